@@ -0,0 +1,298 @@
+/*
+  Throughput benchmarks for mdgcm run against generated discs, so no game data is needed.
+*/
+
+#include <chrono>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+
+#include <boost/filesystem.hpp>
+
+#include "gcm.h"
+#include "synthetic.h"
+
+namespace fs = boost::filesystem;
+
+void usage()
+{
+  std::cout << "Usage: gcm_bench <Command> [Options] <Path>";
+  std::cout << R"DOC(
+    <Command>: "run" or "generate"
+    <Path>   : Run: Work directory for the generated tree, disc and extracted copy
+               Generate: Output path of the generated disc
+    [Options]:
+      --files N         : Number of files (default: 1000)
+      --dirs N          : Number of directories (default: 50)
+      --depth N         : Deepest a directory may be nested (default: 4)
+      --min-size SIZE   : Smallest file, e.g. 256 or 4K (default: 256)
+      --max-size SIZE   : Largest file, e.g. 64K or 8M (default: 64K)
+      --uniform         : Pick sizes evenly across the range instead of across orders of magnitude
+      --seed N          : Seed for the generated tree (default: 1)
+      --iterations N    : Times to repeat the FST benchmarks (default: 20)
+      --jobs N, -j N    : Worker threads used by extract (default: core count)
+    Examples:
+      gcm_bench run --files 20000 --max-size 1M bench_dir
+      gcm_bench generate --files 500 --depth 8 synthetic.gcm
+  )DOC" << std::endl;
+}
+
+//  Silences std::cout while the commands being timed print their progress
+struct Quiet
+{
+  Quiet() : m_old(std::cout.rdbuf(nullptr)) {}
+  ~Quiet()
+  {
+    std::cout.rdbuf(m_old);
+  }
+private:
+  std::streambuf *m_old;
+};
+
+/*
+  Summary:
+    Runs a function a number of times with std::cout silenced
+
+  Returns:
+    The average time of one run in seconds
+*/
+double time_it(uint32_t iterations, std::function<void()> func)
+{
+  Quiet quiet;
+  auto start = std::chrono::steady_clock::now();
+
+  for (uint32_t i = 0; i < iterations; i++)
+  {
+    func();
+  }
+
+  std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+  return elapsed.count() / iterations;
+}
+
+//  Prints one result row. Rates that do not apply are given as zero and shown as "-".
+void report(std::string name, double seconds, uint64_t bytes, uint64_t entries)
+{
+  auto rate = [seconds](double amount) -> std::string
+  {
+    if (amount <= 0 || seconds <= 0)
+    {
+      return "-";
+    }
+
+    std::ostringstream out;
+    out << std::fixed << std::setprecision(1) << amount / seconds;
+    return out.str();
+  };
+
+  std::cout << std::left << std::setw(18) << name << std::right
+            << std::setw(12) << std::fixed << std::setprecision(3) << seconds * 1000.0
+            << std::setw(12) << rate(bytes / 1048576.0)
+            << std::setw(16) << rate(static_cast<double>(entries)) << std::endl;
+}
+
+/*
+  Summary:
+    Generates a disc and times each stage of working with it
+
+  Parameters:
+    work: Directory that receives the generated tree, the disc and the extracted copy
+    synthetic: Shape of the generated disc
+    options: Settings passed to build and extract
+    iterations: Times to repeat the FST benchmarks
+*/
+void run(std::string work, const bench::SyntheticOptions& synthetic, const gcm::Options& options, uint32_t iterations)
+{
+  std::string root = work + "/root";
+  std::string disc = work + "/bench.gcm";
+  std::string out = work + "/extracted";
+
+  fs::create_directories(work);
+
+  std::cout << "Generating " << synthetic.files << " files in " << synthetic.dirs << " directories" << std::endl;
+  bench::SyntheticStats stats = bench::generate_root(root, synthetic);
+  std::cout << "Generated " << stats.bytes / 1048576.0 << " MB of file data" << std::endl << std::endl;
+
+  std::cout << std::left << std::setw(18) << "benchmark" << std::right
+            << std::setw(12) << "ms" << std::setw(12) << "MB/s" << std::setw(16) << "entries/s" << std::endl;
+
+  uint64_t entries = stats.files + stats.dirs + 1;
+
+  //  FST construction walks files/ and lays out every entry
+  double seconds = time_it(iterations, [&]()
+  {
+    fst::FST table(root + "/files/", 0x10000);
+  });
+  report("fst construct", seconds, 0, entries);
+
+  gcm::Options build_options = options;
+  build_options.full = true;
+
+  seconds = time_it(1, [&]()
+  {
+    gcm::build(root, disc, build_options);
+  });
+
+  uint64_t disc_size = fs::file_size(disc);
+  report("build", seconds, disc_size, entries);
+
+  gcm::DiscReader reader(disc);
+  gcm::Header header(reader);
+  auto raw_fst = reader.view(header.fst_offset(), header.fst_size());
+
+  seconds = time_it(iterations, [&]()
+  {
+    fst::FST table(raw_fst);
+  });
+  report("fst parse", seconds, raw_fst.size(), entries);
+
+  seconds = time_it(iterations, [&]()
+  {
+    gcm::files(disc);
+  });
+  report("files", seconds, 0, stats.files);
+
+  fs::remove_all(out);
+
+  seconds = time_it(1, [&]()
+  {
+    gcm::extract(disc, out, options);
+  });
+  report("extract", seconds, stats.bytes, stats.files);
+}
+
+/*
+  Summary:
+    Reads the options shared by both commands
+
+  Returns:
+    False if an option was not recognized or was missing its value
+*/
+bool parse_args(int argc, char *argv[], std::vector<std::string>& args, bench::SyntheticOptions& synthetic, gcm::Options& options, uint32_t& iterations)
+{
+  for (int i = 0; i < argc; i++)
+  {
+    std::string arg(argv[i]);
+
+    if (arg == "--uniform")
+    {
+      synthetic.log_sizes = false;
+      continue;
+    }
+
+    if (arg.size() < 2 || arg[0] != '-')
+    {
+      args.push_back(arg);
+      continue;
+    }
+
+    if (i + 1 >= argc)
+    {
+      return false;
+    }
+
+    std::string value(argv[++i]);
+
+    if (arg == "--files")
+    {
+      synthetic.files = util::to_int32(value);
+    }
+    else if (arg == "--dirs")
+    {
+      synthetic.dirs = util::to_int32(value);
+    }
+    else if (arg == "--depth")
+    {
+      synthetic.depth = util::to_int32(value);
+    }
+    else if (arg == "--min-size")
+    {
+      synthetic.min_size = util::parse_size(value);
+    }
+    else if (arg == "--max-size")
+    {
+      synthetic.max_size = util::parse_size(value);
+    }
+    else if (arg == "--seed")
+    {
+      synthetic.seed = util::to_int32(value);
+    }
+    else if (arg == "--iterations")
+    {
+      iterations = std::max<uint32_t>(util::to_int32(value), 1);
+    }
+    else if (arg == "--jobs" || arg == "-j")
+    {
+      options.jobs = util::to_int32(value);
+
+      if (options.jobs == 0)
+      {
+        return false;
+      }
+    }
+    else
+    {
+      std::cout << "Unknown option: " << arg << std::endl;
+      return false;
+    }
+  }
+
+  return true;
+}
+
+int main(int argc, char *argv[])
+{
+  if (argc < 2)
+  {
+    usage();
+    exit(EXIT_FAILURE);
+  }
+
+  try
+  {
+    std::string cmd(argv[1]);
+    std::vector<std::string> args;
+    bench::SyntheticOptions synthetic;
+    gcm::Options options;
+    uint32_t iterations = 20;
+
+    if (!parse_args(argc - 2, argv + 2, args, synthetic, options, iterations) || args.size() != 1)
+    {
+      usage();
+      exit(EXIT_FAILURE);
+    }
+
+    if (cmd == "run")
+    {
+      run(args[0], synthetic, options, iterations);
+    }
+    else if (cmd == "generate")
+    {
+      std::string root = args[0] + ".root";
+      bench::SyntheticStats stats;
+
+      {
+        Quiet quiet;
+        stats = bench::generate_disc(args[0], root, synthetic);
+      }
+
+      //  The source tree and manifest are only needed to build the disc
+      fs::remove_all(root);
+      fs::remove(gcm::Manifest::path_for(args[0]));
+      std::cout << "Wrote " << args[0] << " with " << stats.files << " files in " << stats.dirs << " directories" << std::endl;
+    }
+    else
+    {
+      std::cout << "Invalid command: " << cmd << std::endl;
+      usage();
+      exit(EXIT_FAILURE);
+    }
+  }
+  catch (const std::exception& e)
+  {
+    std::cout << "Error: " << e.what() << std::endl;
+    exit(EXIT_FAILURE);
+  }
+
+  return EXIT_SUCCESS;
+}
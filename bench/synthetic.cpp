@@ -0,0 +1,224 @@
+#include "synthetic.h"
+
+#include <cmath>
+#include <fstream>
+#include <random>
+#include <stdexcept>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+
+#include "gcm.h"
+
+namespace fs = boost::filesystem;
+
+namespace bench
+{
+  namespace
+  {
+    const uint32_t HeaderSize = 0x440;
+    const uint32_t Bi2Size = 0x2000;
+    const uint32_t ApploaderSize = 0x2000;
+    const uint32_t DolHeaderSize = 0x100;
+
+    void save(std::string filename, const std::vector<uint8_t>& data)
+    {
+      std::ofstream out(filename, std::ios::binary | std::ios::trunc);
+      out.write(reinterpret_cast<const char *>(data.data()), data.size());
+
+      if (!out)
+      {
+        throw std::runtime_error("Could not write " + filename);
+      }
+    }
+
+    //  Writes count bytes of seeded noise so files do not compress or dedupe away
+    void save_noise(std::string filename, uint64_t count, std::mt19937_64& rng)
+    {
+      std::ofstream out(filename, std::ios::binary | std::ios::trunc);
+      std::vector<uint64_t> chunk(0x20000);
+
+      while (count > 0)
+      {
+        size_t bytes = static_cast<size_t>(std::min<uint64_t>(count, chunk.size() * sizeof(uint64_t)));
+
+        for (size_t i = 0; i < (bytes + 7) / 8; i++)
+        {
+          chunk[i] = rng();
+        }
+
+        out.write(reinterpret_cast<const char *>(chunk.data()), bytes);
+        count -= bytes;
+      }
+
+      if (!out)
+      {
+        throw std::runtime_error("Could not write " + filename);
+      }
+    }
+
+    //  Disc header with a game code, the magic word and a name. Offsets are filled in by gcm::build.
+    std::vector<uint8_t> make_header()
+    {
+      std::vector<uint8_t> data(HeaderSize, 0);
+      std::string id = "GBNE01";
+      std::string name = "mdgcm synthetic disc";
+
+      std::copy(id.begin(), id.end(), data.begin() + gcm::Header::Offset::ConsoleID);
+      util::write_big<uint32_t>(data, gcm::Header::Offset::MagicWord, 0xC2339F3D);
+      std::copy(name.begin(), name.end(), data.begin() + gcm::Header::Offset::Name);
+
+      return data;
+    }
+
+    std::vector<uint8_t> make_bi2()
+    {
+      std::vector<uint8_t> data(Bi2Size, 0);
+
+      util::write_big<uint32_t>(data, 0x04, 0x01800000);  //  Simulated memory size
+      util::write_big<uint32_t>(data, 0x18, 1);           //  Region (USA)
+
+      return data;
+    }
+
+    //  Apploader whose code size makes the whole file exactly ApploaderSize bytes
+    std::vector<uint8_t> make_apploader()
+    {
+      std::vector<uint8_t> data(ApploaderSize, 0);
+      std::string date = "2014/07/19";
+
+      std::copy(date.begin(), date.end(), data.begin());
+      util::write_big<uint32_t>(data, 0x10, 0x81200000);            //  Entry point
+      util::write_big<uint32_t>(data, 0x14, ApploaderSize - 0x20);  //  Code size
+      util::write_big<uint32_t>(data, 0x18, 0);                     //  Trailer size
+
+      return data;
+    }
+
+    //  DOL with a single text section loaded right after the exception vectors
+    std::vector<uint8_t> make_dol(uint32_t text_size, std::mt19937_64& rng)
+    {
+      std::vector<uint8_t> data(DolHeaderSize + text_size, 0);
+
+      util::write_big<uint32_t>(data, 0x00, DolHeaderSize);  //  Text section 0 file offset
+      util::write_big<uint32_t>(data, 0x48, 0x80003100);     //  Text section 0 load address
+      util::write_big<uint32_t>(data, 0x90, text_size);      //  Text section 0 size
+      util::write_big<uint32_t>(data, 0xE0, 0x80003100);     //  Entry point
+
+      for (uint32_t i = DolHeaderSize; i < data.size(); i++)
+      {
+        data[i] = static_cast<uint8_t>(rng());
+      }
+
+      return data;
+    }
+  }
+
+  /*
+    Summary:
+      Creates a directory laid out the way gcm::extract leaves it, with sys/ holding a valid
+      header, bi2, apploader and DOL, and files/ holding a random tree shaped by options.
+      Anything already in root is removed first.
+
+    Parameters:
+      root: Directory to create
+      options: Number of files and directories, nesting depth and file sizes
+
+    Returns:
+      Totals for the generated files/ tree
+  */
+  SyntheticStats generate_root(std::string root, const SyntheticOptions& options)
+  {
+    if (options.min_size > options.max_size)
+    {
+      throw std::invalid_argument("Minimum file size is larger than the maximum");
+    }
+
+    std::mt19937_64 rng(options.seed);
+    SyntheticStats stats;
+
+    std::string syspath = root + "/sys/";
+    std::string filepath = root + "/files/";
+
+    fs::remove_all(root);
+    fs::create_directories(syspath);
+    fs::create_directories(filepath);
+
+    save(syspath + "header.bin", make_header());
+    save(syspath + "bi2.bin", make_bi2());
+    save(syspath + "apploader.bin", make_apploader());
+    save(syspath + "main.dol", make_dol(options.dol_size, rng));
+
+    //  An FST holding only the root. gcm::build generates the real one.
+    std::vector<uint8_t> fst(fst::NodeSize, 0);
+    util::write_big<uint32_t>(fst, 0, 0x01000000);
+    util::write_big<uint32_t>(fst, 8, 1);
+    save(syspath + "fst.bin", fst);
+
+    //  Each directory picks a random parent that is not already at the deepest level
+    std::vector<std::pair<std::string, uint32_t>> dirs = { std::make_pair(filepath, 0) };
+
+    for (uint32_t i = 0; i < options.dirs; i++)
+    {
+      auto parent = dirs[rng() % dirs.size()];
+
+      if (parent.second >= options.depth)
+      {
+        parent = dirs[0];
+      }
+
+      std::string path = parent.first + "dir" + std::to_string(i) + "/";
+      fs::create_directories(path);
+      dirs.push_back(std::make_pair(path, parent.second + 1));
+      stats.dirs++;
+    }
+
+    std::uniform_int_distribution<uint64_t> uniform(options.min_size, options.max_size);
+    std::uniform_real_distribution<double> exponent(std::log(static_cast<double>(std::max<uint64_t>(options.min_size, 1))),
+                                                    std::log(static_cast<double>(std::max<uint64_t>(options.max_size, 1))));
+
+    for (uint32_t i = 0; i < options.files; i++)
+    {
+      uint64_t size = options.log_sizes ? static_cast<uint64_t>(std::exp(exponent(rng))) : uniform(rng);
+      size = std::clamp(size, options.min_size, options.max_size);
+
+      std::string path = dirs[rng() % dirs.size()].first + "file" + std::to_string(i) + ".bin";
+      save_noise(path, size, rng);
+
+      stats.files++;
+      stats.bytes += size;
+
+      //  File offsets in the FST are 32-bit
+      if (stats.bytes + options.dol_size > 0xF0000000ull)
+      {
+        throw std::invalid_argument("Generated files are too large to fit on a disc");
+      }
+    }
+
+    return stats;
+  }
+
+  /*
+    Summary:
+      Generates a source tree with generate_root and builds it into a disc image
+
+    Parameters:
+      disc: Path of the image to create
+      root: Directory to generate the source tree in
+      options: Shape of the generated tree
+
+    Returns:
+      Totals for the generated files/ tree
+  */
+  SyntheticStats generate_disc(std::string disc, std::string root, const SyntheticOptions& options)
+  {
+    SyntheticStats stats = generate_root(root, options);
+
+    gcm::Options build_options;
+    build_options.full = true;
+
+    gcm::build(root, disc, build_options);
+
+    return stats;
+  }
+}
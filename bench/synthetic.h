@@ -0,0 +1,34 @@
+#ifndef _SYNTHETIC_H
+#define _SYNTHETIC_H
+
+#include <cstdint>
+#include <string>
+
+namespace bench
+{
+  //  Shape of a generated disc
+  struct SyntheticOptions
+  {
+    uint32_t files = 1000;        //  Number of files under ./files
+    uint32_t dirs = 50;           //  Number of directories under ./files
+    uint32_t depth = 4;           //  Deepest a directory may be nested
+    uint64_t min_size = 0x100;    //  Smallest file size
+    uint64_t max_size = 0x10000;  //  Largest file size
+    bool log_sizes = true;        //  Spread sizes evenly across orders of magnitude instead of evenly across the range
+    uint32_t dol_size = 0x40000;  //  Size of the DOL text section
+    uint64_t seed = 1;            //  Seed so the same options always give the same disc
+  };
+
+  //  Totals for a generated tree
+  struct SyntheticStats
+  {
+    uint32_t files = 0;
+    uint32_t dirs = 0;
+    uint64_t bytes = 0;
+  };
+
+  SyntheticStats generate_root(std::string root, const SyntheticOptions& options);
+  SyntheticStats generate_disc(std::string disc, std::string root, const SyntheticOptions& options);
+}
+
+#endif
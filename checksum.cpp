@@ -0,0 +1,511 @@
+#include "checksum.h"
+#include "stats.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iomanip>
+#include <sstream>
+#include <stdexcept>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <zlib.h>
+
+//  SHA-1 can use the x86 SHA extensions. They are compiled in with GCC and Clang and only
+//  used if the CPU running the program has them.
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define CHECKSUM_SHA_NI
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+namespace util
+{
+  namespace
+  {
+    //  Sine constants of the MD5 rounds
+    const uint32_t Md5Constants[64] =
+    {
+      0xD76AA478, 0xE8C7B756, 0x242070DB, 0xC1BDCEEE,
+      0xF57C0FAF, 0x4787C62A, 0xA8304613, 0xFD469501,
+      0x698098D8, 0x8B44F7AF, 0xFFFF5BB1, 0x895CD7BE,
+      0x6B901122, 0xFD987193, 0xA679438E, 0x49B40821,
+      0xF61E2562, 0xC040B340, 0x265E5A51, 0xE9B6C7AA,
+      0xD62F105D, 0x02441453, 0xD8A1E681, 0xE7D3FBC8,
+      0x21E1CDE6, 0xC33707D6, 0xF4D50D87, 0x455A14ED,
+      0xA9E3E905, 0xFCEFA3F8, 0x676F02D9, 0x8D2A4C8A,
+      0xFFFA3942, 0x8771F681, 0x6D9D6122, 0xFDE5380C,
+      0xA4BEEA44, 0x4BDECFA9, 0xF6BB4B60, 0xBEBFBC70,
+      0x289B7EC6, 0xEAA127FA, 0xD4EF3085, 0x04881D05,
+      0xD9D4D039, 0xE6DB99E5, 0x1FA27CF8, 0xC4AC5665,
+      0xF4292244, 0x432AFF97, 0xAB9423A7, 0xFC93A039,
+      0x655B59C3, 0x8F0CCC92, 0xFFEFF47D, 0x85845DD1,
+      0x6FA87E4F, 0xFE2CE6E0, 0xA3014314, 0x4E0811A1,
+      0xF7537E82, 0xBD3AF235, 0x2AD7D2BB, 0xEB86D391
+    };
+
+    //  Data is fed to every hash in pieces small enough to still be in cache for the second
+    const size_t ChecksumChunk = 0x10000;
+
+    inline uint32_t rotl(uint32_t x, int n)
+    {
+      return (x << n) | (x >> (32 - n));
+    }
+
+    void sha1_blocks_portable(uint32_t *state, const uint8_t *data, size_t blocks)
+    {
+      for (; blocks > 0; blocks--, data += 64)
+      {
+        uint32_t w[80];
+
+        for (int i = 0; i < 16; i++)
+        {
+          w[i] = (static_cast<uint32_t>(data[i * 4]) << 24) | (data[i * 4 + 1] << 16) | (data[i * 4 + 2] << 8) | data[i * 4 + 3];
+        }
+
+        for (int i = 16; i < 80; i++)
+        {
+          w[i] = rotl(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+        }
+
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3], e = state[4];
+
+        //  One loop per round function so none of them has to branch
+        auto round = [&](uint32_t f, uint32_t k, uint32_t w)
+        {
+          uint32_t temp = rotl(a, 5) + f + e + k + w;
+          e = d;
+          d = c;
+          c = rotl(b, 30);
+          b = a;
+          a = temp;
+        };
+
+        for (int i = 0; i < 20; i++)
+        {
+          round((b & c) | (~b & d), 0x5A827999, w[i]);
+        }
+
+        for (int i = 20; i < 40; i++)
+        {
+          round(b ^ c ^ d, 0x6ED9EBA1, w[i]);
+        }
+
+        for (int i = 40; i < 60; i++)
+        {
+          round((b & c) | (b & d) | (c & d), 0x8F1BBCDC, w[i]);
+        }
+
+        for (int i = 60; i < 80; i++)
+        {
+          round(b ^ c ^ d, 0xCA62C1D6, w[i]);
+        }
+
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+      }
+    }
+
+    /*
+      Summary:
+        One of the four MD5 rounds of 16 steps. Each step rotates a different one of a, b, c
+        and d, so four steps are unrolled per loop and the shifts S0 to S3 stay constants.
+
+      Parameters:
+        a, b, c, d: State being hashed
+        m: Words of the block
+        first: Index of the round's first step, 0, 16, 32 or 48
+        f: Round function of three words
+        g: Index of the word used by a step
+    */
+    template <int S0, int S1, int S2, int S3, typename F, typename G>
+    inline void md5_round(uint32_t& a, uint32_t& b, uint32_t& c, uint32_t& d, const uint32_t *m, int first, F f, G g)
+    {
+      for (int i = first; i < first + 16; i += 4)
+      {
+        a = b + rotl(a + f(b, c, d) + Md5Constants[i] + m[g(i)], S0);
+        d = a + rotl(d + f(a, b, c) + Md5Constants[i + 1] + m[g(i + 1)], S1);
+        c = d + rotl(c + f(d, a, b) + Md5Constants[i + 2] + m[g(i + 2)], S2);
+        b = c + rotl(b + f(c, d, a) + Md5Constants[i + 3] + m[g(i + 3)], S3);
+      }
+    }
+
+    void md5_blocks(uint32_t *state, const uint8_t *data, size_t blocks)
+    {
+      for (; blocks > 0; blocks--, data += 64)
+      {
+        uint32_t m[16];
+
+        for (int i = 0; i < 16; i++)
+        {
+          m[i] = data[i * 4] | (data[i * 4 + 1] << 8) | (data[i * 4 + 2] << 16) | (static_cast<uint32_t>(data[i * 4 + 3]) << 24);
+        }
+
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+
+        md5_round<7, 12, 17, 22>(a, b, c, d, m, 0, [](uint32_t x, uint32_t y, uint32_t z) { return (x & y) | (~x & z); },
+                                 [](int i) { return i; });
+        md5_round<5, 9, 14, 20>(a, b, c, d, m, 16, [](uint32_t x, uint32_t y, uint32_t z) { return (z & x) | (~z & y); },
+                                [](int i) { return (5 * i + 1) % 16; });
+        md5_round<4, 11, 16, 23>(a, b, c, d, m, 32, [](uint32_t x, uint32_t y, uint32_t z) { return x ^ y ^ z; },
+                                 [](int i) { return (3 * i + 5) % 16; });
+        md5_round<6, 10, 15, 21>(a, b, c, d, m, 48, [](uint32_t x, uint32_t y, uint32_t z) { return y ^ (x | ~z); },
+                                 [](int i) { return (7 * i) % 16; });
+
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+      }
+    }
+
+#ifdef CHECKSUM_SHA_NI
+    //  Groups G to 19 of four SHA-1 rounds with the SHA extensions. Group G uses msg[G % 4] and
+    //  also advances the message schedule for the groups after it. G is a template argument so
+    //  every group is unrolled and the schedule stays in registers.
+    template <int G>
+    __attribute__((target("sha,sse4.1"))) inline void sha1_ni_groups(__m128i& abcd, __m128i& e, __m128i& prev, __m128i *msg)
+    {
+      e = G == 0 ? _mm_add_epi32(e, msg[0]) : _mm_sha1nexte_epu32(prev, msg[G % 4]);
+      prev = abcd;
+
+      if constexpr (G >= 3)
+      {
+        msg[(G + 1) % 4] = _mm_sha1msg2_epu32(msg[(G + 1) % 4], msg[G % 4]);
+      }
+
+      abcd = _mm_sha1rnds4_epu32(abcd, e, G / 5);
+
+      if constexpr (G >= 1)
+      {
+        msg[(G + 3) % 4] = _mm_sha1msg1_epu32(msg[(G + 3) % 4], msg[G % 4]);
+      }
+
+      if constexpr (G >= 2)
+      {
+        msg[(G + 2) % 4] = _mm_xor_si128(msg[(G + 2) % 4], msg[G % 4]);
+      }
+
+      if constexpr (G < 19)
+      {
+        sha1_ni_groups<G + 1>(abcd, e, prev, msg);
+      }
+    }
+
+    __attribute__((target("sha,sse4.1"))) void sha1_blocks_ni(uint32_t *state, const uint8_t *data, size_t blocks)
+    {
+      const __m128i swap = _mm_set_epi64x(0x0001020304050607ll, 0x08090A0B0C0D0E0Fll);
+
+      __m128i abcd = _mm_shuffle_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i *>(state)), 0x1B);
+      __m128i e = _mm_set_epi32(state[4], 0, 0, 0);
+
+      for (; blocks > 0; blocks--, data += 64)
+      {
+        __m128i abcd_start = abcd;
+        __m128i e_start = e;
+        __m128i prev = abcd;
+        __m128i msg[4];
+
+        for (int i = 0; i < 4; i++)
+        {
+          msg[i] = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i * 16)), swap);
+        }
+
+        sha1_ni_groups<0>(abcd, e, prev, msg);
+
+        e = _mm_sha1nexte_epu32(prev, e_start);
+        abcd = _mm_add_epi32(abcd, abcd_start);
+      }
+
+      _mm_storeu_si128(reinterpret_cast<__m128i *>(state), _mm_shuffle_epi32(abcd, 0x1B));
+      state[4] = static_cast<uint32_t>(_mm_extract_epi32(e, 3));
+    }
+
+    //  SHA extensions need SSSE3 and SSE4.1 as well for the shuffles around them
+    bool has_sha_ni()
+    {
+      unsigned int eax, ebx, ecx, edx;
+
+      if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(ecx & bit_SSSE3) || !(ecx & bit_SSE4_1))
+      {
+        return false;
+      }
+
+      return __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) && (ebx & bit_SHA);
+    }
+
+    const bool UseShaNi = has_sha_ni();
+#endif
+
+    //  Picks the SHA extensions when the CPU has them
+    void transform_blocks(uint32_t *state, const uint8_t *data, size_t blocks)
+    {
+#ifdef CHECKSUM_SHA_NI
+      if (UseShaNi)
+      {
+        sha1_blocks_ni(state, data, blocks);
+        return;
+      }
+#endif
+
+      sha1_blocks_portable(state, data, blocks);
+    }
+
+    /*
+      Summary:
+        Feeds data to a hash that works on 64 byte blocks. A partly filled block is kept until
+        the rest of it arrives, and whole blocks are hashed straight from the input.
+
+      Parameters:
+        block: Partly filled block left by the last update
+        length: Bytes hashed so far, advanced by the size of data
+        data: Data to hash
+        transform: Hashes a run of whole blocks
+    */
+    template <typename Transform>
+    void update_blocks(std::array<uint8_t, 64>& block, uint64_t& length, std::span<const uint8_t> data, Transform transform)
+    {
+      const uint8_t *p = data.data();
+      size_t count = data.size();
+      size_t used = length % 64;
+
+      length += count;
+
+      //  Finish a partly filled block first
+      if (used > 0)
+      {
+        size_t take = std::min(count, 64 - used);
+        memcpy(&block[used], p, take);
+        p += take;
+        count -= take;
+
+        if (used + take < 64)
+        {
+          return;
+        }
+
+        transform(block.data(), 1);
+      }
+
+      size_t blocks = count / 64;
+
+      if (blocks > 0)
+      {
+        transform(p, blocks);
+        p += blocks * 64;
+        count -= blocks * 64;
+      }
+
+      memcpy(block.data(), p, count);
+    }
+
+    /*
+      Summary:
+        Builds the padding MD5 and SHA-1 both end with: a one bit, zeros up to 56 bytes into a
+        block, then the length in bits
+
+      Parameters:
+        length: Bytes hashed
+        big_endian: Whether the length is stored big endian, as SHA-1 does, or little endian
+        pad: Receives the padding
+
+      Returns:
+        Size of the padding in bytes
+    */
+    size_t padding(uint64_t length, bool big_endian, uint8_t (&pad)[72])
+    {
+      uint64_t bits = length * 8;
+      size_t used = length % 64;
+      size_t count = (used < 56 ? 56 : 120) - used;
+
+      memset(pad, 0, sizeof(pad));
+      pad[0] = 0x80;
+
+      for (int i = 0; i < 8; i++)
+      {
+        pad[count + i] = static_cast<uint8_t>(bits >> (big_endian ? 56 - i * 8 : i * 8));
+      }
+
+      return count + 8;
+    }
+
+    std::string to_hex(const uint8_t *data, size_t count)
+    {
+      std::ostringstream out;
+
+      for (size_t i = 0; i < count; i++)
+      {
+        out << std::hex << std::setw(2) << std::setfill('0') << static_cast<int>(data[i]);
+      }
+
+      return out.str();
+    }
+  }
+
+  void Crc32::update(std::span<const uint8_t> data)
+  {
+    m_crc = crc32_z(m_crc, data.data(), data.size());
+  }
+
+  Md5::Md5() : m_state({ 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476 }), m_block(), m_length(0)
+  {
+  }
+
+  void Md5::update(std::span<const uint8_t> data)
+  {
+    update_blocks(m_block, m_length, data, [this](const uint8_t *blocks, size_t count)
+    {
+      md5_blocks(m_state.data(), blocks, count);
+    });
+  }
+
+  std::array<uint8_t, 16> Md5::digest() const
+  {
+    Md5 copy = *this;
+    uint8_t pad[72];
+
+    copy.update(std::span<const uint8_t>(pad, padding(m_length, false, pad)));
+
+    std::array<uint8_t, 16> ret;
+
+    for (int i = 0; i < 4; i++)
+    {
+      for (int j = 0; j < 4; j++)
+      {
+        ret[i * 4 + j] = static_cast<uint8_t>(copy.m_state[i] >> (j * 8));
+      }
+    }
+
+    return ret;
+  }
+
+  //  Digest as 32 lowercase hex digits
+  std::string Md5::hex() const
+  {
+    auto value = digest();
+    return to_hex(value.data(), value.size());
+  }
+
+  Sha1::Sha1() : m_state({ 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 }), m_block(), m_length(0)
+  {
+  }
+
+  void Sha1::update(std::span<const uint8_t> data)
+  {
+    update_blocks(m_block, m_length, data, [this](const uint8_t *blocks, size_t count)
+    {
+      transform_blocks(m_state.data(), blocks, count);
+    });
+  }
+
+  std::array<uint8_t, 20> Sha1::digest() const
+  {
+    Sha1 copy = *this;
+    uint8_t pad[72];
+
+    copy.update(std::span<const uint8_t>(pad, padding(m_length, true, pad)));
+
+    std::array<uint8_t, 20> ret;
+
+    for (int i = 0; i < 5; i++)
+    {
+      for (int j = 0; j < 4; j++)
+      {
+        ret[i * 4 + j] = static_cast<uint8_t>(copy.m_state[i] >> (24 - j * 8));
+      }
+    }
+
+    return ret;
+  }
+
+  //  Digest as 40 lowercase hex digits
+  std::string Sha1::hex() const
+  {
+    auto value = digest();
+    return to_hex(value.data(), value.size());
+  }
+
+  void Checksum::update(std::span<const uint8_t> data)
+  {
+    size += data.size();
+
+    for (size_t done = 0; done < data.size(); done += ChecksumChunk)
+    {
+      auto chunk = data.subspan(done, std::min(ChecksumChunk, data.size() - done));
+      m_crc.update(chunk);
+      m_md5.update(chunk);
+      m_sha1.update(chunk);
+    }
+  }
+
+  std::string Checksum::crc32() const
+  {
+    std::ostringstream out;
+    out << std::hex << std::setw(8) << std::setfill('0') << m_crc.value();
+    return out.str();
+  }
+
+  std::string Checksum::md5() const
+  {
+    return m_md5.hex();
+  }
+
+  std::string Checksum::sha1() const
+  {
+    return m_sha1.hex();
+  }
+
+  /*
+    Summary:
+      Computes the CRC-32, MD5 and SHA-1 of a whole file in one pass
+
+    Parameters:
+      filename: File to read
+      buffer_size: Size of the read buffer
+  */
+  Checksum checksum_file(std::string filename, uint32_t buffer_size)
+  {
+    int fd = open(filename.c_str(), O_RDONLY);
+    stats::add_syscalls(2);  //  open and close
+
+    if (fd < 0)
+    {
+      throw std::runtime_error("Could not open " + filename + ": " + strerror(errno));
+    }
+
+    std::vector<uint8_t> buffer(std::max<uint32_t>(buffer_size, 1));
+    Checksum ret;
+
+    while (true)
+    {
+      ssize_t got = read(fd, &buffer[0], buffer.size());
+      stats::add_read(got > 0 ? got : 0, 1);
+
+      if (got < 0)
+      {
+        if (errno == EINTR)
+        {
+          continue;
+        }
+
+        close(fd);
+        throw std::runtime_error("Could not read " + filename + ": " + strerror(errno));
+      }
+
+      if (got == 0)
+      {
+        break;
+      }
+
+      ret.update(std::span<const uint8_t>(&buffer[0], got));
+    }
+
+    close(fd);
+    return ret;
+  }
+}
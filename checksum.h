@@ -0,0 +1,71 @@
+#ifndef _CHECKSUM_H
+#define _CHECKSUM_H
+
+#include <array>
+#include <cstdint>
+#include <span>
+#include <string>
+
+namespace util
+{
+  //  CRC-32 as used by zip and Redump, computed by zlib with whatever acceleration it was built with
+  struct Crc32
+  {
+    Crc32() : m_crc(0) {}
+
+    void update(std::span<const uint8_t> data);
+
+    inline uint32_t value() const
+    {
+      return m_crc;
+    }
+  private:
+    uint32_t m_crc;
+  };
+
+  struct Md5
+  {
+    Md5();
+
+    void update(std::span<const uint8_t> data);
+    std::array<uint8_t, 16> digest() const;
+    std::string hex() const;
+  private:
+    std::array<uint32_t, 4> m_state;
+    std::array<uint8_t, 64> m_block;
+    uint64_t m_length;
+  };
+
+  struct Sha1
+  {
+    Sha1();
+
+    void update(std::span<const uint8_t> data);
+    std::array<uint8_t, 20> digest() const;
+    std::string hex() const;
+  private:
+    std::array<uint32_t, 5> m_state;
+    std::array<uint8_t, 64> m_block;
+    uint64_t m_length;
+  };
+
+  //  CRC-32, MD5 and SHA-1 of the same data, the three Redump lists, computed together so the data is only read once
+  struct Checksum
+  {
+    uint64_t size = 0;
+
+    void update(std::span<const uint8_t> data);
+
+    std::string crc32() const;
+    std::string md5() const;
+    std::string sha1() const;
+  private:
+    Crc32 m_crc;
+    Md5 m_md5;
+    Sha1 m_sha1;
+  };
+
+  Checksum checksum_file(std::string filename, uint32_t buffer_size);
+}
+
+#endif
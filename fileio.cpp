@@ -0,0 +1,309 @@
+#include "fileio.h"
+#include "stats.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+
+namespace util
+{
+  namespace
+  {
+    //  Errors that mean the kernel cannot do the copy for this pair of files, rather than a real I/O failure
+    inline bool unsupported(int error)
+    {
+      return error == ENOSYS || error == EXDEV || error == EINVAL || error == EOPNOTSUPP;
+    }
+
+    inline std::runtime_error io_error(const char *what)
+    {
+      return std::runtime_error(std::string(what) + " failed: " + strerror(errno));
+    }
+
+    uint64_t copy_buffered(int in_fd, uint64_t in_offset, int out_fd, uint64_t out_offset, uint64_t count)
+    {
+      std::vector<uint8_t> buffer(static_cast<size_t>(std::min<uint64_t>(count, CopyBufferSize)));
+      uint64_t done = 0;
+
+      while (done < count)
+      {
+        size_t chunk = static_cast<size_t>(std::min<uint64_t>(count - done, buffer.size()));
+        ssize_t got = pread(in_fd, &buffer[0], chunk, in_offset + done);
+        stats::add_read(got > 0 ? got : 0, 1);
+
+        if (got < 0)
+        {
+          if (errno == EINTR)
+          {
+            continue;
+          }
+
+          throw io_error("pread");
+        }
+
+        if (got == 0)
+        {
+          break;
+        }
+
+        ssize_t put = 0;
+
+        while (put < got)
+        {
+          ssize_t result = pwrite(out_fd, &buffer[put], got - put, out_offset + done + put);
+          stats::add_write(result > 0 ? result : 0, 1);
+
+          if (result < 0)
+          {
+            if (errno == EINTR)
+            {
+              continue;
+            }
+
+            throw io_error("pwrite");
+          }
+
+          put += result;
+        }
+
+        done += got;
+      }
+
+      return done;
+    }
+  }
+
+  /*
+    Summary:
+      Copies a byte range from one file to another without going through user space when possible.
+      Tries copy_file_range first, then sendfile, then falls back to a fixed size buffer.
+
+    Parameters:
+      in_fd: File to read from
+      in_offset: Offset to start reading at
+      out_fd: File to write to
+      out_offset: Offset to start writing at
+      count: Number of bytes to copy
+      shared: Skip sendfile, which moves the file position of out_fd, so other threads can
+              write to out_fd at the same time
+
+    Returns:
+      The number of bytes copied, which is less than count only if the input ends early
+  */
+  uint64_t copy_range(int in_fd, uint64_t in_offset, int out_fd, uint64_t out_offset, uint64_t count, bool shared)
+  {
+    uint64_t done = 0;
+
+#ifdef __linux__
+    bool use_copy_file_range = true;
+
+    while (done < count)
+    {
+      off_t in_pos = static_cast<off_t>(in_offset + done);
+      off_t out_pos = static_cast<off_t>(out_offset + done);
+      size_t chunk = static_cast<size_t>(std::min<uint64_t>(count - done, 0x40000000));
+      ssize_t result;
+
+      if (use_copy_file_range)
+      {
+        result = copy_file_range(in_fd, &in_pos, out_fd, &out_pos, chunk, 0);
+        stats::add_syscalls();
+
+        if (result < 0 && unsupported(errno))
+        {
+          use_copy_file_range = false;
+          continue;
+        }
+      }
+      else
+      {
+        //  sendfile writes at the current position of the output
+        if (shared || lseek(out_fd, out_pos, SEEK_SET) < 0)
+        {
+          break;
+        }
+
+        result = sendfile(out_fd, in_fd, &in_pos, chunk);
+        stats::add_syscalls(2);
+
+        if (result < 0 && unsupported(errno))
+        {
+          break;
+        }
+      }
+
+      if (result < 0)
+      {
+        if (errno == EINTR)
+        {
+          continue;
+        }
+
+        throw io_error(use_copy_file_range ? "copy_file_range" : "sendfile");
+      }
+
+      if (result == 0)
+      {
+        return done;
+      }
+
+      //  The kernel read and wrote the range itself
+      stats::add_read(result);
+      stats::add_write(result);
+      done += result;
+    }
+#endif
+
+    return done + copy_buffered(in_fd, in_offset + done, out_fd, out_offset + done, count - done);
+  }
+
+  /*
+    Summary:
+      Creates (or truncates) a file and fills it with a byte range of another file
+
+    Parameters:
+      in_fd: File to read from
+      in_offset: Offset to start reading at
+      count: Number of bytes to copy
+      filename: Path of the file to create
+  */
+  void copy_to_file(int in_fd, uint64_t in_offset, uint64_t count, std::string filename)
+  {
+    int out_fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    stats::add_syscalls(2);  //  open and close
+
+    if (out_fd < 0)
+    {
+      throw std::runtime_error("Could not create " + filename + ": " + strerror(errno));
+    }
+
+    try
+    {
+      copy_range(in_fd, in_offset, out_fd, 0, count);
+    }
+    catch (...)
+    {
+      close(out_fd);
+      throw;
+    }
+
+    close(out_fd);
+  }
+
+  /*
+    Summary:
+      Writes data to a new file one piece at a time, folding each piece into a checksum just
+      before it is written so the data only has to be brought into cache once
+
+    Parameters:
+      filename: Path of the file to create
+      data: Data to write, usually a view of a mapped disc
+      checksum: Checksum to update with the data
+      buffer_size: Number of bytes checksummed and written per call
+  */
+  void write_checksummed(std::string filename, std::span<const uint8_t> data, Checksum& checksum, uint32_t buffer_size)
+  {
+    int out_fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    stats::add_syscalls(2);  //  open and close
+
+    if (out_fd < 0)
+    {
+      throw std::runtime_error("Could not create " + filename + ": " + strerror(errno));
+    }
+
+    size_t step = std::max<uint32_t>(buffer_size, 1);
+    size_t done = 0;
+
+    while (done < data.size())
+    {
+      auto piece = data.subspan(done, std::min(step, data.size() - done));
+      checksum.update(piece);
+
+      size_t put = 0;
+
+      while (put < piece.size())
+      {
+        ssize_t result = write(out_fd, piece.data() + put, piece.size() - put);
+        stats::add_write(result > 0 ? result : 0, 1);
+
+        if (result < 0)
+        {
+          if (errno == EINTR)
+          {
+            continue;
+          }
+
+          close(out_fd);
+          throw io_error("write");
+        }
+
+        put += result;
+      }
+
+      done += piece.size();
+    }
+
+    close(out_fd);
+  }
+
+  /*
+    Summary:
+      Hashes the whole contents of a file with hash_bytes, reading it one buffer at a time
+
+    Parameters:
+      filename: File to hash
+      buffer_size: Size of the read buffer
+
+    Returns:
+      The hash of the file contents
+  */
+  uint64_t hash_file(std::string filename, uint32_t buffer_size)
+  {
+    int fd = open(filename.c_str(), O_RDONLY);
+    stats::add_syscalls(2);  //  open and close
+
+    if (fd < 0)
+    {
+      throw std::runtime_error("Could not open " + filename + ": " + strerror(errno));
+    }
+
+    std::vector<uint8_t> buffer(std::max<uint32_t>(buffer_size, 1));
+    uint64_t hash = HashSeed;
+
+    while (true)
+    {
+      ssize_t got = read(fd, &buffer[0], buffer.size());
+      stats::add_read(got > 0 ? got : 0, 1);
+
+      if (got < 0)
+      {
+        if (errno == EINTR)
+        {
+          continue;
+        }
+
+        close(fd);
+        throw io_error("read");
+      }
+
+      if (got == 0)
+      {
+        break;
+      }
+
+      hash = hash_bytes(hash, &buffer[0], got);
+    }
+
+    close(fd);
+    return hash;
+  }
+}
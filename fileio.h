@@ -0,0 +1,35 @@
+#ifndef _FILEIO_H
+#define _FILEIO_H
+
+#include <cstdint>
+#include <span>
+#include <string>
+
+#include "checksum.h"
+
+namespace util
+{
+  //  Size of the buffer used when data has to be copied through user space
+  const uint32_t CopyBufferSize = 0x100000;
+
+  //  Starting value for hash_bytes
+  const uint64_t HashSeed = 0xCBF29CE484222325ull;
+
+  //  Folds a block of data into a running 64-bit FNV-1a hash
+  inline uint64_t hash_bytes(uint64_t hash, const uint8_t *data, size_t count)
+  {
+    for (size_t i = 0; i < count; i++)
+    {
+      hash = (hash ^ data[i]) * 0x100000001B3ull;
+    }
+
+    return hash;
+  }
+
+  uint64_t hash_file(std::string filename, uint32_t buffer_size = CopyBufferSize);
+  uint64_t copy_range(int in_fd, uint64_t in_offset, int out_fd, uint64_t out_offset, uint64_t count, bool shared = false);
+  void copy_to_file(int in_fd, uint64_t in_offset, uint64_t count, std::string filename);
+  void write_checksummed(std::string filename, std::span<const uint8_t> data, Checksum& checksum, uint32_t buffer_size = CopyBufferSize);
+}
+
+#endif
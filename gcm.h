@@ -10,23 +10,85 @@
 #include <boost/filesystem.hpp>
 
 #include "util.h"
+#include "pool.h"
+#include "uring.h"
+#include "stats.h"
+#include "logging.h"
 
+#include "gcm_reader.h"
+#include "gcm_writer.h"
+#include "gcm_gcz.h"
+#include "gcm_manifest.h"
+#include "gcm_layout.h"
+#include "gcm_checksums.h"
+#include "gcm_batch.h"
+#include "gcm_store.h"
+#include "gcm_tar.h"
+#include "gcm_patch.h"
 #include "gcm_header.h"
 #include "gcm_fst.h"
+#include "gcm_disc.h"
+#include "gcm_builder.h"
 
 namespace gcm
 {
+  //  Settings shared by the commands that can be changed from the command line
+  struct Options
+  {
+    uint32_t jobs = util::ThreadPool::default_threads();  //  Number of worker threads used to copy file data
+    uint32_t buffer_size = util::CopyBufferSize;          //  Size of the buffer used to stream files into a built disc
+    bool full = false;                                    //  Rebuild the whole disc even if it could be patched in place
+    bool sparse = false;                                  //  Leave padding in a built disc as holes instead of reserving it
+    bool hash = false;                                    //  Checksum data while extracting it and write the checksum list
+    bool gcz = false;                                     //  Write built and repacked discs as compressed GCZ images
+    std::string store;                                    //  Content store extracted files are kept in and linked from, empty for none
+    bool clone = false;                                   //  Align file data in a built disc so it can be cloned from its sources
+    bool tar = false;                                     //  Extract into a tar archive instead of a directory
+    std::string layout = layout::Original;                //  Order of file data in built and repacked discs
+    std::string trace;                                    //  File access trace used by the trace layout
+    std::string io = "auto";                              //  How files are copied: "uring", "threads" or "auto" for io_uring when the kernel has it
+    uint32_t queue_depth = util::DefaultQueueDepth;       //  Number of file copies kept in flight by io_uring
+    util::ThreadPool *pool = nullptr;                     //  Pool shared by every job of a batch, used instead of starting one per command
+    uint32_t batch_jobs = 4;                              //  Number of batch jobs run at once
+    uint32_t device_jobs = 2;                             //  Number of batch jobs run at once on any one device
+    logging::Level log_level = logging::Level::Normal;    //  How much the commands print
+    std::string stats;                                    //  Format of the stats summary printed at exit ("text" or "json"), empty for none
+    uint32_t slowest = 10;                                //  Number of slowest files listed in the stats summary
+  };
+
+  //  Whether file data is copied through io_uring rather than the thread pool
+  inline bool use_uring(const Options& options)
+  {
+    return options.io == "uring" || (options.io == "auto" && util::CopyRing::available());
+  }
+
   bool valid_directory(std::string root);
 
-  void extract(std::string disc, std::string outfile);
-  void extract_app(std::string disc, std::string out_directory);
-  void extract_fst(std::string disc, std::string out_directory);
-  void extract_dol(std::string disc, std::string out_directory);
-  void extract_files(std::string disc, std::string out_directory);
+  void extract(std::string disc, std::string outfile, const Options& options = Options());
+  void extract(const Disc& disc, std::string outfile, const Options& options = Options());
+  uint32_t apploader_size(const DiscReader& disc);
+  uint32_t dol_size(const DiscReader& disc, uint32_t doloffset);
+  void extract_app(const DiscReader& disc, std::string out_directory);
+  void extract_fst(const DiscReader& disc, std::string out_directory);
+  void extract_dol(const DiscReader& disc, std::string out_directory);
+  std::vector<ChecksumEntry> extract_files(const Disc& disc, std::string out_directory, const Options& options = Options());
+  fst::FST parse_fst(const DiscReader& disc, const Header& header);
+  void extract_paths(std::string disc, std::string outpath, const std::vector<std::string>& patterns, const Options& options = Options());
+  void extract_paths(const Disc& disc, std::string outpath, const std::vector<std::string>& patterns, const Options& options = Options());
+  void extract_tar(std::string disc, std::string outpath, const std::vector<std::string>& patterns, const Options& options = Options());
+  void extract_tar(const Disc& disc, std::string outpath, const std::vector<std::string>& patterns, const Options& options = Options());
 
-  void build(std::string root, std::string outfile);
+  void build(std::string root, std::string outfile, const Options& options = Options());
+  void repack(std::string disc, std::string outfile, const Options& options = Options());
+  void repack(const Disc& disc, std::string outfile, const Options& options = Options());
 
   void files(std::string disc);
+
+  void diff(std::string old_disc, std::string new_disc, std::string patchfile, const Options& options = Options());
+  void diff(const Disc& old_disc, const Disc& new_disc, std::string patchfile, const Options& options = Options());
+  void apply(std::string old_disc, std::string patchfile, std::string outfile, const Options& options = Options());
+
+  bool verify(std::string target, std::string checksums, const Options& options = Options());
 }
 
 #endif
@@ -0,0 +1,262 @@
+#include "gcm.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <iomanip>
+#include <map>
+#include <mutex>
+#include <sstream>
+
+#include <sys/stat.h>
+
+namespace gcm
+{
+  namespace
+  {
+    //  Device a path is on. Outputs that do not exist yet are placed on their nearest parent's device.
+    uint64_t device_of(std::string path)
+    {
+      boost::filesystem::path current = boost::filesystem::absolute(path);
+
+      while (true)
+      {
+        struct stat st;
+        stats::add_syscalls();
+
+        if (stat(current.c_str(), &st) == 0)
+        {
+          return static_cast<uint64_t>(st.st_dev);
+        }
+
+        if (!current.has_parent_path() || current.parent_path() == current)
+        {
+          return 0;
+        }
+
+        current = current.parent_path();
+      }
+    }
+
+    //  Whether two paths are the same or one is inside the other
+    bool overlaps(const boost::filesystem::path& a, const boost::filesystem::path& b)
+    {
+      auto shorter = a.size() < b.size() ? a : b;
+      auto longer = a.size() < b.size() ? b : a;
+
+      return std::mismatch(shorter.begin(), shorter.end(), longer.begin()).first == shorter.end();
+    }
+
+    //  Whether a job touches anything an earlier one writes, or writes anything it reads
+    bool conflicts(const BatchJob& earlier, const BatchJob& later)
+    {
+      auto any = [](const std::vector<std::string>& first, const std::vector<std::string>& second)
+      {
+        for (auto& a : first)
+        {
+          for (auto& b : second)
+          {
+            if (overlaps(boost::filesystem::absolute(a).lexically_normal(), boost::filesystem::absolute(b).lexically_normal()))
+            {
+              return true;
+            }
+          }
+        }
+
+        return false;
+      };
+
+      return any(earlier.outputs, later.inputs) || any(earlier.outputs, later.outputs) || any(earlier.inputs, later.outputs);
+    }
+  }
+
+  /*
+    Summary:
+      Runs the jobs of a batch, options.batch_jobs at a time and no more than
+      options.device_jobs at a time on any one device. Jobs start in list order as soon as
+      every device they use has room and every earlier job they depend on has finished. A
+      job depends on an earlier one if it reads what that job writes, or writes what it reads
+      or writes, so a list can extract a disc and then build from the extracted directory.
+      A job that fails is reported and the rest carry on, except for the jobs that depend on
+      it, which are skipped without running and counted as failed.
+
+    Parameters:
+      jobs: Jobs to run. Each should run its command on the pool in options.pool.
+      options: Settings such as the number of jobs run at once
+
+    Returns:
+      True if every job succeeded
+  */
+  bool run_batch(std::vector<BatchJob>& jobs, const Options& options)
+  {
+    std::vector<std::vector<uint64_t>> devices(jobs.size());
+    std::vector<std::vector<size_t>> after(jobs.size());
+
+    for (size_t i = 0; i < jobs.size(); i++)
+    {
+      for (auto& path : jobs[i].inputs)
+      {
+        devices[i].push_back(device_of(path));
+      }
+
+      for (auto& path : jobs[i].outputs)
+      {
+        devices[i].push_back(device_of(path));
+      }
+
+      for (size_t j = 0; j < i; j++)
+      {
+        if (conflicts(jobs[j], jobs[i]))
+        {
+          after[i].push_back(j);
+        }
+      }
+
+      std::sort(devices[i].begin(), devices[i].end());
+      devices[i].erase(std::unique(devices[i].begin(), devices[i].end()), devices[i].end());
+    }
+
+    std::mutex lock;
+    std::condition_variable finished;
+    std::map<uint64_t, uint32_t> busy;
+    std::vector<bool> started(jobs.size(), false);
+    std::vector<bool> ended(jobs.size(), false);
+    std::vector<bool> broken(jobs.size(), false);
+    uint32_t running = 0;
+    size_t done = 0;
+    size_t failed = 0;
+
+    uint32_t batch_jobs = std::max<uint32_t>(options.batch_jobs, 1);
+    uint32_t device_jobs = std::max<uint32_t>(options.device_jobs, 1);
+
+    //  Earlier job that failed or was skipped which a job depends on, or jobs.size() if none
+    auto broken_dependency = [&](size_t i)
+    {
+      auto found = std::find_if(after[i].begin(), after[i].end(), [&](size_t j){ return broken[j]; });
+      return found == after[i].end() ? jobs.size() : *found;
+    };
+
+    //  First job not started yet that can start or be skipped now, or jobs.size() if none can.
+    //  A job to be skipped needs neither a runner nor its devices.
+    auto next = [&]()
+    {
+      for (size_t i = 0; i < jobs.size(); i++)
+      {
+        if (started[i] || !std::all_of(after[i].begin(), after[i].end(), [&](size_t j){ return ended[j]; }))
+        {
+          continue;
+        }
+
+        if (broken_dependency(i) < jobs.size() ||
+            (running < batch_jobs && std::all_of(devices[i].begin(), devices[i].end(), [&](uint64_t device){ return busy[device] < device_jobs; })))
+        {
+          return i;
+        }
+      }
+
+      return jobs.size();
+    };
+
+    util::ThreadPool runners(batch_jobs);
+
+    for (size_t count = 0; count < jobs.size(); count++)
+    {
+      size_t i;
+
+      {
+        std::unique_lock<std::mutex> guard(lock);
+        finished.wait(guard, [&]{ return (i = next()) < jobs.size(); });
+
+        started[i] = true;
+
+        //  Whatever it would read or replace was not made, so it is not run
+        size_t dependency = broken_dependency(i);
+
+        if (dependency < jobs.size())
+        {
+          done++;
+          failed++;
+          ended[i] = true;
+          broken[i] = true;
+
+          logging::warn("[", done, "/", jobs.size(), "] SKIPPED: ", jobs[i].name, ": depends on failed job ", jobs[dependency].name);
+          continue;
+        }
+
+        running++;
+
+        for (auto device : devices[i])
+        {
+          busy[device]++;
+        }
+      }
+
+      runners.submit([&, i]()
+      {
+        auto start = std::chrono::steady_clock::now();
+        std::string error;
+        bool ok = false;
+
+        try
+        {
+          ok = jobs[i].run();
+
+          if (!ok)
+          {
+            error = "check failed";
+          }
+        }
+        catch (const std::exception& e)
+        {
+          error = e.what();
+        }
+        catch (...)
+        {
+          error = "unknown error";
+        }
+
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        {
+          std::lock_guard<std::mutex> guard(lock);
+          running--;
+          done++;
+          ended[i] = true;
+          broken[i] = !ok;
+
+          for (auto device : devices[i])
+          {
+            busy[device]--;
+          }
+
+          failed += ok ? 0 : 1;
+
+          std::ostringstream status;
+          status << "[" << done << "/" << jobs.size() << "] " << (ok ? "ok" : "FAILED") << ": " << jobs[i].name
+                 << " (" << std::fixed << std::setprecision(3) << seconds << " s)";
+
+          if (!ok)
+          {
+            status << ": " << error;
+          }
+
+          //  A failed job is shown even when quiet
+          if (ok)
+          {
+            logging::info(status.str());
+          }
+          else
+          {
+            logging::warn(status.str());
+          }
+        }
+
+        finished.notify_all();
+      });
+    }
+
+    runners.wait();
+
+    logging::info("Batch finished: ", jobs.size(), " jobs, ", failed, " failed");
+    return failed == 0;
+  }
+}
@@ -0,0 +1,24 @@
+#ifndef _GCM_BATCH_H
+#define _GCM_BATCH_H
+
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace gcm
+{
+  struct Options;
+
+  //  One command of a batch
+  struct BatchJob
+  {
+    std::string name;                   //  Shown in the status report, usually the line from the job list
+    std::vector<std::string> inputs;    //  Discs, directories and files the job reads
+    std::vector<std::string> outputs;   //  Discs and directories the job writes
+    std::function<bool()> run;          //  Runs the command. Returning false or throwing marks the job failed.
+  };
+
+  bool run_batch(std::vector<BatchJob>& jobs, const Options& options);
+}
+
+#endif
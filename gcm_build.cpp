@@ -1,62 +1,247 @@
 #include "gcm.h"
 
+#include <sys/stat.h>
+#include <unistd.h>
+
 using namespace fst;
 
 namespace fs = boost::filesystem;
 
 namespace gcm
 {
+  namespace
+  {
+    //  Describes a source file as it is now, with its hash left to be filled in once it is read
+    ManifestEntry describe(std::string root, std::string path, uint64_t offset)
+    {
+      struct stat st;
+      stats::add_syscalls();
+
+      if (stat((root + "/" + path).c_str(), &st) != 0)
+      {
+        throw std::runtime_error("Could not stat " + root + "/" + path);
+      }
+
+      int64_t mtime = static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+      return ManifestEntry{ path, offset, static_cast<uint64_t>(st.st_size), mtime, util::HashSeed };
+    }
+
+    /*
+      Summary:
+        Works out the order of the file data from the layout in options. The original layout
+        follows sys/fst.bin and falls back to the sorted one if it cannot be read.
+
+      Returns:
+        Entry indexes of the files in data order, or nothing for table order
+    */
+    std::vector<uint32_t> plan_order(const FST& fst, std::string root, const Options& options)
+    {
+      if (options.layout == layout::Trace)
+      {
+        return order_by_trace(fst, options.trace);
+      }
+
+      if (options.layout == layout::Original)
+      {
+        try
+        {
+          FST original(util::read_file(root + "/sys/fst.bin"));
+          return order_by_offset(fst, original);
+        }
+        catch (const std::exception& e)
+        {
+          logging::warn("Could not read ", root, "/sys/fst.bin, using the sorted layout: ", e.what());
+        }
+      }
+
+      return std::vector<uint32_t>();
+    }
+
+    /*
+      Summary:
+        Works out whether a build can patch the previous image instead of laying it out again.
+        Every file must keep its place in the FST and still fit before the next file's data,
+        and the new FST must fit before the first file. On success each file is moved back to
+        its previous offset.
+    */
+    bool fits_in_place(const Manifest& previous, Manifest& current, FST& fst)
+    {
+      if (previous.dol_offset != current.dol_offset || previous.fst_offset != current.fst_offset ||
+          previous.sys.size() != current.sys.size() || previous.files.size() != current.files.size())
+      {
+        return false;
+      }
+
+      //  Data is not always in table order, so each slot ends where the next data starts
+      std::vector<uint64_t> starts;
+      starts.reserve(previous.files.size());
+
+      for (auto& entry : previous.files)
+      {
+        starts.push_back(entry.offset);
+      }
+
+      std::sort(starts.begin(), starts.end());
+
+      uint64_t data_start = starts.empty() ? UINT64_MAX : starts.front();
+
+      if (current.fst_offset + fst.raw().size() > data_start)
+      {
+        return false;
+      }
+
+      std::vector<uint32_t> offsets;
+      offsets.reserve(current.files.size());
+
+      for (size_t i = 0; i < current.files.size(); i++)
+      {
+        auto next = std::upper_bound(starts.begin(), starts.end(), previous.files[i].offset);
+        uint64_t slot_end = (next != starts.end()) ? *next : UINT64_MAX;
+
+        if (previous.files[i].path != current.files[i].path ||
+            previous.files[i].offset + current.files[i].size > slot_end)
+        {
+          return false;
+        }
+
+        offsets.push_back(static_cast<uint32_t>(previous.files[i].offset));
+      }
+
+      //  Nothing is moved until every file is known to fit
+      for (size_t i = 0; i < current.files.size(); i++)
+      {
+        current.files[i].offset = offsets[i];
+      }
+
+      fst.relocate(offsets);
+      return true;
+    }
+  }
+
   /*
     Summary:
-      Builds a GCM from the contents of a directory which has files previously extracted
+      Builds a GCM from the contents of a directory which has files previously extracted. If a
+      manifest from an earlier build of the same output exists and the layout still holds, only
+      the header, the FST and the files that changed are rewritten. File data is ordered by
+      options.layout, and the disc is written by write_disc, the same as a Builder's: as a GCM
+      on options.jobs worker threads or through io_uring, as a GCZ image with options.gcz, or
+      front to back to stdout for an outfile of "-".
 
     Parameter:
       root: Directory where the ./files and ./sys directories are
-      outfile: Output path for the GCM file
+      outfile: Output path for the GCM file, or "-" for stdout
+      options: Settings such as the size of the copy buffer and the number of worker threads
   */
-  void build(std::string root, std::string outfile)
+  void build(std::string root, std::string outfile, const Options& options)
   {
+    //  An output of "-" streams the disc to stdout
+    bool stream = (outfile == "-");
+    std::optional<logging::ToStderr> to_stderr;
+
+    if (stream)
+    {
+      check_stream(options);
+
+      //  The disc is the only thing that may go to stdout, so messages go to stderr until the build ends
+      to_stderr.emplace();
+    }
+
     std::string syspath = root + "/sys/";
     std::string filepath = root + "/files/";
 
+    //  The DOL and FST go after the apploader, each on a 4 byte boundary
+    SysPlacement sys = place_sys(fs::file_size(syspath + "header.bin"), fs::file_size(syspath + "bi2.bin"),
+                                 fs::file_size(syspath + "apploader.bin"), fs::file_size(syspath + "main.dol"));
+
     //  Create the header from the extracted file
     Header header(syspath + "header.bin");
 
-    //  DOL offset is 0x2440 + apploader size
-    uint32_t doloffset = static_cast<uint32_t>(0x2440 + boost::filesystem::file_size(syspath + "apploader.bin"));
-    //  DOL padding to an even 4 byte boundary
-    uint32_t dolpad = util::pad(doloffset, 4);
+    //  Create a new FST from the files under the ./files directory
+    stats::Phase fst_phase("fst construct");
+    FST fst(filepath, sys.fst_offset);
+    fst_phase.end();
 
-    //  FST is after the DOL program
-    uint32_t fstoffset = static_cast<uint32_t>(doloffset + dolpad + boost::filesystem::file_size(syspath + "main.dol"));
-    //  FST padding to an even 4 byte boundary
-    uint32_t fstpad = util::pad(fstoffset, 4);
+    //  Record where everything goes so the next build can compare against it
+    stats::Phase plan_phase("plan");
+    //  Cloned data must start on a filesystem block, a compressed disc is never cloned
+    bool clone = options.clone && !options.gcz && !stream;
+    fst.pack(sys.fst_offset, plan_order(fst, root, options), clone ? CloneBlockSize : 0x10);
 
-    //  Create a new FST from the files under the ./files directory
-    FST fst(filepath, fstoffset + fstpad);
+    Manifest current;
+    current.order = layout_key(options.layout, options.trace) + (clone ? " clone" : "");
+    current.dol_offset = sys.dol_offset;
+    current.fst_offset = sys.fst_offset;
+    current.sys.push_back(describe(root, "sys/bi2.bin", Header::Size));
+    current.sys.push_back(describe(root, "sys/apploader.bin", 0x2440));
+    current.sys.push_back(describe(root, "sys/main.dol", sys.dol_offset));
+
+    for (auto& file : fst.sources())
+    {
+      current.files.push_back(describe(root, file.path().substr(root.length() + 1), file.offset()));
+    }
+
+    std::string manifest_path = Manifest::path_for(outfile);
+    Manifest previous;
+
+    bool update = !options.full && !options.gcz && !stream && fs::is_regular_file(outfile) && previous.load(manifest_path) &&
+                  previous.image_size == fs::file_size(outfile) && previous.order == current.order &&
+                  fits_in_place(previous, current, fst);
+
+    plan_phase.end();
 
     //  Set the correct new data in the header
     header.set_fst_size(fst.rawsize());         //  FST size
-    header.set_fst_offset(fstoffset + fstpad);  //  FST offset
-    header.set_dol_offset(doloffset + dolpad);  //  DOL offset
+    header.set_fst_offset(sys.fst_offset);      //  FST offset
+    header.set_dol_offset(sys.dol_offset);      //  DOL offset
+
+    //  A manifest must never describe a partly written disc
+    if (!stream)
+    {
+      fs::remove(manifest_path);
+    }
+
+    if (update)
+    {
+      logging::info("Updating ", outfile, " in place");
+    }
+
+    //  Every offset is known now, so work out where the image ends before writing anything
+    auto raw = fst.raw();
 
-    //  Write out each binary portion of the disc
-    util::write_file(outfile, header.raw());
-    util::append_file(outfile, util::read_file(syspath + "bi2.bin"));
-    util::append_file(outfile, util::read_file(syspath + "apploader.bin"));
-    util::append_file(outfile, util::read_file(syspath + "main.dol"), 0, doloffset + dolpad);
-    util::append_file(outfile, fst.raw(), 0, fstoffset + fstpad);
+    DiscLayout layout;
+    layout.header = header.raw();
+    layout.fst.assign(raw.begin(), raw.begin() + fst.rawsize());
+    layout.fst_offset = sys.fst_offset;
+    layout.fst_end = sys.fst_offset + raw.size();
+    layout.image_size = layout.fst_end;
+    layout.clone = clone;
 
-    //  Begin writing each file to the disc
-    for (auto& file : fst.files())
+    for (auto& entry : current.sys)
     {
-      //  If file has actual content append it to the disc
-      if (file.size() > 0)
+      layout.sys.push_back(Section{ entry.path, root + "/" + entry.path, nullptr, entry.offset, entry.size });
+    }
+
+    for (auto& entry : current.files)
+    {
+      layout.files.push_back(Section{ entry.path, root + "/" + entry.path, nullptr, entry.offset, entry.size });
+
+      if (entry.size > 0)
       {
-        std::cout << "Writing " << file.path() << std::endl;
-        util::append_file(outfile, util::read_file(file.path()), 0, file.offset());
+        layout.image_size = std::max(layout.image_size, entry.offset + entry.size);
       }
     }
+
+    write_disc(layout, outfile, options, update ? &previous : nullptr, &current);
+
+    //  A streamed or compressed disc cannot be patched later, so it has no manifest
+    if (stream || options.gcz)
+    {
+      return;
+    }
+
+    stats::Phase manifest_phase("manifest");
+    current.image_size = layout.image_size;
+    current.save(manifest_path);
   }
 
   /*
@@ -75,49 +260,49 @@ namespace gcm
     //  If the directory does not have /files and /sys then it wasn't extracted by this extractor
     if (fs::is_directory(root) == false)
     {
-      std::cout << root << " is not a valid directory." << std::endl;
+      logging::warn(root, " is not a valid directory.");
       ret = false;
     }
 
     if (fs::is_directory(root + "/files") == false)
     {
-      std::cout << "Missing directory /files under " << root << std::endl;
+      logging::warn("Missing directory /files under ", root);
       ret = false;
     }
 
     if (fs::is_directory(root + "/sys") == false)
     {
-      std::cout << "Missing directory /sys under " << root << std::endl;
+      logging::warn("Missing directory /sys under ", root);
       ret = false;
     }
 
     if (fs::is_regular_file(root + "/sys/apploader.bin") == false)
     {
-      std::cout << "Missing file " << root << "/sys/apploader.bin" << std::endl;
+      logging::warn("Missing file ", root, "/sys/apploader.bin");
       ret = false;
     }
 
     if (fs::is_regular_file(root + "/sys/bi2.bin") == false)
     {
-      std::cout << "Missing file " << root << "/sys/bi2.bin" << std::endl;
+      logging::warn("Missing file ", root, "/sys/bi2.bin");
       ret = false;
     }
 
     if (fs::is_regular_file(root + "/sys/fst.bin") == false)
     {
-      std::cout << "Missing file " << root << "/sys/fst.bin" << std::endl;
+      logging::warn("Missing file ", root, "/sys/fst.bin");
       ret = false;
     }
 
     if (fs::is_regular_file(root + "/sys/header.bin") == false)
     {
-      std::cout << "Missing file " << root << "/sys/header.bin" << std::endl;
+      logging::warn("Missing file ", root, "/sys/header.bin");
       ret = false;
     }
 
     if (fs::is_regular_file(root + "/sys/main.dol") == false)
     {
-      std::cout << "Missing file " << root << "/sys/main.dol" << std::endl;
+      logging::warn("Missing file ", root, "/sys/main.dol");
       ret = false;
     }
 
@@ -0,0 +1,715 @@
+#include "gcm.h"
+
+#include <unistd.h>
+
+using namespace fst;
+
+namespace fs = boost::filesystem;
+
+namespace gcm
+{
+  namespace
+  {
+    //  Parts of the system area a Builder takes, named as extract writes them to sys/
+    const std::vector<std::string> SysNames = { "header.bin", "bi2.bin", "apploader.bin", "main.dol", "fst.bin" };
+
+    /*
+      Summary:
+        Splits a path in the disc into its names. A leading "./" or "/" is dropped, the same as
+        the paths extract takes.
+
+      Parameters:
+        path: Path of a file in the disc
+
+      Returns:
+        Names of the directories the file is in followed by its own name
+    */
+    std::vector<std::string> split_path(std::string path)
+    {
+      std::vector<std::string> names;
+      size_t start = 0;
+
+      while (start <= path.length())
+      {
+        size_t end = std::min(path.find('/', start), path.length());
+        std::string name = path.substr(start, end - start);
+
+        if (name == "..")
+        {
+          throw std::runtime_error("A path in the disc cannot go up a directory: " + path);
+        }
+
+        if (!name.empty() && name != ".")
+        {
+          names.push_back(std::move(name));
+        }
+
+        start = end + 1;
+      }
+
+      if (names.empty())
+      {
+        throw std::runtime_error("Not a path to a file in the disc: " + path);
+      }
+
+      return names;
+    }
+
+    /*
+      Summary:
+        Checks whether a source still has the contents recorded by the last build. The file is
+        only read when its size matches but its modification time does not.
+    */
+    bool unchanged(std::string source, const ManifestEntry& previous, ManifestEntry& current, uint32_t buffer_size)
+    {
+      if (previous.path != current.path || previous.size != current.size)
+      {
+        return false;
+      }
+
+      if (previous.mtime != current.mtime)
+      {
+        current.hash = util::hash_file(source, buffer_size);
+        return current.hash == previous.hash;
+      }
+
+      current.hash = previous.hash;
+      return true;
+    }
+
+    std::string join_path(const std::vector<std::string>& names)
+    {
+      std::string path;
+
+      for (auto& name : names)
+      {
+        path += (path.empty() ? "" : "/") + name;
+      }
+
+      return path;
+    }
+  }
+
+  //  Sets a part of the system area to a file on disk
+  void Builder::set_sys(std::string name, std::string source)
+  {
+    if (std::find(SysNames.begin(), SysNames.end(), name) == SysNames.end())
+    {
+      throw std::runtime_error("Unknown system file " + name);
+    }
+
+    m_sys[name] = make_part(source);
+  }
+
+  //  Sets a part of the system area to data in memory
+  void Builder::set_sys(std::string name, std::vector<uint8_t> data)
+  {
+    if (std::find(SysNames.begin(), SysNames.end(), name) == SysNames.end())
+    {
+      throw std::runtime_error("Unknown system file " + name);
+    }
+
+    uint32_t size = static_cast<uint32_t>(data.size());
+    m_sys[name] = Part{ "", std::make_shared<const std::vector<uint8_t>>(std::move(data)), size };
+  }
+
+  /*
+    Summary:
+      Adds a file read from disk when the disc is written. Adding a path a second time replaces
+      the file added before.
+
+    Parameters:
+      path: Path of the file in the disc, such as "./audio/bgm.adp"
+      source: Path of the file on disk
+  */
+  void Builder::add_file(std::string path, std::string source)
+  {
+    std::string key = join_path(split_path(path));
+    Part part = make_part(source);
+    auto [it, added] = m_paths.emplace(key, m_files.size());
+
+    if (added)
+    {
+      m_files.emplace_back(key, std::move(part));
+    }
+    else
+    {
+      m_files[it->second].second = std::move(part);
+    }
+  }
+
+  //  Adds a file held in memory, replacing any file added before with the same path
+  void Builder::add_file(std::string path, std::vector<uint8_t> data)
+  {
+    std::string key = join_path(split_path(path));
+
+    if (data.size() > UINT32_MAX)
+    {
+      throw std::runtime_error("Too large for a disc: " + path);
+    }
+
+    uint32_t size = static_cast<uint32_t>(data.size());
+    Part part{ "", std::make_shared<const std::vector<uint8_t>>(std::move(data)), size };
+    auto [it, added] = m_paths.emplace(key, m_files.size());
+
+    if (added)
+    {
+      m_files.emplace_back(key, std::move(part));
+    }
+    else
+    {
+      m_files[it->second].second = std::move(part);
+    }
+  }
+
+  //  Works out where everything goes without reading or writing any file data
+  Plan Builder::plan(const Options& options) const
+  {
+    DiscLayout layout = lay_out(options, options.clone && !options.gcz);
+
+    Plan plan;
+    plan.dol_offset = static_cast<uint32_t>(layout.sys[2].offset);
+    plan.fst_offset = static_cast<uint32_t>(layout.fst_offset);
+    plan.fst_size = static_cast<uint32_t>(layout.fst.size());
+    plan.image_size = layout.image_size;
+
+    for (auto& file : layout.files)
+    {
+      plan.files.push_back(Placement{ file.name, static_cast<uint32_t>(file.offset), static_cast<uint32_t>(file.size) });
+    }
+
+    return plan;
+  }
+
+  /*
+    Summary:
+      Writes the disc with write_disc, the same way build does, to a GCM or GCZ image or to
+      stdout. It has no manifest, so a later build cannot update it in place.
+
+    Parameters:
+      outfile: Output path for the disc, or "-" for stdout
+      options: Settings such as the layout and the number of worker threads
+  */
+  void Builder::write(std::string outfile, const Options& options) const
+  {
+    bool stream = (outfile == "-");
+    std::optional<logging::ToStderr> to_stderr;
+
+    if (stream)
+    {
+      check_stream(options);
+      to_stderr.emplace();
+    }
+
+    write_disc(lay_out(options, options.clone && !options.gcz && !stream), outfile, options);
+  }
+
+  //  Makes a part from a file on disk, reading only its size
+  Builder::Part Builder::make_part(std::string source) const
+  {
+    if (!fs::is_regular_file(source))
+    {
+      throw std::runtime_error("Not a file: " + source);
+    }
+
+    uint64_t size = fs::file_size(source);
+
+    if (size > UINT32_MAX)
+    {
+      throw std::runtime_error("Too large for a disc: " + source);
+    }
+
+    return Part{ source, nullptr, static_cast<uint32_t>(size) };
+  }
+
+  const Builder::Part& Builder::sys_part(std::string name) const
+  {
+    auto it = m_sys.find(name);
+
+    if (it == m_sys.end())
+    {
+      throw std::runtime_error("The disc has no " + name + ", set it with set_sys");
+    }
+
+    return it->second;
+  }
+
+  /*
+    Summary:
+      Lays out the disc the same way build does. The table is made from the file paths with
+      each directory sorted by name, and the file data is ordered by options.layout.
+
+    Parameters:
+      options: Settings with the layout and trace to order the data by
+      clone: Whether file data is aligned so it can be cloned from its sources
+  */
+  DiscLayout Builder::lay_out(const Options& options, bool clone) const
+  {
+    const Part& header_part = sys_part("header.bin");
+    const Part& bi2 = sys_part("bi2.bin");
+    const Part& apploader = sys_part("apploader.bin");
+    const Part& dol = sys_part("main.dol");
+
+    SysPlacement sys = place_sys(header_part.size, bi2.size, apploader.size, dol.size);
+
+    //  Sort the files the way a directory is scanned, each directory's names by name_less
+    std::vector<std::vector<std::string>> names;
+    std::vector<size_t> order(m_files.size());
+    names.reserve(m_files.size());
+
+    for (size_t i = 0; i < m_files.size(); i++)
+    {
+      names.push_back(split_path(m_files[i].first));
+      order[i] = i;
+    }
+
+    std::sort(order.begin(), order.end(), [&](size_t a, size_t b)
+    {
+      return std::lexicographical_compare(names[a].begin(), names[a].end(), names[b].begin(), names[b].end(), name_less);
+    });
+
+    //  Walk the sorted files, opening and closing directories as their paths change
+    std::vector<ScanEntry> entries;
+    std::vector<uint32_t> open;
+    std::vector<size_t> parts;
+    const std::vector<std::string> *last = nullptr;
+
+    auto close = [&](size_t depth)
+    {
+      while (open.size() > depth)
+      {
+        entries[open.back() - 1].next = static_cast<uint32_t>(entries.size()) + 1;
+        open.pop_back();
+      }
+    };
+
+    for (auto i : order)
+    {
+      auto& path = names[i];
+
+      //  A file cannot also be a directory
+      if (last && last->size() < path.size() && std::equal(last->begin(), last->end(), path.begin()))
+      {
+        throw std::runtime_error(join_path(*last) + " is a file and a directory in the disc");
+      }
+
+      size_t depth = 0;
+
+      while (depth < open.size() && depth + 1 < path.size() && entries[open[depth] - 1].name == path[depth])
+      {
+        depth++;
+      }
+
+      close(depth);
+
+      for (; depth + 1 < path.size(); depth++)
+      {
+        entries.push_back(ScanEntry{ path[depth], "", false, 0, open.empty() ? 0 : open.back(), 0 });
+        open.push_back(static_cast<uint32_t>(entries.size()));
+      }
+
+      const Part& part = m_files[i].second;
+      entries.push_back(ScanEntry{ path.back(), part.source, true, part.size, open.empty() ? 0 : open.back(), 0 });
+      parts.push_back(i);
+      last = &path;
+    }
+
+    close(0);
+
+    FST fst(std::move(entries), sys.fst_offset);
+
+    std::vector<uint32_t> data_order;
+
+    if (options.layout == layout::Trace)
+    {
+      data_order = order_by_trace(fst, options.trace);
+    }
+    else if (options.layout == layout::Original && m_sys.count("fst.bin"))
+    {
+      const Part& original = sys_part("fst.bin");
+      data_order = order_by_offset(fst, FST(original.data ? *original.data : util::read_file(original.source)));
+    }
+
+    //  Cloned data must start on a filesystem block
+    fst.pack(sys.fst_offset, data_order, clone ? CloneBlockSize : 0x10);
+
+    Header header = header_part.data ? Header(*header_part.data) : Header(header_part.source);
+    header.set_fst_size(fst.rawsize());
+    header.set_fst_offset(sys.fst_offset);
+    header.set_dol_offset(sys.dol_offset);
+
+    auto section = [](std::string name, const Part& part, uint64_t offset)
+    {
+      return Section{ name, part.source, part.data, offset, part.size };
+    };
+
+    auto raw = fst.raw();
+
+    DiscLayout layout;
+    layout.header = header.raw();
+    layout.fst.assign(raw.begin(), raw.begin() + fst.rawsize());
+    layout.fst_offset = sys.fst_offset;
+    layout.fst_end = sys.fst_offset + raw.size();
+    layout.image_size = layout.fst_end;
+    layout.clone = clone;
+    layout.sys.push_back(section("bi2.bin", bi2, Header::Size));
+    layout.sys.push_back(section("apploader.bin", apploader, 0x2440));
+    layout.sys.push_back(section("main.dol", dol, sys.dol_offset));
+
+    auto& sources = fst.sources();
+
+    for (size_t i = 0; i < sources.size(); i++)
+    {
+      layout.files.push_back(section("./" + m_files[parts[i]].first, m_files[parts[i]].second, sources[i].offset()));
+
+      if (sources[i].size() > 0)
+      {
+        layout.image_size = std::max<uint64_t>(layout.image_size, sources[i].offset() + sources[i].size());
+      }
+    }
+
+    return layout;
+  }
+
+  /*
+    Summary:
+      Places the DOL and FST after the header, bi2 and apploader, each on a 4 byte boundary.
+      The header and bi2 fill the space before the apploader, so they must be their usual
+      sizes.
+
+    Parameters:
+      header_size, bi2_size, apploader_size, dol_size: Sizes of the system area's parts
+
+    Returns:
+      Offsets of the DOL and the FST
+  */
+  SysPlacement place_sys(uint64_t header_size, uint64_t bi2_size, uint64_t apploader_size, uint64_t dol_size)
+  {
+    if (header_size != Header::Size)
+    {
+      throw std::runtime_error("header.bin must be " + std::to_string(Header::Size) + " bytes");
+    }
+
+    if (bi2_size != 0x2000)
+    {
+      throw std::runtime_error("bi2.bin must be 8192 bytes");
+    }
+
+    uint64_t doloffset = 0x2440 + apploader_size;
+    doloffset += util::pad(doloffset, 4);
+
+    uint64_t fstoffset = doloffset + dol_size;
+    fstoffset += util::pad(fstoffset, 4);
+
+    if (fstoffset > UINT32_MAX)
+    {
+      throw std::runtime_error("The apploader and DOL do not fit on a disc");
+    }
+
+    return SysPlacement{ static_cast<uint32_t>(doloffset), static_cast<uint32_t>(fstoffset) };
+  }
+
+  //  Checks a disc can be written to stdout. Messages must then go to stderr until it is written.
+  void check_stream(const Options& options)
+  {
+    if (options.gcz)
+    {
+      throw std::runtime_error("A GCZ image cannot be streamed, its block table goes before the data");
+    }
+
+    //  stdout is shared by every job in a batch
+    if (options.pool)
+    {
+      throw std::runtime_error("A batch job cannot stream a disc to stdout");
+    }
+
+    if (isatty(STDOUT_FILENO))
+    {
+      throw std::runtime_error("Not writing a disc image to a terminal, pipe or redirect stdout instead");
+    }
+  }
+
+  /*
+    Summary:
+      Writes a laid out disc to a GCM image, a GCZ image or stdout. Every section of a GCM is
+      written at its final offset by a pool of options.jobs worker threads, or when io_uring is
+      used files on disk are copied through it from this thread, options.queue_depth at a
+      time. A GCZ image compresses blocks on the same number of threads. An outfile of "-"
+      writes the disc to stdout front to back, filling the gaps between sections with zeros.
+
+      Given the manifest of the build the image already holds, only the header, the FST and
+      the sections that changed since are written, and space a section or the table no longer
+      uses is cleared. The hash of each section written is kept in current.
+
+    Parameters:
+      layout: Disc to write
+      outfile: Output path, or "-" for stdout
+      options: Settings such as the size of the copy buffer and the number of worker threads
+      previous: Manifest of the build to update in place, or null to write the whole image
+      current: Manifest of this build with an entry for each sys section and file, or null
+  */
+  void write_disc(const DiscLayout& layout, std::string outfile, const Options& options, const Manifest *previous, Manifest *current)
+  {
+    bool update = (previous != nullptr);
+    std::span<const uint8_t> fst(layout.fst);
+
+    uint64_t bytes = 0;
+
+    for (auto& file : layout.files)
+    {
+      bytes += file.size;
+    }
+
+    //  A streamed disc is written front to back in one pass and has no manifest either. Every
+    //  section is already placed, so the gaps between them are filled with zeros as it goes.
+    if (outfile == "-")
+    {
+      stats::Phase write_phase("write");
+      StreamWriter writer(STDOUT_FILENO, options.buffer_size);
+
+      auto put = [&writer](const Section& section)
+      {
+        if (section.data)
+        {
+          writer.write(section.offset, *section.data);
+        }
+        else
+        {
+          writer.write_file(section.offset, section.source, section.size);
+        }
+      };
+
+      writer.write(0, layout.header);
+
+      for (auto& section : layout.sys)
+      {
+        put(section);
+      }
+
+      writer.write(layout.fst_offset, fst);
+
+      //  Data order depends on the layout, so put the files in disc order
+      std::vector<const Section*> files;
+
+      for (auto& file : layout.files)
+      {
+        if (file.size > 0)
+        {
+          files.push_back(&file);
+        }
+      }
+
+      std::sort(files.begin(), files.end(), [](const Section *a, const Section *b)
+      {
+        return a->offset < b->offset;
+      });
+
+      logging::Progress progress("Building", files.size(), bytes);
+
+      for (auto file : files)
+      {
+        logging::verbose("Writing ", file->source.empty() ? file->name : file->source);
+        auto start = std::chrono::steady_clock::now();
+        put(*file);
+        stats::add_file(file->name, file->size, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+        progress.add(file->size);
+      }
+
+      writer.finish(layout.image_size);
+      progress.end();
+      return;
+    }
+
+    //  A compressed disc is written in one pass and cannot be patched later, so it has no manifest
+    if (options.gcz)
+    {
+      stats::Phase compress_phase("compress");
+      GczWriter writer(outfile, layout.image_size);
+
+      auto put = [&writer](const Section& section)
+      {
+        if (section.data)
+        {
+          writer.add(section.offset, *section.data);
+        }
+        else
+        {
+          writer.add_file(section.offset, section.source, section.size);
+        }
+      };
+
+      writer.add(0, layout.header);
+      writer.add(layout.fst_offset, layout.fst);
+
+      for (auto& section : layout.sys)
+      {
+        put(section);
+      }
+
+      for (auto& file : layout.files)
+      {
+        if (file.size > 0)
+        {
+          put(file);
+        }
+      }
+
+      writer.write(options.jobs, options.pool);
+      return;
+    }
+
+    //  Open the output once and size it up front. New space reads back as zeros and every
+    //  section can then be written at its own offset in any order. Padding is never written
+    //  unless an earlier build may have left data in it.
+    DiscWriter writer(outfile, options.buffer_size, update, options.sparse, layout.clone);
+    writer.resize(layout.image_size);
+
+    stats::Phase write_phase("write");
+    util::TaskGroup pool(options.pool, options.jobs);
+
+    //  Writes a section and returns the hash of its data
+    auto put = [&writer](const Section& section) -> uint64_t
+    {
+      if (section.data)
+      {
+        writer.write(section.offset, *section.data);
+        return util::hash_bytes(util::HashSeed, section.data->data(), section.data->size());
+      }
+
+      return writer.write_file(section.offset, section.source, section.size);
+    };
+
+    //  Write out each binary portion of the disc
+    pool.submit([&writer, &layout]()
+    {
+      writer.write(0, layout.header);
+    });
+
+    for (size_t i = 0; i < layout.sys.size(); i++)
+    {
+      pool.submit([&, i]()
+      {
+        if (!update || !unchanged(layout.sys[i].source, previous->sys[i], current->sys[i], options.buffer_size))
+        {
+          uint64_t hash = put(layout.sys[i]);
+
+          if (current)
+          {
+            current->sys[i].hash = hash;
+          }
+        }
+      });
+    }
+
+    pool.submit([&]()
+    {
+      writer.write(layout.fst_offset, fst);
+
+      //  Clear whatever is left of a larger FST from the previous build
+      if (update)
+      {
+        uint64_t clear_end = layout.fst_end;
+
+        if (!layout.files.empty())
+        {
+          auto first = std::min_element(layout.files.begin(), layout.files.end(), [](const Section& a, const Section& b)
+          {
+            return a.offset < b.offset;
+          });
+
+          clear_end = std::max(layout.fst_end, first->offset);
+        }
+
+        uint64_t fst_data_end = layout.fst_offset + fst.size();
+        writer.zero(fst_data_end, clear_end - fst_data_end);
+      }
+    });
+
+    //  Hand each file to the pool to be copied to its offset, or queue it on io_uring from this thread
+    std::unique_ptr<util::CopyRing> ring;
+
+    //  The ring copies through buffers, so cloning keeps to the plain copy
+    if (use_uring(options) && !layout.clone)
+    {
+      ring = std::make_unique<util::CopyRing>(options.queue_depth);
+    }
+
+    logging::Progress progress(update ? "Updating" : "Building", layout.files.size(), bytes);
+
+    for (size_t i = 0; i < layout.files.size(); i++)
+    {
+      auto copy = [&, i]()
+      {
+        auto& file = layout.files[i];
+
+        if (update && unchanged(file.source, previous->files[i], current->files[i], options.buffer_size))
+        {
+          progress.skip(file.size);
+          return;
+        }
+
+        //  If file has actual content write it to the disc
+        if (file.size > 0)
+        {
+          logging::verbose("Writing ", file.source.empty() ? file.name : file.source);
+          auto start = std::chrono::steady_clock::now();
+
+          if (ring && !file.data)
+          {
+            writer.queue_file(*ring, file.offset, file.source, file.size, [&file, &progress, current, i, start](uint64_t hash)
+            {
+              if (current)
+              {
+                current->files[i].hash = hash;
+              }
+
+              stats::add_file(file.name, file.size, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+              progress.add(file.size);
+            });
+          }
+          else
+          {
+            uint64_t hash = put(file);
+
+            if (current)
+            {
+              current->files[i].hash = hash;
+            }
+
+            stats::add_file(file.name, file.size, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+            progress.add(file.size);
+          }
+        }
+        else
+        {
+          progress.add(0);
+        }
+
+        //  Clear the tail of a file that shrank in place
+        if (update && previous->files[i].size > file.size)
+        {
+          writer.zero(file.offset + file.size, previous->files[i].size - file.size);
+        }
+      };
+
+      if (ring)
+      {
+        copy();
+      }
+      else
+      {
+        pool.submit(copy);
+      }
+    }
+
+    if (ring)
+    {
+      ring->wait();
+    }
+
+    pool.wait();
+    writer.close();
+    write_phase.end();
+    progress.end();
+  }
+}
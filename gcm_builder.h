@@ -0,0 +1,106 @@
+#ifndef _GCM_BUILDER_H
+#define _GCM_BUILDER_H
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "gcm_manifest.h"
+
+namespace gcm
+{
+  struct Options;
+
+  //  Where a file of a planned disc goes
+  struct Placement
+  {
+    std::string path;   //  Path starting with "./"
+    uint32_t offset;
+    uint32_t size;
+  };
+
+  //  A part of a disc at its place in the image, read from a file on disk or from memory
+  struct Section
+  {
+    std::string name;                                   //  Named in messages and stats
+    std::string source;                                 //  Path on disk, empty for data in memory
+    std::shared_ptr<const std::vector<uint8_t>> data;   //  Data in memory, null for a file on disk
+    uint64_t offset;
+    uint64_t size;
+  };
+
+  //  A disc with everything placed, ready for write_disc
+  struct DiscLayout
+  {
+    std::vector<uint8_t> header;    //  Header with the DOL and FST offsets set
+    std::vector<uint8_t> fst;       //  Table without its padding
+    uint64_t fst_offset;
+    uint64_t fst_end;               //  End of the space kept for the table
+    uint64_t image_size;
+    bool clone;                     //  File data is aligned so it can be cloned from its sources
+    std::vector<Section> sys;       //  bi2.bin, apploader.bin and main.dol
+    std::vector<Section> files;     //  Files in table order
+  };
+
+  //  Where the DOL and FST go after the parts of the system area before them
+  struct SysPlacement
+  {
+    uint32_t dol_offset;
+    uint32_t fst_offset;
+  };
+
+  //  Layout of a disc before it is written
+  struct Plan
+  {
+    uint32_t dol_offset;
+    uint32_t fst_offset;
+    uint32_t fst_size;
+    uint64_t image_size;
+    std::vector<Placement> files;   //  In table order
+  };
+
+  /*
+    Summary:
+      Builds a disc from parts given one at a time instead of from an extracted directory.
+      Each part is read from a file on disk or from memory. The sys parts have the names
+      extract gives them in sys/: header.bin, bi2.bin, apploader.bin and main.dol are needed,
+      and fst.bin is only read by the original layout. Files are placed in the FST by their
+      paths, with their directories made as needed. Nothing is read until the disc is
+      planned or written, and nothing is printed but through logging. It is written by the
+      same write_disc as build, only without a manifest, so it cannot be updated in place.
+  */
+  struct Builder
+  {
+    void set_sys(std::string name, std::string source);
+    void set_sys(std::string name, std::vector<uint8_t> data);
+    void add_file(std::string path, std::string source);
+    void add_file(std::string path, std::vector<uint8_t> data);
+
+    Plan plan(const Options& options) const;
+    void write(std::string outfile, const Options& options) const;
+  private:
+    //  A part of the disc, from a file on disk or from memory
+    struct Part
+    {
+      std::string source;                                 //  Path on disk, empty for data in memory
+      std::shared_ptr<const std::vector<uint8_t>> data;   //  Data in memory, null for a file on disk
+      uint32_t size;
+    };
+
+    std::unordered_map<std::string, Part> m_sys;
+    std::vector<std::pair<std::string, Part>> m_files;    //  Path in the disc without "./", and its data
+    std::unordered_map<std::string, size_t> m_paths;      //  Index in m_files by path
+
+    Part make_part(std::string source) const;
+    const Part& sys_part(std::string name) const;
+    DiscLayout lay_out(const Options& options, bool clone) const;
+  };
+
+  SysPlacement place_sys(uint64_t header_size, uint64_t bi2_size, uint64_t apploader_size, uint64_t dol_size);
+  void check_stream(const Options& options);
+  void write_disc(const DiscLayout& layout, std::string outfile, const Options& options, const Manifest *previous = nullptr, Manifest *current = nullptr);
+}
+
+#endif
@@ -0,0 +1,122 @@
+#include "gcm_checksums.h"
+
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+namespace gcm
+{
+  namespace
+  {
+    const char *ChecksumsMagic = "mdgcm-checksums 2";
+
+    //  First line of lists written before MD5 was added, which are still read
+    const char *ChecksumsMagicV1 = "mdgcm-checksums 1";
+  }
+
+  /*
+    Summary:
+      Reads a checksum list written by save
+
+    Parameters:
+      file: Path to the checksum list
+
+    Returns:
+      False if the list does not exist or cannot be understood
+  */
+  bool Checksums::load(std::string file)
+  {
+    std::ifstream in(file);
+    std::string line;
+
+    if (!in || !std::getline(in, line) || (line != ChecksumsMagic && line != ChecksumsMagicV1))
+    {
+      return false;
+    }
+
+    bool has_md5 = (line == ChecksumsMagic);
+
+    image.clear();
+    files.clear();
+
+    while (std::getline(in, line))
+    {
+      std::istringstream fields(line);
+      std::string kind;
+      fields >> kind;
+
+      if (kind != "image" && kind != "file")
+      {
+        return false;
+      }
+
+      ChecksumEntry entry;
+      fields >> entry.size >> entry.crc32;
+
+      if (has_md5)
+      {
+        fields >> entry.md5;
+      }
+
+      fields >> entry.sha1;
+
+      //  The path is the rest of the line so it may contain spaces
+      fields.get();
+      std::getline(fields, entry.path);
+
+      if (fields.fail() || entry.crc32.size() != 8 || (has_md5 && entry.md5.size() != 32) || entry.sha1.size() != 40)
+      {
+        return false;
+      }
+
+      (kind == "image" ? image : files).push_back(entry);
+    }
+
+    return image.size() <= 1;
+  }
+
+  /*
+    Summary:
+      Writes the checksum list as plain text, one entry per line
+
+    Parameters:
+      file: Path to write to
+  */
+  void Checksums::save(std::string file) const
+  {
+    std::ofstream out(file, std::ios::trunc);
+
+    if (!out)
+    {
+      throw std::runtime_error("Could not create " + file);
+    }
+
+    write(out);
+
+    if (!out.flush())
+    {
+      throw std::runtime_error("Could not write " + file);
+    }
+  }
+
+  //  Writes the checksum list to a stream in the form save uses
+  void Checksums::write(std::ostream& out) const
+  {
+    out << ChecksumsMagic << "\n";
+
+    auto line = [&out](const char *kind, const ChecksumEntry& entry)
+    {
+      out << kind << " " << entry.size << " " << entry.crc32 << " " << entry.md5 << " " << entry.sha1 << " " << entry.path << "\n";
+    };
+
+    for (auto& entry : image)
+    {
+      line("image", entry);
+    }
+
+    for (auto& entry : files)
+    {
+      line("file", entry);
+    }
+  }
+}
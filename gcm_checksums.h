@@ -0,0 +1,62 @@
+#ifndef _GCM_CHECKSUMS_H
+#define _GCM_CHECKSUMS_H
+
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "checksum.h"
+
+namespace gcm
+{
+  //  Checksums of the whole image or of one file inside it
+  struct ChecksumEntry
+  {
+    std::string path;   //  Path inside the disc, e.g. "./audio/a.adp", or the image file name
+    uint64_t size = 0;  //  Size of the data in bytes
+    std::string crc32;  //  CRC-32 as 8 hex digits
+    std::string md5;    //  MD5 as 32 hex digits, empty in lists written before it was added
+    std::string sha1;   //  SHA-1 as 40 hex digits
+
+    static inline ChecksumEntry from(std::string path, const util::Checksum& checksum)
+    {
+      return ChecksumEntry{ .path = path, .size = checksum.size, .crc32 = checksum.crc32(), .md5 = checksum.md5(), .sha1 = checksum.sha1() };
+    }
+
+    //  An entry for a path whose checksums are filled in once its data is read
+    static inline ChecksumEntry pending(std::string path)
+    {
+      return ChecksumEntry{ .path = path, .size = 0, .crc32 = "", .md5 = "", .sha1 = "" };
+    }
+
+    //  True if both entries describe the same data, whatever their paths. MD5 is only compared when both have it.
+    inline bool matches(const ChecksumEntry& other) const
+    {
+      return size == other.size && crc32 == other.crc32 && sha1 == other.sha1 && (md5.empty() || other.md5.empty() || md5 == other.md5);
+    }
+  };
+
+  /*
+    Summary:
+      CRC-32, MD5 and SHA-1 of a disc image and of every file in its FST. Written by extract
+      --hash and checked by verify.
+  */
+  struct Checksums
+  {
+    std::vector<ChecksumEntry> image;   //  Empty or a single entry for the whole image
+    std::vector<ChecksumEntry> files;   //  Files in FST order
+
+    bool load(std::string file);
+    void save(std::string file) const;
+    void write(std::ostream& out) const;
+
+    //  Name of the checksum list written into an extracted directory
+    static inline std::string path_in(std::string directory)
+    {
+      return directory + "/checksums.txt";
+    }
+  };
+}
+
+#endif
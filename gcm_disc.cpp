@@ -0,0 +1,96 @@
+#include "gcm.h"
+
+namespace gcm
+{
+  /*
+    Summary:
+      Opens a disc and reads its header and FST
+
+    Parameters:
+      path: Path to a GCM or GCZ image
+  */
+  Disc::Disc(std::string path) : m_reader(path), m_header(m_reader), m_fst(parse_fst(m_reader, m_header))
+  {
+  }
+
+  //  Every part of the system area in disc order
+  std::vector<SysFile> Disc::sys() const
+  {
+    uint32_t doloffset = m_header.dol_offset();
+
+    return std::vector<SysFile>
+    {
+      SysFile{ "header.bin", 0, Header::Size },
+      SysFile{ "bi2.bin", Header::Size, 0x2000 },
+      SysFile{ "apploader.bin", 0x2440, apploader_size(m_reader) },
+      SysFile{ "main.dol", doloffset, dol_size(m_reader, doloffset) },
+      SysFile{ "fst.bin", m_header.fst_offset(), m_header.fst_size() }
+    };
+  }
+
+  //  Every file in table order
+  std::vector<FileInfo> Disc::files() const
+  {
+    std::vector<FileInfo> found;
+
+    m_fst.visit(0, [&](uint32_t i, std::string_view path)
+    {
+      if (m_fst.is_file(i))
+      {
+        found.push_back(info(i, std::string(path)));
+      }
+
+      return true;
+    });
+
+    return found;
+  }
+
+  //  Looks up a file by its path, such as "./audio/bgm.adp". Directories are not returned.
+  std::optional<FileInfo> Disc::find(std::string_view path) const
+  {
+    std::optional<uint32_t> index = m_fst.find(path);
+
+    if (!index || !m_fst.is_file(*index))
+    {
+      return std::nullopt;
+    }
+
+    return info(*index, m_fst.path(*index));
+  }
+
+  //  Every file matched by a path or glob, as extract takes them, in table order
+  std::vector<FileInfo> Disc::match(std::string_view pattern) const
+  {
+    std::vector<FileInfo> found;
+
+    for (auto index : m_fst.match(pattern))
+    {
+      found.push_back(info(index, m_fst.path(index)));
+    }
+
+    return found;
+  }
+
+  std::vector<uint8_t> Disc::read(uint64_t offset, uint64_t count) const
+  {
+    return m_reader.read(offset, count);
+  }
+
+  //  Reads the whole of a file into memory
+  std::vector<uint8_t> Disc::read(const FileInfo& file) const
+  {
+    return m_reader.read(file.offset, file.size);
+  }
+
+  //  Passes a file to sink a piece at a time, without holding all of it in memory
+  void Disc::stream(const FileInfo& file, const std::function<void(std::span<const uint8_t>)>& sink) const
+  {
+    m_reader.stream(file.offset, file.size, sink);
+  }
+
+  FileInfo Disc::info(uint32_t index, std::string path) const
+  {
+    return FileInfo{ index, std::move(path), m_fst.data_offset(index), m_fst.data_size(index) };
+  }
+}
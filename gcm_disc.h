@@ -0,0 +1,96 @@
+#ifndef _GCM_DISC_H
+#define _GCM_DISC_H
+
+#include <cstdint>
+#include <functional>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "gcm_reader.h"
+#include "gcm_header.h"
+#include "gcm_fst.h"
+
+namespace gcm
+{
+  //  A file on a disc
+  struct FileInfo
+  {
+    uint32_t index;     //  Entry index in the FST
+    std::string path;   //  Path starting with "./"
+    uint32_t offset;
+    uint32_t size;
+  };
+
+  //  A part of the system area, named as extract writes it to sys/
+  struct SysFile
+  {
+    std::string name;
+    uint64_t offset;
+    uint64_t size;
+  };
+
+  /*
+    Summary:
+      An open disc with its header and FST read once, for programs that use this code as a
+      library and ask many questions of the same disc. Every command that reads a disc can
+      take one instead of a path. The const members may be called from any number of threads
+      at once. Errors are thrown as exceptions and nothing is printed.
+  */
+  struct Disc
+  {
+    explicit Disc(std::string path);
+
+    Disc(const Disc&) = delete;
+    Disc& operator=(const Disc&) = delete;
+
+    inline std::string path() const
+    {
+      return m_reader.path();
+    }
+
+    inline uint64_t size() const
+    {
+      return m_reader.size();
+    }
+
+    inline bool compressed() const
+    {
+      return m_reader.compressed();
+    }
+
+    inline const DiscReader& reader() const
+    {
+      return m_reader;
+    }
+
+    inline const Header& header() const
+    {
+      return m_header;
+    }
+
+    inline const fst::FST& fst() const
+    {
+      return m_fst;
+    }
+
+    std::vector<SysFile> sys() const;
+    std::vector<FileInfo> files() const;
+    std::optional<FileInfo> find(std::string_view path) const;
+    std::vector<FileInfo> match(std::string_view pattern) const;
+
+    std::vector<uint8_t> read(uint64_t offset, uint64_t count) const;
+    std::vector<uint8_t> read(const FileInfo& file) const;
+    void stream(const FileInfo& file, const std::function<void(std::span<const uint8_t>)>& sink) const;
+  private:
+    DiscReader m_reader;
+    Header m_header;
+    fst::FST m_fst;
+
+    FileInfo info(uint32_t index, std::string path) const;
+  };
+}
+
+#endif
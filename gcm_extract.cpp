@@ -1,128 +1,406 @@
 #include "gcm.h"
 
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 namespace gcm
 {
+  namespace
+  {
+    //  Copies one file out of the disc, timing it for the stats summary. If checksum is set the
+    //  data is checksummed as it is copied.
+    void copy_out(const DiscReader& disc, uint32_t offset, uint32_t size, std::string path, util::Checksum *checksum = nullptr)
+    {
+      auto start = std::chrono::steady_clock::now();
+
+      if (checksum)
+      {
+        disc.copy_to_file(offset, size, path, *checksum);
+      }
+      else
+      {
+        disc.copy_to_file(offset, size, path);
+      }
+
+      stats::add_file(path, size, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+    }
+
+    //  A file to copy out of the disc, with the slot for its checksum if it gets one
+    struct FileCopy
+    {
+      std::string path;
+      uint32_t offset;
+      uint32_t size;
+      ChecksumEntry *entry;
+    };
+
+    /*
+      Summary:
+        Extracts one file through a content store. The file is checksummed from the disc,
+        added to the store only if the store does not have it yet and then placed from there,
+        so a file the store already has is read but never written.
+    */
+    void store_out(const DiscReader& disc, const Store& store, const FileCopy& file)
+    {
+      auto start = std::chrono::steady_clock::now();
+
+      //  The SHA-1 --hash computes is also the store's key, so it is only worked out once
+      util::Checksum checksum;
+      util::Sha1 sha1;
+
+      disc.stream(file.offset, file.size, [&file, &checksum, &sha1](std::span<const uint8_t> piece)
+      {
+        if (file.entry)
+        {
+          checksum.update(piece);
+        }
+        else
+        {
+          sha1.update(piece);
+        }
+      });
+
+      std::string key = file.entry ? checksum.sha1() : sha1.hex();
+
+      store.add(key, disc, file.offset, file.size);
+      store.place(key, file.path);
+
+      if (file.entry)
+      {
+        *file.entry = ChecksumEntry::from(file.entry->path, checksum);
+      }
+
+      stats::add_file(file.path, file.size, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+    }
+
+    //  Removes a file that is hard linked elsewhere, such as to a store, so writing it cannot change the other copies
+    void unshare(std::string path)
+    {
+      struct stat st;
+      stats::add_syscalls();
+
+      if (lstat(path.c_str(), &st) == 0 && st.st_nlink > 1)
+      {
+        stats::add_syscalls();
+        unlink(path.c_str());
+      }
+    }
+
+    /*
+      Summary:
+        Copies files out of the disc on a pool of options.jobs worker threads, or through
+        io_uring from this thread with options.queue_depth files in flight. Compressed discs
+        always use the pool since their blocks have to be decoded on the way out, and so does
+        extracting through options.store.
+
+      Parameters:
+        disc: Disc to read from
+        copies: Files to copy. Their directories must already exist.
+        options: Settings such as the number of worker threads
+    */
+    void copy_files(const DiscReader& disc, const std::vector<FileCopy>& copies, const Options& options)
+    {
+      uint64_t bytes = 0;
+
+      for (auto& file : copies)
+      {
+        bytes += file.size;
+      }
+
+      logging::Progress progress("Extracting", copies.size(), bytes);
+
+      if (!options.store.empty())
+      {
+        Store store(options.store);
+        util::TaskGroup pool(options.pool, options.jobs);
+
+        for (auto& file : copies)
+        {
+          logging::verbose("Writing file: ", file.path);
+
+          pool.submit([&disc, &store, &progress, file]()
+          {
+            store_out(disc, store, file);
+            progress.add(file.size);
+          });
+        }
+
+        pool.wait();
+        progress.end();
+        return;
+      }
+
+      if (disc.compressed() || !use_uring(options))
+      {
+        util::TaskGroup pool(options.pool, options.jobs);
+
+        for (auto& file : copies)
+        {
+          logging::verbose("Writing file: ", file.path);
+
+          pool.submit([&disc, &progress, file]()
+          {
+            unshare(file.path);
+
+            if (file.entry)
+            {
+              util::Checksum checksum;
+              copy_out(disc, file.offset, file.size, file.path, &checksum);
+              *file.entry = ChecksumEntry::from(file.entry->path, checksum);
+            }
+            else
+            {
+              copy_out(disc, file.offset, file.size, file.path);
+            }
+
+            progress.add(file.size);
+          });
+        }
+
+        pool.wait();
+        progress.end();
+        return;
+      }
+
+      util::CopyRing ring(options.queue_depth);
+
+      for (auto& file : copies)
+      {
+        logging::verbose("Writing file: ", file.path);
+        unshare(file.path);
+
+        int out_fd = open(file.path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        stats::add_syscalls();
+
+        if (out_fd < 0)
+        {
+          throw std::runtime_error("Could not create " + file.path + ": " + strerror(errno));
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        auto checksum = file.entry ? std::make_shared<util::Checksum>() : nullptr;
+
+        util::CopyRing::Copy copy{ .path = file.path, .in_fd = disc.fd(), .in_offset = file.offset, .out_fd = out_fd, .out_offset = 0, .count = file.size };
+        copy.owns_out = true;
+
+        if (checksum)
+        {
+          copy.data = [checksum](std::span<const uint8_t> piece)
+          {
+            checksum->update(piece);
+          };
+        }
+
+        copy.done = [file, checksum, start, &progress](uint64_t)
+        {
+          if (checksum)
+          {
+            *file.entry = ChecksumEntry::from(file.entry->path, *checksum);
+          }
+
+          stats::add_file(file.path, file.size, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+          progress.add(file.size);
+        };
+
+        ring.add(std::move(copy));
+      }
+
+      ring.wait();
+      progress.end();
+    }
+
+    //  Checksums the whole image. Runs alongside the file copies, which read the same pages.
+    ChecksumEntry checksum_image(const DiscReader& disc)
+    {
+      util::Checksum checksum;
+
+      disc.stream(0, disc.size(), [&checksum](std::span<const uint8_t> piece)
+      {
+        checksum.update(piece);
+      });
+
+      return ChecksumEntry::from(boost::filesystem::path(disc.path()).filename().string(), checksum);
+    }
+  }
 
   /*
     Summary:
-      Extracts the Apploader data from the disc
+      Works out the size of the Apploader from its own header
 
     Parameters:
-      disc: Path to the disc to read from
-      out_directory: Directory where files will be extracted to
+      disc: Disc to read from
+
+    Returns:
+      Size of the Apploader and its trailer, padded to a 0x100 byte boundary
   */
-  void extract_app(std::string disc, std::string out_directory)
+  uint32_t apploader_size(const DiscReader& disc)
   {
-    uint32_t appoffset = 0x2440;  //  Always after header and bi2
-
     uint32_t appsize = 0;
 
-    appsize += util::read_big<uint32_t>(disc, 0x2454);  //  Apploader size
-    appsize += util::read_big<uint32_t>(disc, 0x2458);  //  Trailer size
-    appsize += util::pad(appsize, 0x100);               //  Pad it to a 0x100 byte boundary
+    appsize += disc.read_big<uint32_t>(0x2454);   //  Apploader size
+    appsize += disc.read_big<uint32_t>(0x2458);   //  Trailer size
+    appsize += util::pad(appsize, 0x100);         //  Pad it to a 0x100 byte boundary
+
+    return appsize;
+  }
+
+  /*
+    Summary:
+      Works out the size of the DOL binary from its section table
+
+    Parameters:
+      disc: Disc to read from
+      doloffset: Offset of the DOL in the disc
+
+    Returns:
+      Size of the DOL header and every section
+  */
+  uint32_t dol_size(const DiscReader& disc, uint32_t doloffset)
+  {
+    uint32_t dolsize = 0x100;
+    auto sizes = disc.view(doloffset + 0x90, 0x48);
 
-    std::vector<uint8_t> appbin = util::read_file(disc, appsize, appoffset);
+    for (int i = 0; i < 0x48; i += 4)
+    {
+      dolsize += util::read_big<uint32_t>(sizes, i);
+    }
 
-    util::write_file(out_directory + "apploader.bin", appbin);
+    return dolsize;
   }
 
   /*
     Summary:
-      Extracts the FST data from the disc
+      Extracts the Apploader data from the disc
 
     Parameters:
-      disc: Path to the disc to read from
+      disc: Disc to read from
       out_directory: Directory where files will be extracted to
   */
-  void extract_fst(std::string disc, std::string out_directory)
+  void extract_app(const DiscReader& disc, std::string out_directory)
   {
-    uint32_t fstsize = util::read_big<uint32_t>(disc, Header::Offset::FSTSize);
-    uint32_t fstoffset = util::read_big<uint32_t>(disc, Header::Offset::FSTOffset);
-
-    std::vector<uint8_t> fstbin = util::read_file(disc, fstsize, fstoffset);
+    stats::Phase phase("apploader");
+    uint32_t appoffset = 0x2440;  //  Always after header and bi2
 
-    util::write_file(out_directory + "fst.bin", fstbin);
+    util::write_file(out_directory + "apploader.bin", disc.view(appoffset, apploader_size(disc)));
   }
 
   /*
     Summary:
-      Extracts the DOL binary from the disc
+      Extracts the FST data from the disc
 
     Parameters:
-      disc: Path to the disc to read from
+      disc: Disc to read from
       out_directory: Directory where files will be extracted to
   */
-  void extract_dol(std::string disc, std::string out_directory)
+  void extract_fst(const DiscReader& disc, std::string out_directory)
   {
-    uint32_t doloffset = util::read_big<uint32_t>(disc, Header::Offset::DOLOffset);
+    stats::Phase phase("fst");
+    Header header(disc);
 
-    uint32_t dolsize = 0x100;
-    std::vector<uint8_t> sizes = util::read_file(disc, 0x48, doloffset + 0x90);
+    util::write_file(out_directory + "fst.bin", disc.view(header.fst_offset(), header.fst_size()));
+  }
 
-    for (int i = 0; i < 0x48; i += 4)
-    {
-      dolsize += util::read_big<uint32_t>(sizes, i);
-    }
+  /*
+    Summary:
+      Extracts the DOL binary from the disc
 
-    std::vector<uint8_t> dolbin = util::read_file(disc, dolsize, doloffset);
+    Parameters:
+      disc: Disc to read from
+      out_directory: Directory where files will be extracted to
+  */
+  void extract_dol(const DiscReader& disc, std::string out_directory)
+  {
+    stats::Phase phase("dol");
+    uint32_t doloffset = disc.read_big<uint32_t>(Header::Offset::DOLOffset);
 
-    util::write_file(out_directory + "main.dol", dolbin);
+    util::write_file(out_directory + "main.dol", disc.view(doloffset, dol_size(disc, doloffset)));
   }
 
   /*
     Summary:
-      Extracts files from a disc to a given directory
+      Extracts files from a disc to a given directory. Directories are created up front and
+      the files are then copied on the pool or through io_uring, as options.io picks.
 
     Parameters:
-      disc: Path to the disc to read from
+      image: Disc to read from
       out_directory: Directory where files will be extracted to
+      options: Settings such as the number of worker threads
+
+    Returns:
+      Checksums of every file in FST order if options.hash is set, otherwise nothing
   */
-  void extract_files(std::string disc, std::string out_directory)
+  std::vector<ChecksumEntry> extract_files(const Disc& image, std::string out_directory, const Options& options)
   {
-    //  Get the raw FST data from the disc
-    uint32_t fstsize = util::read_big<uint32_t>(disc, Header::Offset::FSTSize);
-    uint32_t fstoffset = util::read_big<uint32_t>(disc, Header::Offset::FSTOffset);
-    std::vector<uint8_t> fstbin = util::read_file(disc, fstsize, fstoffset);
-    std::vector<std::thread> threads;
+    stats::Phase phase("files");
 
-    //  Create FST object
-    fst::FST fst(fstbin);
+    const DiscReader& disc = image.reader();
+    const fst::FST& fst = image.fst();
+
+    //  Every file gets its own checksum slot up front so workers never share one
+    std::vector<ChecksumEntry> checksums;
+    std::vector<FileCopy> copies;
+
+    if (options.hash)
+    {
+      checksums.reserve(std::distance(fst.files().begin(), fst.files().end()));
+    }
 
-    for (auto& node : fst.entries())
+    //  Create every directory first so workers never race on parent creation
+    fst.visit(0, [&](uint32_t i, std::string_view path)
     {
-      std::string path = node.first.substr(2); // Skip the ./ part
-      fst::Node entry = node.second;
+      std::string target = out_directory;
+      target += path.substr(2); //  Skip the ./ part
 
-      if (entry.is_dir())
+      if (fst.is_dir(i))
       {
-        std::cout << "Creating directory: " << out_directory << path << std::endl;
-        boost::filesystem::create_directories(out_directory + path);
+        logging::verbose("Creating directory: ", target);
+        boost::filesystem::create_directories(target);
+        return true;
       }
-      else
-      {
-        std::cout << "Writing file: " << out_directory << path << std::endl;
 
-        //threads.push_back(std::thread(std::bind(util::write_file, out_directory + path, util::read_file(disc, entry.data_size(), entry.data_offset()))));
-        util::write_file(out_directory + path, util::read_file(disc, entry.data_size(), entry.data_offset()));
+      ChecksumEntry *entry = nullptr;
+
+      if (options.hash)
+      {
+        checksums.push_back(ChecksumEntry::pending(std::string(path)));
+        entry = &checksums.back();
       }
-    }
 
-    for (auto& thread : threads)
-    {
-      thread.join();
-    }
+      copies.push_back(FileCopy{ std::move(target), fst.data_offset(i), fst.data_size(i), entry });
+      return true;
+    });
+
+    copy_files(disc, copies, options);
+    return checksums;
   }
 
   /*
     Summary:
-      Extracts all important binaries and files from a disc to a given directory.
+      Parses the FST of a disc as its own stats phase
+  */
+  fst::FST parse_fst(const DiscReader& disc, const Header& header)
+  {
+    stats::Phase phase("fst parse");
+    return fst::FST(disc.view(header.fst_offset(), header.fst_size()));
+  }
+
+  /*
+    Summary:
+      Extracts all important binaries and files from a disc to a given directory. With
+      options.hash the whole image is checksummed on its own thread while the files are copied
+      and the checksums are written to checksums.txt in the output directory.
 
     Parameters:
-      disc: Path to the disc to read from
+      image: Disc to read from
       outpath: Directory to extract files to 
+      options: Settings passed on to extract_files
   */
-  void extract(std::string disc, std::string outpath)
+  void extract(const Disc& image, std::string outpath, const Options& options)
   {
+    //  The disc is opened once and shared between every extraction step
+    const DiscReader& disc = image.reader();
+
     //  Store the directories where files will be extracted
     std::string syspath = outpath + "/sys/";
     std::string filepath = outpath + "/files/";
@@ -132,13 +410,24 @@ namespace gcm
     boost::filesystem::create_directories(syspath);
     boost::filesystem::create_directories(filepath);
 
-    //  Read the raw header and bi2 data
-    std::vector<uint8_t> headerbin = util::read_file(disc, 0x440);
-    std::vector<uint8_t> bi2bin = util::read_file(disc, 0x2000, 0x440);
+    //  Write out the raw header and bi2 data
+    {
+      stats::Phase phase("header");
+      util::write_file(syspath + "header.bin", disc.view(0, 0x440));
+      util::write_file(syspath + "bi2.bin", disc.view(0x440, 0x2000));
+    }
+
+    //  Start checksumming the image first so it overlaps with everything below
+    Checksums checksums;
+    util::TaskGroup image_pool(options.pool, 1);
 
-    //  Write out the header and bi2 data
-    util::write_file(syspath + "header.bin", headerbin);
-    util::write_file(syspath + "bi2.bin", bi2bin);
+    if (options.hash)
+    {
+      image_pool.submit([&disc, &checksums]()
+      {
+        checksums.image.push_back(checksum_image(disc));
+      });
+    }
 
     //  Extract each section of non-file data out
     extract_app(disc, syspath);
@@ -146,30 +435,354 @@ namespace gcm
     extract_dol(disc, syspath);
 
     //  Extract the files
-    extract_files(disc, filepath);
+    checksums.files = extract_files(image, filepath, options);
+
+    if (options.hash)
+    {
+      stats::Phase phase("checksums");
+      image_pool.wait();
+      checksums.save(Checksums::path_in(outpath));
+    }
+  }
+
+  void extract(std::string discpath, std::string outpath, const Options& options)
+  {
+    extract(Disc(discpath), outpath, options);
   }
 
   /*
     Summary:
-      Prints each file entry to the console. Does not print plain or empty directories.
+      Extracts only the files that match any of the given paths or globs. Nothing from sys/ is
+      written and only the byte ranges of the matching files are read from the disc. With
+      options.hash the checksums of the extracted files are written to checksums.txt.
 
     Parameters:
-      disc: Path to the disc to read from
+      image: Disc to read from
+      outpath: Directory to extract files to. Paths inside the disc are kept relative to it.
+      patterns: Paths, or globs with "*" or "?" in their names, to resolve against the FST
+      options: Settings such as the number of worker threads
   */
-  void files(std::string disc)
+  void extract_paths(const Disc& image, std::string outpath, const std::vector<std::string>& patterns, const Options& options)
   {
-    //  Get the raw FST data from the disc
-    uint32_t fstsize = util::read_big<uint32_t>(disc, Header::Offset::FSTSize);
-    uint32_t fstoffset = util::read_big<uint32_t>(disc, Header::Offset::FSTOffset);
-    std::vector<uint8_t> fstbin = util::read_file(disc, fstsize, fstoffset);
+    const DiscReader& disc = image.reader();
+    const fst::FST& fst = image.fst();
 
-    //  Create an FST object
-    fst::FST table(fstbin);
+    stats::Phase phase("files");
+    std::vector<uint32_t> matches;
 
-    //  Print out each file listing
-    for (auto& file : table.files())
+    for (auto& pattern : patterns)
+    {
+      std::vector<uint32_t> found = fst.match(pattern);
+
+      if (found.empty())
+      {
+        logging::warn("No files match ", pattern);
+      }
+
+      matches.insert(matches.end(), found.begin(), found.end());
+    }
+
+    //  Patterns can overlap so only extract each file once
+    std::sort(matches.begin(), matches.end());
+    matches.erase(std::unique(matches.begin(), matches.end()), matches.end());
+
+    std::string out_directory = outpath + "/";
+    Checksums checksums;
+
+    if (options.hash)
+    {
+      for (auto index : matches)
+      {
+        checksums.files.push_back(ChecksumEntry::pending(fst.path(index)));
+      }
+    }
+
+    std::vector<FileCopy> copies;
+
+    for (size_t i = 0; i < matches.size(); i++)
+    {
+      uint32_t index = matches[i];
+      std::string path = out_directory + fst.path(index).substr(2);
+      ChecksumEntry *entry = options.hash ? &checksums.files[i] : nullptr;
+
+      //  Parents are created before any copy starts so workers never race on them
+      boost::filesystem::create_directories(boost::filesystem::path(path).parent_path());
+      copies.push_back(FileCopy{ path, fst.data_offset(index), fst.data_size(index), entry });
+    }
+
+    //  Checksums stay in FST order as a full extract writes them, but files are copied in disc order
+    std::stable_sort(copies.begin(), copies.end(), [](const FileCopy& a, const FileCopy& b)
+    {
+      return a.offset < b.offset;
+    });
+
+    copy_files(disc, copies, options);
+
+    if (options.hash)
+    {
+      stats::Phase checksum_phase("checksums");
+      checksums.save(Checksums::path_in(outpath));
+    }
+  }
+
+  void extract_paths(std::string discpath, std::string outpath, const std::vector<std::string>& patterns, const Options& options)
+  {
+    extract_paths(Disc(discpath), outpath, patterns, options);
+  }
+
+  /*
+    Summary:
+      Extracts a disc into a tar archive instead of a directory, so no file or directory is
+      created for each entry. The archive holds sys/ and files/ as extract would write them,
+      or with patterns only the matching files at their paths inside the disc, as
+      extract_paths would. File data goes into it in disc order, so the disc is read front to
+      back, and straight from the disc by the kernel unless it is compressed or checksummed.
+      With options.hash, checksums.txt is added as the last entry.
+
+    Parameters:
+      image: Disc to read from
+      outpath: Archive to write, or "-" for stdout
+      patterns: Paths or globs of the files to extract, empty for the whole disc
+      options: Settings such as whether to checksum the data
+  */
+  void extract_tar(const Disc& image, std::string outpath, const std::vector<std::string>& patterns, const Options& options)
+  {
+    if (!options.store.empty())
+    {
+      throw std::runtime_error("A tar archive cannot be extracted through a store");
+    }
+
+    const DiscReader& disc = image.reader();
+    const fst::FST& fst = image.fst();
+
+    //  An output of "-" streams the archive to stdout
+    bool stream = (outpath == "-");
+    std::optional<logging::ToStderr> to_stderr;
+
+    if (stream)
+    {
+      //  stdout is shared by every job in a batch
+      if (options.pool)
+      {
+        throw std::runtime_error("A batch job cannot stream an archive to stdout");
+      }
+
+      if (isatty(STDOUT_FILENO))
+      {
+        throw std::runtime_error("Not writing an archive to a terminal, pipe or redirect stdout instead");
+      }
+
+      //  The archive is the only thing that may go to stdout, so messages go to stderr
+      to_stderr.emplace();
+    }
+
+    int fd = stream ? STDOUT_FILENO : open(outpath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    stats::add_syscalls(stream ? 0 : 2);
+
+    if (fd < 0)
+    {
+      throw std::runtime_error("Could not create " + outpath + ": " + strerror(errno));
+    }
+
+    //  Every entry takes the time of the disc, so the same disc always gives the same archive
+    struct stat st;
+    int64_t mtime = (fstat(disc.fd(), &st) == 0) ? static_cast<int64_t>(st.st_mtime) : 0;
+
+    try
+    {
+      TarWriter tar(fd, mtime, options.buffer_size);
+
+      //  Start checksumming the image first so it overlaps with writing the archive
+      Checksums checksums;
+      util::TaskGroup image_pool(options.pool, 1);
+
+      if (options.hash && patterns.empty())
+      {
+        image_pool.submit([&disc, &checksums]()
+        {
+          checksums.image.push_back(checksum_image(disc));
+        });
+      }
+
+      //  Everything but the file data, in disc order
+      std::string prefix;
+
+      if (patterns.empty())
+      {
+        stats::Phase phase("sys");
+        tar.add_directory("sys/");
+
+        for (auto& part : image.sys())
+        {
+          tar.add("sys/" + part.name, disc.view(part.offset, part.size));
+        }
+
+        prefix = "files/";
+      }
+
+      stats::Phase phase("files");
+
+      //  Files to write. Patterns can overlap, so each file is only picked once.
+      std::vector<bool> picked(fst.count(), patterns.empty());
+
+      for (auto& pattern : patterns)
+      {
+        std::vector<uint32_t> found = fst.match(pattern);
+
+        if (found.empty())
+        {
+          logging::warn("No files match ", pattern);
+        }
+
+        for (auto index : found)
+        {
+          picked[index] = true;
+        }
+      }
+
+      //  Directories go first, then the files in the order their data is on the disc. Each
+      //  file's checksum keeps its slot in FST order.
+      std::vector<FileCopy> copies;
+
+      if (options.hash)
+      {
+        checksums.files.reserve(std::count(picked.begin(), picked.end(), true));
+      }
+
+      if (patterns.empty())
+      {
+        tar.add_directory(prefix);
+      }
+
+      fst.visit(0, [&](uint32_t i, std::string_view path)
+      {
+        std::string name = prefix;
+        name += path.substr(2); //  Skip the ./ part
+
+        if (fst.is_dir(i))
+        {
+          if (patterns.empty())
+          {
+            tar.add_directory(name + "/");
+          }
+
+          return true;
+        }
+
+        if (picked[i])
+        {
+          ChecksumEntry *entry = nullptr;
+
+          if (options.hash)
+          {
+            checksums.files.push_back(ChecksumEntry::pending(std::string(path)));
+            entry = &checksums.files.back();
+          }
+
+          copies.push_back(FileCopy{ std::move(name), fst.data_offset(i), fst.data_size(i), entry });
+        }
+
+        return true;
+      });
+
+      std::stable_sort(copies.begin(), copies.end(), [](const FileCopy& a, const FileCopy& b)
+      {
+        return a.offset < b.offset;
+      });
+
+      uint64_t bytes = 0;
+
+      for (auto& file : copies)
+      {
+        bytes += file.size;
+      }
+
+      logging::Progress progress("Extracting", copies.size(), bytes);
+
+      for (auto& file : copies)
+      {
+        logging::verbose("Writing file: ", file.path);
+        auto start = std::chrono::steady_clock::now();
+
+        if (file.entry)
+        {
+          util::Checksum checksum;
+          tar.add_range(file.path, disc, file.offset, file.size, &checksum);
+          *file.entry = ChecksumEntry::from(file.entry->path, checksum);
+        }
+        else
+        {
+          tar.add_range(file.path, disc, file.offset, file.size);
+        }
+
+        stats::add_file(file.path, file.size, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+        progress.add(file.size);
+      }
+
+      progress.end();
+      phase.end();
+
+      if (options.hash)
+      {
+        stats::Phase checksum_phase("checksums");
+        image_pool.wait();
+
+        std::ostringstream text;
+        checksums.write(text);
+
+        std::string list = text.str();
+        tar.add("checksums.txt", std::span<const uint8_t>(reinterpret_cast<const uint8_t *>(list.data()), list.size()));
+      }
+
+      tar.finish();
+    }
+    catch (...)
+    {
+      if (!stream)
+      {
+        close(fd);
+      }
+
+      throw;
+    }
+
+    if (!stream && close(fd) != 0)
     {
-      std::cout << file.path() << std::endl;
+      throw std::runtime_error("Could not write " + outpath + ": " + strerror(errno));
     }
   }
+
+  void extract_tar(std::string discpath, std::string outpath, const std::vector<std::string>& patterns, const Options& options)
+  {
+    extract_tar(Disc(discpath), outpath, patterns, options);
+  }
+
+  /*
+    Summary:
+      Prints each file entry to the console. Does not print plain or empty directories.
+      Programs that want the list itself use Disc::files instead.
+
+    Parameters:
+      discpath: Path to the disc to read from
+  */
+  void files(std::string discpath)
+  {
+    Disc disc(discpath);
+    const fst::FST& table = disc.fst();
+
+    //  Print out each file listing
+    stats::Phase phase("list");
+
+    table.visit(0, [&table](uint32_t i, std::string_view path)
+    {
+      if (table.is_file(i))
+      {
+        std::cout << path << '\n';
+      }
+
+      return true;
+    });
+
+    std::cout << std::flush;
+  }
 }
\ No newline at end of file
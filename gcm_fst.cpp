@@ -1,204 +1,544 @@
 #include "gcm_fst.h"
 
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <stdexcept>
+
 namespace fs = boost::filesystem;
 
 namespace fst
 {
-  Node::Node(std::vector<uint8_t>& data)
+  //  Names are compared without case as on Nintendo's own discs, falling back to their bytes
+  //  so the order is still total
+  bool name_less(const std::string& a, const std::string& b)
+  {
+    size_t count = std::min(a.size(), b.size());
+
+    for (size_t i = 0; i < count; i++)
+    {
+      int x = std::toupper(static_cast<unsigned char>(a[i]));
+      int y = std::toupper(static_cast<unsigned char>(b[i]));
+
+      if (x != y)
+      {
+        return x < y;
+      }
+    }
+
+    return (a.size() != b.size()) ? a.size() < b.size() : a < b;
+  }
+
+  Node::Node(std::span<const uint8_t> data)
   {
     m_type_string_offset = util::read_big<uint32_t>(data);
     m_file_parent_offset = util::read_big<uint32_t>(data, 4);
     m_size_next_offset = util::read_big<uint32_t>(data, 8);
   }
 
-  FST::FST(std::vector<uint8_t>& data)
+  FST::FST(std::span<const uint8_t> data) : m_string_start(0), m_strtable_size(0), m_file_offset(0), m_padding(0)
   {
-    m_root = Node(data);
-    uint32_t string_start = m_root.total_entries() * NodeSize;
+    m_raw.assign(data.begin(), data.end());
+    parse();
+  }
 
-    //  Start the current path at root (".")
-    std::vector<std::pair<std::string, uint32_t>> path = { std::make_pair(".", -1) };
+  //  Walks the directory once and builds everything else from the result
+  FST::FST(std::string root, uint32_t fst_offset) : FST(scan(root), fst_offset)
+  {
+  }
+
+  /*
+    Summary:
+      Builds a table from a list of entries and packs the file data after it in table order
+
+    Parameters:
+      entries: Every entry but the root in table order, each directory followed by its
+               contents, as scan gives them
+      fst_offset: Offset the table will be written at
+  */
+  FST::FST(std::vector<ScanEntry> entries, uint32_t fst_offset)
+  {
+    uint32_t total_entries = static_cast<uint32_t>(entries.size()) + 1;
+
+    uint64_t strtable_size = 0;
 
-    for (uint32_t i = 1; i < m_root.total_entries(); i++)
+    for (auto& entry : entries)
     {
-      //  Remove all directory names that are past their range
-      path.erase(std::remove_if(path.begin(), path.end(), [i](std::pair<std::string, uint32_t>& x){return i >= x.second; }), path.end());
+      strtable_size += entry.name.length() + 1;
+    }
 
-      Node next = Node(util::subset(data, i * NodeSize, NodeSize));
-      std::string name = util::read(data, string_start + next.string_offset());
-      std::string fullpath = compact_path(path);
+    //  Nodes hold name offsets in 3 bytes, so every name has to start below 16 MiB
+    if (strtable_size > 0xFFFFFF)
+    {
+      throw std::runtime_error("Too many names for a disc: the FST name table would be " + std::to_string(strtable_size) +
+                               " bytes, more than the " + std::to_string(0xFFFFFF) + " a disc can address");
+    }
 
-      if (next.is_dir())
+    m_strtable_size = static_cast<uint32_t>(strtable_size);
+
+    uint32_t string_start = total_entries * NodeSize;
+    uint32_t fst_size = string_start + m_strtable_size;
+
+    //  Allocate the whole table up front. File data offsets are filled in by pack at the end.
+    m_padding = 0;
+    m_raw.assign(fst_size, 0);
+    m_strtable.reserve(entries.size());
+    m_files.reserve(entries.size());
+
+    std::span<uint8_t> raw(m_raw);
+
+    //  Create root node
+    util::write_big<uint32_t>(raw, 0, 0x1000000);     //  Set as directory
+    util::write_big<uint32_t>(raw, 4, 0);             //  Parent is 0
+    util::write_big<uint32_t>(raw, 8, total_entries); //  Next offset is end of all entries
+
+    uint32_t string_offset = 0;
+
+    for (uint32_t i = 0; i < entries.size(); i++)
+    {
+      auto& entry = entries[i];
+      uint32_t node = (i + 1) * NodeSize;
+
+      if (entry.file)
       {
-        //  Push this directory name onto the list
-        path.push_back(std::make_pair(name, next.next_offset()));
+        util::write_big<uint32_t>(raw, node, string_offset & 0x00FFFFFF);  //  String table offset is 3 bytes. Upper byte is always 0 for files.
+        util::write_big<uint32_t>(raw, node + 8, entry.size);              //  File data length / File size
+
+        //  Push the path and file size into a vector for easy use later. The offset is set by pack.
+        m_files.push_back(FileData(entry.path, entry.size, 0));
       }
       else
       {
-        //  Push file entry into vector
-        m_files.push_back(FileData(fullpath + name, next.data_size(), next.data_offset()));
+        //  Upper byte is 1 to signal it's a directory. Last 3 bytes are the string table offset.
+        util::write_big<uint32_t>(raw, node, 0x01000000 | (string_offset & 0x00FFFFFF));
+        util::write_big<uint32_t>(raw, node + 4, entry.parent);  //  Index of the parent directory
+        util::write_big<uint32_t>(raw, node + 8, entry.next);    //  Index just past this directory's entries
       }
 
-      //  Put data into nodes indexed by the absolute path
-      m_nodes[fullpath + name] = next;
+      //  Copy the name into the string table. The null terminator is already in place.
+      std::copy(entry.name.begin(), entry.name.end(), m_raw.begin() + string_start + string_offset);
+      string_offset += entry.name.length() + 1;
+
+      m_strtable.push_back(std::move(entry.name));
     }
+
+    parse();
+    pack(fst_offset);
   }
 
-  FST::FST(std::string root, uint32_t fst_offset)
+  /*
+    Summary:
+      Splits the raw node table into flat arrays and works out the parent of every entry
+  */
+  void FST::parse()
   {
-    fs::recursive_directory_iterator dir(root), end;
+    if (m_raw.size() < NodeSize)
+    {
+      throw std::out_of_range("FST is too small to hold a root entry");
+    }
 
-    //  Set the start offset where file data is stored and give it some even padding
-    m_file_offset = fst_offset + calculate_size(root);
-    m_padding = util::pad(m_file_offset, 0x100);  //  Pad the FST to an even 0x100 byte boundary
-    m_file_offset += m_padding; //  Add the padding
+    std::span<const uint8_t> raw(m_raw);
 
-    //m_file_offset += (m_file_offset % 16) + 16;
-    m_strtable_size = 0;
+    m_root = Node(raw);
+    uint32_t total = m_root.total_entries();
 
-    //  Store original root path
-    m_root_path = root;
+    if (total == 0 || total > m_raw.size() / NodeSize)
+    {
+      throw std::out_of_range("FST entries run past the end of the table");
+    }
 
-    //  current_parent.back() holds the latest parent index which is pruned each iteration
-    std::vector<std::pair<uint32_t, uint32_t>> current_parent = { std::make_pair(0, 0) };
+    m_string_start = total * NodeSize;
 
-    //  Create root node
-    util::push_int_big<uint32_t>(m_raw, 0x1000000); //  Set as directory
-    util::push_int_big<uint32_t>(m_raw, 0);         //  Parent is 0
-    util::push_int_big<uint32_t>(m_raw, count_entries(root) + 1); //  Next offset is end of all entries
+    m_types.assign(total, 1);
+    m_name_offsets.assign(total, 0);
+    m_offsets.assign(total, 0);
+    m_sizes.assign(total, 0);
+    m_parents.assign(total, 0);
+    m_sizes[0] = total;
+    m_index.clear();
+    m_indexed = std::make_unique<std::once_flag>();
 
-    //  Start at one to skip root index (above)
-    uint32_t current_index = 1;
+    //  Directories that contain the current entry. Each one ends at its next offset.
+    std::vector<uint32_t> dirs = { 0 };
 
-    //  Loop through every file and directory entry recursively
-    while (dir != end)
+    for (uint32_t i = 1; i < total; i++)
     {
-      //  Get the name of the path relative to the root directory
-      std::string temp = dir->path().string().substr(root.length());
-      boost::replace_all(temp, "\\", "/");
+      while (dirs.size() > 1 && i >= m_sizes[dirs.back()])
+      {
+        dirs.pop_back();
+      }
 
-      std::string path = "./" + temp;
+      uint32_t type_name = util::read_big<uint32_t>(raw, i * NodeSize);
 
-      //  Remove any directory indexes that are past their range
-      current_parent.erase(std::remove_if(current_parent.begin(), current_parent.end(),
-        [current_index](std::pair<uint32_t, uint32_t>& x)
-        {
-          //  Remove if the current index is greater than the directory range and isn't root (0)
-          return (current_index >= x.second) && (x.first != 0); 
-        }), current_parent.end());
+      m_types[i] = static_cast<uint8_t>(type_name >> 24);
+      m_name_offsets[i] = type_name & 0x00FFFFFF;
+      m_offsets[i] = util::read_big<uint32_t>(raw, i * NodeSize + 4);
+      m_sizes[i] = util::read_big<uint32_t>(raw, i * NodeSize + 8);
+      m_parents[i] = dirs.back();
 
-      //  If this entry is a file
-      if (fs::is_regular_file(dir->path()))
+      if (is_dir(i))
       {
-        uint32_t filesize = static_cast<uint32_t>(fs::file_size(dir->path()));
+        dirs.push_back(i);
+      }
+    }
+  }
 
-        util::push_int_big<uint32_t>(m_raw, m_strtable_size & 0x00FFFFFF);  //  String table offset is 3 bytes. Upper byte is always 0 for files.
-        util::push_int_big<uint32_t>(m_raw, m_file_offset);                 //  File data offset into disc
-        util::push_int_big<uint32_t>(m_raw, filesize);                      //  File data length / File size
+  /*
+    Summary:
+      Gets the name of an entry from the string table. The root has no name.
+  */
+  std::string_view FST::name(uint32_t index) const
+  {
+    if (index == 0)
+    {
+      return std::string_view();
+    }
 
-        //  Push the path as well as the file size and file offset into a vector for easy use later.
-        m_files.push_back(FileData(dir->path().string(), filesize, m_file_offset));
+    size_t start = static_cast<size_t>(m_string_start) + m_name_offsets[index];
 
-        //  Increase the total file offset by the file size
-        m_file_offset += filesize;
+    if (start >= m_raw.size())
+    {
+      return std::string_view();
+    }
+
+    const char *str = reinterpret_cast<const char *>(&m_raw[start]);
+    const void *null = memchr(str, 0, m_raw.size() - start);
+    size_t length = null ? static_cast<const char *>(null) - str : m_raw.size() - start;
+
+    return std::string_view(str, length);
+  }
+
+  /*
+    Summary:
+      Builds the full path of an entry by walking up its parents
+
+    Returns:
+      The path starting with "./", or "." for the root
+  */
+  std::string FST::path(uint32_t index) const
+  {
+    std::vector<uint32_t> chain;
 
-        //  Pad the next file entry to the next 16 byte boundary
-        m_file_offset += util::pad(m_file_offset, 0x10);
+    for (uint32_t i = index; i != 0; i = m_parents[i])
+    {
+      chain.push_back(i);
+    }
+
+    std::string ret = ".";
+
+    for (auto it = chain.rbegin(); it != chain.rend(); ++it)
+    {
+      ret += "/";
+      ret += name(*it);
+    }
+
+    return ret;
+  }
+
+  /*
+    Summary:
+      Looks up an entry by its path. Leading "./" or "/" is optional.
+
+    Returns:
+      The entry index, or nothing if no entry has that path
+  */
+  std::optional<uint32_t> FST::find(std::string_view path) const
+  {
+    std::call_once(*m_indexed, [this]()
+    {
+      m_index.reserve(count());
+
+      for (uint32_t i = 1; i < count(); i++)
+      {
+        m_index.emplace(child_hash(m_parents[i], name(i)), i);
       }
-      else
+    });
+
+    uint32_t current = 0;
+
+    while (!path.empty())
+    {
+      size_t slash = path.find('/');
+      std::string_view part = path.substr(0, slash);
+      path = (slash == std::string_view::npos) ? std::string_view() : path.substr(slash + 1);
+
+      if (part.empty() || part == ".")
+      {
+        continue;
+      }
+
+      auto range = m_index.equal_range(child_hash(current, part));
+      auto match = std::find_if(range.first, range.second, [&](auto& x)
       {
-        uint32_t entries = count_entries(dir->path().string());
-        uint32_t next_index = current_index + entries + 1;
+        return m_parents[x.second] == current && name(x.second) == part;
+      });
 
-        //  Upper byte is 1 to signal it's a directory. Last 3 bytes are the string table offset.
-        util::push_int_big<uint32_t>(m_raw, 0x01000000 | (m_strtable_size & 0x00FFFFFF));
+      if (match == range.second)
+      {
+        return std::nullopt;
+      }
 
-        //  Set the parent offset to the current parent's index
-        util::push_int_big<uint32_t>(m_raw, current_parent.back().first);
+      current = match->second;
+    }
 
-        //  Set the next index to the end of this directories entries
-        util::push_int_big<uint32_t>(m_raw, next_index);
+    return current;
+  }
 
-        //  Set this directory as the current parent
-        current_parent.push_back(std::make_pair(current_index, next_index));
+  /*
+    Summary:
+      Finds every file matched by a path pattern. Each component of the pattern may use the *
+      and ? wildcards. A pattern that ends on a directory matches every file beneath it, and
+      directories whose names do not match are skipped without looking at their entries.
+
+    Parameters:
+      pattern: Path such as "./audio/bgm.adp", or a glob such as "*.adp" in place of a name.
+               Leading "./" or "/" is optional.
+
+    Returns:
+      Indexes of the matching file entries in table order
+  */
+  std::vector<uint32_t> FST::match(std::string_view pattern) const
+  {
+    std::vector<std::string_view> parts;
+
+    while (!pattern.empty())
+    {
+      size_t slash = pattern.find('/');
+      std::string_view part = pattern.substr(0, slash);
+      pattern = (slash == std::string_view::npos) ? std::string_view() : pattern.substr(slash + 1);
+
+      if (!part.empty() && part != ".")
+      {
+        parts.push_back(part);
       }
+    }
 
-      //  Push back the name of the file or directory and increment the total size
-      m_strtable.push_back(dir->path().filename().string());
-      m_strtable_size += dir->path().filename().string().length() + 1;
+    std::vector<uint32_t> ret;
 
-      //  Go to next directory and increase the current index
-      ++dir;
-      ++current_index;
+    if (count() > 0)
+    {
+      match_children(0, parts, 0, ret);
     }
 
-    //  Compile all the strings into a valid string table
-    std::vector<uint8_t> rawstr;
+    return ret;
+  }
+
+  void FST::match_children(uint32_t dir, const std::vector<std::string_view>& parts, size_t depth, std::vector<uint32_t>& out) const
+  {
+    uint32_t end = end_of(dir);
 
-    for (auto& name : m_strtable)
+    //  Nothing left to match so take everything in this directory
+    if (depth == parts.size())
     {
-      for (auto& c : name)
+      for (uint32_t i = dir + 1; i < end; i++)
       {
-        rawstr.push_back(c);
+        if (is_file(i))
+        {
+          out.push_back(i);
+        }
       }
-      rawstr.push_back(0);  //  Add a null padding to the end of each string
+
+      return;
     }
 
-    //  Add the padding at the end of the FST so data lines up nicely.
-    for (uint32_t i = 0; i < m_padding; i++)
+    //  Step from sibling to sibling, jumping over the contents of directories
+    for (uint32_t i = dir + 1; i < end; i = is_dir(i) ? end_of(i) : i + 1)
     {
-      rawstr.push_back(0);
+      if (!util::glob_match(parts[depth], name(i)))
+      {
+        continue;
+      }
+
+      if (is_dir(i))
+      {
+        match_children(i, parts, depth + 1, out);
+      }
+      else if (depth + 1 == parts.size())
+      {
+        out.push_back(i);
+      }
     }
+  }
+
+  /*
+    Summary:
+      Moves file data to new offsets, updating both the raw table and the file list
+
+    Parameters:
+      offsets: New data offset for each file entry, in table order
+  */
+  void FST::relocate(const std::vector<uint32_t>& offsets)
+  {
+    std::span<uint8_t> raw(m_raw);
+    size_t file = 0;
+
+    for (uint32_t i = 1; i < count() && file < offsets.size(); i++)
+    {
+      if (is_file(i))
+      {
+        m_offsets[i] = offsets[file];
+        util::write_big<uint32_t>(raw, i * NodeSize + 4, offsets[file]);
+
+        if (file < m_files.size())
+        {
+          m_files[file] = FileData(m_files[file].path(), m_files[file].size(), offsets[file]);
+        }
 
-    //  Add the string table to the end of the FST entries
-    m_raw.insert(m_raw.end(), rawstr.begin(), rawstr.end());
+        file++;
+      }
+    }
   }
 
   /*
     Summary:
-      Compacts a vector of strings into a full path. Currently a highly specialized for this class function.
+      Lays file data out right after the table. The table is padded to a 0x100 byte boundary,
+      then every file follows the one before it, each starting on an align byte boundary.
 
     Parameters:
-      std::vector<std::pair<std::string, uint32_t>>& path: Vector to use
+      fst_offset: Offset of the table in the disc
+      order: Entry indexes of the files in the order their data should be placed. Files that
+             are left out follow in table order. Empty for plain table order.
+      align: Boundary every file starts on. Larger than 0x100 also pads the table to it.
 
     Returns:
-      A string containing the strings combined like a file path
+      Offset just past the padded end of the last file
   */
-  std::string FST::compact_path(std::vector<std::pair<std::string, uint32_t>>& path)
+  uint32_t FST::pack(uint32_t fst_offset, const std::vector<uint32_t>& order, uint32_t align)
   {
-    std::string ret;
+    uint32_t table_size = rawsize();
 
-    for (auto& pair : path)
+    //  Set the start offset where file data is stored and give it some even padding
+    m_file_offset = fst_offset + table_size;
+    m_padding = util::pad(m_file_offset, std::max<uint32_t>(align, 0x100));  //  Pad the FST to an even 0x100 byte boundary
+    m_file_offset += m_padding; //  Add the padding
+
+    m_raw.resize(table_size + m_padding, 0);
+
+    std::vector<uint32_t> placed(count(), UINT32_MAX);
+
+    auto place = [&](uint32_t i)
     {
-      ret += pair.first + "/";
+      if (i < count() && is_file(i) && placed[i] == UINT32_MAX)
+      {
+        placed[i] = m_file_offset;
+
+        //  Increase the total file offset by the file size
+        m_file_offset += m_sizes[i];
+
+        //  Pad the next file entry to the next boundary
+        m_file_offset += util::pad(m_file_offset, align);
+      }
+    };
+
+    for (auto i : order)
+    {
+      place(i);
     }
-    return ret;
+
+    for (uint32_t i = 1; i < count(); i++)
+    {
+      place(i);
+    }
+
+    //  relocate takes the offsets in table order
+    std::vector<uint32_t> offsets;
+
+    for (uint32_t i = 1; i < count(); i++)
+    {
+      if (is_file(i))
+      {
+        offsets.push_back(placed[i]);
+      }
+    }
+
+    relocate(offsets);
+    return m_file_offset;
   }
 
   /*
-    Summary: 
-      Calculates the total end size of the FST without padding given a root directory
+    Summary:
+      Walks a directory once and records every entry in the order it will appear in the FST.
+      Entries in each directory are sorted by name so the table does not depend on the order
+      the filesystem lists them in.
 
     Parameters:
       std::string root: The directory that is used as the root of the FST (usually the ./files directory)
 
     Returns:
-      uint32_t with the total calculated size
+      Every file and directory under root. Entry i here is node i + 1 in the FST.
   */
-  uint32_t FST::calculate_size(std::string root)
+  std::vector<ScanEntry> FST::scan(std::string root)
   {
-    fs::recursive_directory_iterator dir(root), end;
+    std::vector<ScanEntry> entries;
+    scan_directory(root, 0, entries);
+    return entries;
+  }
 
-    //  Start the size at the total size for all nodes which is (File + Directory count + 1) * NodeSize
-    uint32_t total_size = (count_entries(root) + 1) * NodeSize;
+  /*
+    Summary:
+      Appends the sorted contents of one directory, with each subdirectory followed by its own
+      contents
+
+    Parameters:
+      directory: Directory to list
+      parent: Entry index of the directory, 0 for the root
+      entries: Receives the entries
+  */
+  void FST::scan_directory(std::string directory, uint32_t parent, std::vector<ScanEntry>& entries)
+  {
+    std::vector<ScanEntry> children;
 
-    while (dir != end)
+    for (fs::directory_iterator dir(directory), end; dir != end; ++dir)
     {
-      //  Add the string length + 1 for the null padding
-      total_size += dir->path().filename().string().length() + 1;
-      ++dir;
+      ScanEntry entry;
+      entry.name = dir->path().filename().string();
+      entry.path = dir->path().string();
+      entry.file = fs::is_regular_file(dir->status());
+      uint64_t size = entry.file ? fs::file_size(dir->path()) : 0;
+      stats::add_syscalls(entry.file ? 2 : 1);
+
+      //  Sizes are stored in 4 bytes
+      if (size > UINT32_MAX)
+      {
+        throw std::runtime_error("Too large for a disc: " + entry.path);
+      }
+
+      entry.size = static_cast<uint32_t>(size);
+      entry.parent = parent;
+      entry.next = 0;
+
+      //  Only real directories are walked into, the same as a recursive iterator would
+      if (!entry.file && !fs::is_directory(dir->symlink_status()))
+      {
+        entry.next = UINT32_MAX;
+      }
+
+      children.push_back(std::move(entry));
     }
 
-    return total_size;
+    std::sort(children.begin(), children.end(), [](const ScanEntry& a, const ScanEntry& b)
+    {
+      return name_less(a.name, b.name);
+    });
+
+    for (auto& child : children)
+    {
+      uint32_t index = static_cast<uint32_t>(entries.size()) + 1;
+      bool walk = !child.file && child.next != UINT32_MAX;
+      std::string path = child.path;
+
+      entries.push_back(std::move(child));
+
+      if (walk)
+      {
+        scan_directory(path, index, entries);
+      }
+
+      //  A directory's entries run up to whatever comes after its contents
+      if (!entries[index - 1].file)
+      {
+        entries[index - 1].next = static_cast<uint32_t>(entries.size()) + 1;
+      }
+    }
   }
-}
\ No newline at end of file
+}
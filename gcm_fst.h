@@ -3,9 +3,15 @@
 
 #include <cstdint>
 #include <algorithm>
-#include <vector>
-#include <map>
 #include <iterator>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <unordered_map>
 
 #include <boost/filesystem.hpp>
 #include <boost/algorithm/string.hpp>
@@ -27,44 +33,44 @@ namespace fst
       m_size_next_offset = size_nextoff;
     }
 
-    Node(std::vector<uint8_t>& data);
+    Node(std::span<const uint8_t> data);
 
-    inline uint32_t type()
+    inline uint32_t type() const
     {
       return (m_type_string_offset & 0xFF000000) >> 24;
     }
 
-    inline bool is_file()
+    inline bool is_file() const
     {
       return type() == 0;
     }
 
-    inline bool is_dir()
+    inline bool is_dir() const
     {
       return type() == 1;
     }
 
-    inline uint32_t string_offset()
+    inline uint32_t string_offset() const
     {
       return m_type_string_offset & 0x00FFFFFF;
     }
 
-    inline uint32_t data_offset()
+    inline uint32_t data_offset() const
     {
       return m_file_parent_offset;
     }
 
-    inline uint32_t data_size()
+    inline uint32_t data_size() const
     {
       return m_size_next_offset;
     }
 
-    inline uint32_t next_offset()
+    inline uint32_t next_offset() const
     {
       return m_size_next_offset;
     }
 
-    inline uint32_t total_entries()
+    inline uint32_t total_entries() const
     {
       return m_size_next_offset;
     }
@@ -84,17 +90,17 @@ namespace fst
       m_fileoffset = offset;
     }
 
-    inline std::string path()
+    inline const std::string& path() const
     {
       return m_path;
     }
 
-    inline uint32_t size()
+    inline uint32_t size() const
     {
       return m_filesize;
     }
 
-    inline uint32_t offset()
+    inline uint32_t offset() const
     {
       return m_fileoffset;
     }
@@ -104,40 +110,212 @@ namespace fst
     uint32_t m_fileoffset;
   };
 
+  //  Order of the names in one directory of a built table
+  bool name_less(const std::string& a, const std::string& b);
+
+  //  A file or directory of a table being built, found by scanning the root directory or given by a Builder
+  struct ScanEntry
+  {
+    std::string name;   //  File or directory name
+    std::string path;   //  Full path on disk, empty for data a Builder holds in memory
+    bool file;          //  True for regular files
+    uint32_t size;      //  File size, unused for directories
+    uint32_t parent;    //  Index of the parent directory entry
+    uint32_t next;      //  Index just past the last entry inside this directory
+  };
+
+  /*
+    Summary:
+      Forward iterator over the indexes of either the file or the directory entries of a
+      table, in table order. It reads the table in place, so it stays valid only as long as
+      the table is not changed.
+  */
+  struct EntryIterator
+  {
+    using iterator_category = std::forward_iterator_tag;
+    using value_type = uint32_t;
+    using difference_type = std::ptrdiff_t;
+    using pointer = const uint32_t *;
+    using reference = uint32_t;
+
+    EntryIterator() : m_types(nullptr), m_index(0), m_type(0) {};
+
+    EntryIterator(const std::vector<uint8_t> *types, uint32_t index, uint8_t type) : m_types(types), m_index(index), m_type(type)
+    {
+      skip();
+    }
+
+    inline uint32_t operator*() const
+    {
+      return m_index;
+    }
+
+    inline EntryIterator& operator++()
+    {
+      m_index++;
+      skip();
+      return *this;
+    }
+
+    inline EntryIterator operator++(int)
+    {
+      EntryIterator ret = *this;
+      ++(*this);
+      return ret;
+    }
+
+    inline bool operator==(const EntryIterator& other) const
+    {
+      return m_index == other.m_index;
+    }
+  private:
+    const std::vector<uint8_t> *m_types;
+    uint32_t m_index;
+    uint8_t m_type;
+
+    //  Moves forward to the next entry of the wanted type, or to the end
+    inline void skip()
+    {
+      while (m_index < m_types->size() && (*m_types)[m_index] != m_type)
+      {
+        m_index++;
+      }
+    }
+  };
+
+  struct EntryRange
+  {
+    EntryIterator first;
+    EntryIterator last;
+
+    inline EntryIterator begin() const
+    {
+      return first;
+    }
+
+    inline EntryIterator end() const
+    {
+      return last;
+    }
+  };
+
   struct FST
   {
-    FST() : m_root(), m_strtable_size(0), m_file_offset(0) {};
+    FST() : m_root(), m_string_start(0), m_indexed(std::make_unique<std::once_flag>()), m_strtable_size(0), m_file_offset(0), m_padding(0) {};
     FST(std::string root, uint32_t fst_offset);
-    FST(std::vector<uint8_t>& data);
+    FST(std::vector<ScanEntry> entries, uint32_t fst_offset);
+    FST(std::span<const uint8_t> data);
+
+    //  Number of entries including the root
+    inline uint32_t count() const
+    {
+      return static_cast<uint32_t>(m_types.size());
+    }
+
+    inline bool is_dir(uint32_t index) const
+    {
+      return m_types[index] == 1;
+    }
+
+    inline bool is_file(uint32_t index) const
+    {
+      return m_types[index] == 0;
+    }
+
+    //  Index of the directory that contains this entry
+    inline uint32_t parent(uint32_t index) const
+    {
+      return m_parents[index];
+    }
+
+    //  File data offset, or the parent offset stored on disc for directories
+    inline uint32_t data_offset(uint32_t index) const
+    {
+      return m_offsets[index];
+    }
+
+    //  File size, or the next offset for directories
+    inline uint32_t data_size(uint32_t index) const
+    {
+      return m_sizes[index];
+    }
 
-    inline std::map<std::string, Node> entries()
+    inline Node node(uint32_t index) const
     {
-      return m_nodes;
+      return Node(is_file(index), m_name_offsets[index], m_offsets[index], m_sizes[index]);
     }
 
-    inline std::vector<uint8_t> raw()
+    std::string_view name(uint32_t index) const;
+    std::string path(uint32_t index) const;
+    std::optional<uint32_t> find(std::string_view path) const;
+    std::vector<uint32_t> match(std::string_view pattern) const;
+    void relocate(const std::vector<uint32_t>& offsets);
+    uint32_t pack(uint32_t fst_offset, const std::vector<uint32_t>& order = {}, uint32_t align = 0x10);
+
+    //  Entry indexes of every file, or every directory other than the root, in table order
+    inline EntryRange files() const
+    {
+      return EntryRange{ EntryIterator(&m_types, 1, 0), EntryIterator(&m_types, count(), 0) };
+    }
+
+    inline EntryRange directories() const
+    {
+      return EntryRange{ EntryIterator(&m_types, 1, 1), EntryIterator(&m_types, count(), 1) };
+    }
+
+    /*
+      Summary:
+        Walks the entries beneath a directory in table order, building each path in one
+        buffer instead of walking up the parents of every entry
+
+      Parameters:
+        dir: Entry index of the directory to start from, 0 for the whole table
+        visitor: Called as visitor(index, path) for each entry, with the path starting with
+                 "./". The path is only valid during the call. Returning false from a
+                 directory skips its contents.
+    */
+    template <typename Visitor>
+    void visit(uint32_t dir, Visitor&& visitor) const
+    {
+      std::string buffer = path(dir);
+      visit_children(dir, buffer, visitor);
+    }
+
+    inline std::span<const uint8_t> raw() const
     {
       return m_raw;
     }
 
-    inline std::vector<FileData> files()
+    //  Files found on disk when building, with their paths on disk. Empty for a parsed table.
+    inline const std::vector<FileData>& sources() const
     {
       return m_files;
     }
 
-    inline uint32_t size()
+    inline uint32_t size() const
     {
-      return calculate_size(m_root_path);
+      return m_raw.size() - m_padding;
     }
 
-    inline uint32_t rawsize()
+    inline uint32_t rawsize() const
     {
       return m_raw.size() - m_padding;
     }
   private:
-    std::string m_root_path;              //  Store the root path provided if using the FST(std::string, uint32_t) constructor
     Node m_root;                          //  Store the root node separately 
-    std::map<std::string, Node> m_nodes;  //  Store each node indexed by its path
+
+    //  Every node split into flat arrays, indexed by entry number
+    std::vector<uint8_t> m_types;
+    std::vector<uint32_t> m_name_offsets;
+    std::vector<uint32_t> m_offsets;
+    std::vector<uint32_t> m_sizes;
+    std::vector<uint32_t> m_parents;
+    uint32_t m_string_start;
+
+    //  Maps a hash of (parent, name) to entry indexes. Built once by the first call to find,
+    //  whichever thread makes it.
+    mutable std::unordered_multimap<size_t, uint32_t> m_index;
+    mutable std::unique_ptr<std::once_flag> m_indexed;
 
     uint32_t m_strtable_size; //  Size of the entire string table
     uint32_t m_file_offset;   //  The current file offset used when adding a file to the FST
@@ -149,14 +327,41 @@ namespace fst
     //  Stores information like path, file size, and file data offset
     std::vector<FileData> m_files;
 
-    std::string compact_path(std::vector<std::pair<std::string, uint32_t>>& path);
-    uint32_t calculate_size(std::string root);
+    static std::vector<ScanEntry> scan(std::string root);
+    static void scan_directory(std::string directory, uint32_t parent, std::vector<ScanEntry>& entries);
+    void parse();
+    void match_children(uint32_t dir, const std::vector<std::string_view>& parts, size_t depth, std::vector<uint32_t>& out) const;
 
+    //  Index just past a directory's entries, clamped to the table
+    inline uint32_t end_of(uint32_t index) const
+    {
+      return (index == 0) ? count() : std::clamp(m_sizes[index], index + 1, count());
+    }
+
+    template <typename Visitor>
+    void visit_children(uint32_t dir, std::string& path, Visitor& visitor) const
+    {
+      size_t length = path.size();
+
+      //  Step from sibling to sibling, jumping over the contents of directories that are not walked into
+      for (uint32_t i = dir + 1; i < end_of(dir); i = is_dir(i) ? end_of(i) : i + 1)
+      {
+        path.resize(length);
+        path += '/';
+        path += name(i);
+
+        if (visitor(i, std::string_view(path)) && is_dir(i))
+        {
+          visit_children(i, path, visitor);
+        }
+      }
+
+      path.resize(length);
+    }
 
-    inline uint32_t count_entries(std::string path)
+    inline size_t child_hash(uint32_t parent, std::string_view name) const
     {
-      return std::distance(boost::filesystem::recursive_directory_iterator(path),
-                           boost::filesystem::recursive_directory_iterator());
+      return std::hash<std::string_view>()(name) ^ (parent * 0x9E3779B97F4A7C15ull);
     }
   };
 }
@@ -0,0 +1,439 @@
+#include "gcm_gcz.h"
+#include "gcm_reader.h"
+#include "pool.h"
+#include "stats.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <zlib.h>
+
+namespace gcm
+{
+  namespace
+  {
+    //  Blocks compressed per batch for each worker thread before the batch is written out
+    const uint32_t BlocksPerJob = 16;
+
+    inline std::runtime_error io_error(std::string what, std::string path)
+    {
+      return std::runtime_error(what + " " + path + ": " + strerror(errno));
+    }
+
+    void pwrite_all(int fd, const uint8_t *data, uint64_t count, uint64_t offset, std::string path)
+    {
+      uint64_t done = 0;
+
+      while (done < count)
+      {
+        ssize_t result = pwrite(fd, data + done, static_cast<size_t>(count - done), offset + done);
+        stats::add_write(result > 0 ? result : 0, 1);
+
+        if (result < 0)
+        {
+          if (errno == EINTR)
+          {
+            continue;
+          }
+
+          throw io_error("Could not write", path);
+        }
+
+        done += result;
+      }
+    }
+
+    //  File shared by the blocks of one segment. The first block to need it opens it, and it is
+    //  closed once every byte of the segment has been filled, so only the files whose blocks are
+    //  being compressed are open at a time.
+    struct SegmentFile
+    {
+      SegmentFile(std::string path, uint64_t count) : path(path), fd(-1), left(count) {}
+
+      ~SegmentFile()
+      {
+        if (fd >= 0)
+        {
+          close(fd);
+        }
+      }
+
+      std::string path;
+      std::mutex lock;
+      int fd;
+      uint64_t left;
+    };
+  }
+
+  namespace gcz
+  {
+    bool is_gcz(std::span<const uint8_t> data)
+    {
+      return data.size() >= HeaderSize && util::read<uint32_t>(data) == Magic;
+    }
+  }
+
+  /*
+    Summary:
+      Reads the header and block tables of a GCZ image
+
+    Parameters:
+      file: The whole GCZ file, usually memory mapped
+      path: Path of the file, used in error messages
+  */
+  GczImage::GczImage(std::span<const uint8_t> file, std::string path) : m_file(file), m_path(path)
+  {
+    if (!gcz::is_gcz(file))
+    {
+      throw std::runtime_error(path + " is not a GCZ image");
+    }
+
+    m_compressed_size = util::read<uint64_t>(file, 0x08);
+    m_data_size = util::read<uint64_t>(file, 0x10);
+    m_block_size = util::read<uint32_t>(file, 0x18);
+    uint32_t blocks = util::read<uint32_t>(file, 0x1C);
+
+    m_data_start = gcz::HeaderSize + static_cast<uint64_t>(blocks) * 12;
+
+    if (m_block_size == 0 || m_data_start > file.size() || m_compressed_size > file.size() - m_data_start ||
+        static_cast<uint64_t>(blocks) * m_block_size < m_data_size)
+    {
+      throw std::runtime_error(path + " has a broken GCZ header");
+    }
+
+    m_pointers.resize(blocks);
+    m_hashes.resize(blocks);
+
+    for (uint32_t i = 0; i < blocks; i++)
+    {
+      m_pointers[i] = util::read<uint64_t>(file, gcz::HeaderSize + i * 8);
+      m_hashes[i] = util::read<uint32_t>(file, gcz::HeaderSize + blocks * 8 + i * 4);
+    }
+  }
+
+  /*
+    Summary:
+      Decompresses one block and checks it against its stored hash
+
+    Parameters:
+      block: Index of the block
+      out: Receives block_size bytes. The end of the last block past the image is left as zeros.
+  */
+  void GczImage::decode(uint64_t block, uint8_t *out) const
+  {
+    bool raw = (m_pointers[block] & gcz::RawBlock) != 0;
+    uint64_t start = m_pointers[block] & ~gcz::RawBlock;
+    uint64_t end = (block + 1 < m_pointers.size()) ? (m_pointers[block + 1] & ~gcz::RawBlock) : m_compressed_size;
+
+    if (start > end || end > m_compressed_size)
+    {
+      throw std::runtime_error(m_path + " has a broken block table");
+    }
+
+    const uint8_t *data = m_file.data() + m_data_start + start;
+    uint64_t count = end - start;
+
+    stats::add_read(count);
+
+    if (adler32(adler32(0, nullptr, 0), data, static_cast<uInt>(count)) != m_hashes[block])
+    {
+      throw std::runtime_error(m_path + " is corrupt at block " + std::to_string(block));
+    }
+
+    if (raw)
+    {
+      memcpy(out, data, static_cast<size_t>(std::min<uint64_t>(count, m_block_size)));
+      memset(out + std::min<uint64_t>(count, m_block_size), 0, m_block_size - std::min<uint64_t>(count, m_block_size));
+      return;
+    }
+
+    uLongf out_size = m_block_size;
+    uLong in_size = static_cast<uLong>(count);
+
+    if (uncompress2(out, &out_size, data, &in_size) != Z_OK)
+    {
+      throw std::runtime_error(m_path + " could not be decompressed at block " + std::to_string(block));
+    }
+
+    memset(out + out_size, 0, m_block_size - out_size);
+  }
+
+  GczWriter::GczWriter(std::string file, uint64_t size, uint32_t block_size) : m_path(file), m_size(size), m_block_size(block_size)
+  {
+  }
+
+  /*
+    Summary:
+      Places a block of data in the image
+
+    Parameters:
+      offset: Offset into the uncompressed image
+      data: Data to place there
+  */
+  void GczWriter::add(uint64_t offset, std::vector<uint8_t> data)
+  {
+    uint64_t size = data.size();
+    auto shared = std::make_shared<std::vector<uint8_t>>(std::move(data));
+
+    m_segments.push_back(Segment{ offset, size, [shared](uint64_t from, std::span<uint8_t> out)
+    {
+      std::copy_n(shared->begin() + from, out.size(), out.begin());
+    } });
+  }
+
+  /*
+    Summary:
+      Places the contents of a file in the image. The file is read when its blocks are
+      compressed. If it is shorter than count the rest of the range is left as zeros.
+
+    Parameters:
+      offset: Offset into the uncompressed image
+      path: File to read from
+      count: Number of bytes the file occupies in the image
+  */
+  void GczWriter::add_file(uint64_t offset, std::string path, uint64_t count)
+  {
+    auto file = std::make_shared<SegmentFile>(path, count);
+
+    m_segments.push_back(Segment{ offset, count, [file](uint64_t from, std::span<uint8_t> out)
+    {
+      int fd;
+
+      {
+        std::lock_guard<std::mutex> guard(file->lock);
+
+        if (file->fd < 0)
+        {
+          file->fd = open(file->path.c_str(), O_RDONLY);
+          stats::add_syscalls();
+
+          if (file->fd < 0)
+          {
+            throw io_error("Could not open", file->path);
+          }
+        }
+
+        fd = file->fd;
+      }
+
+      size_t done = 0;
+
+      while (done < out.size())
+      {
+        ssize_t got = pread(fd, out.data() + done, out.size() - done, from + done);
+        stats::add_read(got > 0 ? got : 0, 1);
+
+        if (got < 0 && errno == EINTR)
+        {
+          continue;
+        }
+
+        if (got < 0)
+        {
+          throw io_error("Could not read", file->path);
+        }
+
+        if (got == 0)
+        {
+          break;
+        }
+
+        done += got;
+      }
+
+      std::lock_guard<std::mutex> guard(file->lock);
+      file->left -= out.size();
+
+      if (file->left == 0)
+      {
+        close(file->fd);
+        stats::add_syscalls();
+        file->fd = -1;
+      }
+    } });
+  }
+
+  /*
+    Summary:
+      Places a byte range of another disc in the image
+
+    Parameters:
+      offset: Offset into the uncompressed image
+      disc: Disc to read from. Must stay open until write returns.
+      source: Offset of the range in disc
+      count: Number of bytes to copy
+  */
+  void GczWriter::add_range(uint64_t offset, const DiscReader& disc, uint64_t source, uint64_t count)
+  {
+    m_segments.push_back(Segment{ offset, count, [&disc, source](uint64_t from, std::span<uint8_t> out)
+    {
+      size_t done = 0;
+
+      disc.stream(source + from, out.size(), [&out, &done](std::span<const uint8_t> piece)
+      {
+        std::copy(piece.begin(), piece.end(), out.begin() + done);
+        done += piece.size();
+      });
+    } });
+  }
+
+  //  Builds one uncompressed block from every segment that overlaps it
+  void GczWriter::fill_block(uint64_t block, std::vector<uint8_t>& out) const
+  {
+    uint64_t start = block * m_block_size;
+    uint64_t end = start + m_block_size;
+
+    std::fill(out.begin(), out.end(), 0);
+
+    //  Segments are sorted and never overlap, so start from the first one that ends past start
+    auto it = std::partition_point(m_segments.begin(), m_segments.end(), [start](const Segment& segment)
+    {
+      return segment.offset + segment.size <= start;
+    });
+
+    for (; it != m_segments.end() && it->offset < end; ++it)
+    {
+      uint64_t from = std::max(start, it->offset);
+      uint64_t to = std::min(end, it->offset + it->size);
+
+      if (from < to)
+      {
+        it->fill(from - it->offset, std::span<uint8_t>(&out[from - start], static_cast<size_t>(to - from)));
+      }
+    }
+  }
+
+  /*
+    Summary:
+      Compresses every block on a pool of worker threads and writes the image. Blocks that do
+      not get smaller are stored as they are, as Dolphin does.
+
+    Parameters:
+      jobs: Number of worker threads
+      shared: Pool to compress on instead of starting one, if any
+  */
+  void GczWriter::write(uint32_t jobs, util::ThreadPool *shared)
+  {
+    std::sort(m_segments.begin(), m_segments.end(), [](const Segment& a, const Segment& b)
+    {
+      return a.offset < b.offset;
+    });
+
+    uint64_t blocks = (m_size + m_block_size - 1) / m_block_size;
+
+    if (blocks > UINT32_MAX)
+    {
+      throw std::runtime_error("Too many blocks for a GCZ image");
+    }
+
+    int fd = open(m_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    stats::add_syscalls(2);  //  open and close
+
+    if (fd < 0)
+    {
+      throw io_error("Could not create", m_path);
+    }
+
+    struct Compressed
+    {
+      std::vector<uint8_t> data;
+      bool raw;
+      uint32_t hash;
+    };
+
+    std::vector<uint64_t> pointers(blocks);
+    std::vector<uint32_t> hashes(blocks);
+    uint64_t data_start = gcz::HeaderSize + blocks * 12;
+    uint64_t position = 0;
+
+    try
+    {
+      util::TaskGroup pool(shared, jobs);
+      uint64_t batch = std::max<uint64_t>(pool.size() * BlocksPerJob, 1);
+      std::vector<Compressed> results(static_cast<size_t>(std::min(batch, blocks)));
+
+      for (uint64_t first = 0; first < blocks; first += batch)
+      {
+        uint64_t count = std::min(batch, blocks - first);
+
+        for (uint64_t i = 0; i < count; i++)
+        {
+          pool.submit([this, &results, first, i]()
+          {
+            thread_local std::vector<uint8_t> block;
+            block.resize(m_block_size);
+            fill_block(first + i, block);
+
+            auto& result = results[static_cast<size_t>(i)];
+            uLongf size = compressBound(m_block_size);
+            result.data.resize(size);
+            result.raw = compress2(&result.data[0], &size, &block[0], m_block_size, Z_DEFAULT_COMPRESSION) != Z_OK || size >= m_block_size;
+
+            if (result.raw)
+            {
+              result.data.assign(block.begin(), block.end());
+            }
+            else
+            {
+              result.data.resize(size);
+            }
+
+            result.hash = adler32(adler32(0, nullptr, 0), &result.data[0], static_cast<uInt>(result.data.size()));
+          });
+        }
+
+        pool.wait();
+
+        //  Blocks go out in order, straight after the tables
+        for (uint64_t i = 0; i < count; i++)
+        {
+          auto& result = results[static_cast<size_t>(i)];
+          pointers[first + i] = position | (result.raw ? gcz::RawBlock : 0);
+          hashes[first + i] = result.hash;
+
+          pwrite_all(fd, result.data.data(), result.data.size(), data_start + position, m_path);
+          position += result.data.size();
+        }
+      }
+
+      //  The tables can only be written once every block has its final place
+      std::vector<uint8_t> tables;
+      tables.reserve(static_cast<size_t>(data_start));
+
+      util::push_int<uint32_t>(tables, gcz::Magic);
+      util::push_int<uint32_t>(tables, 0);          //  GameCube disc
+      util::push_int<uint64_t>(tables, position);   //  Size of the compressed data
+      util::push_int<uint64_t>(tables, m_size);     //  Size of the uncompressed image
+      util::push_int<uint32_t>(tables, m_block_size);
+      util::push_int<uint32_t>(tables, static_cast<uint32_t>(blocks));
+
+      for (auto pointer : pointers)
+      {
+        util::push_int<uint64_t>(tables, pointer);
+      }
+
+      for (auto hash : hashes)
+      {
+        util::push_int<uint32_t>(tables, hash);
+      }
+
+      pwrite_all(fd, tables.data(), tables.size(), 0, m_path);
+    }
+    catch (...)
+    {
+      close(fd);
+      throw;
+    }
+
+    if (close(fd) != 0)
+    {
+      throw io_error("Could not close", m_path);
+    }
+  }
+}
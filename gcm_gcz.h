@@ -0,0 +1,102 @@
+#ifndef _GCM_GCZ_H
+#define _GCM_GCZ_H
+
+#include <cstdint>
+#include <functional>
+#include <span>
+#include <string>
+#include <vector>
+
+namespace util
+{
+  struct ThreadPool;
+}
+
+namespace gcm
+{
+  struct DiscReader;
+
+  //  Dolphin's compressed image format. All fields are little endian.
+  namespace gcz
+  {
+    const uint32_t Magic = 0xB10BC001;
+    const uint32_t HeaderSize = 0x20;
+    const uint32_t DefaultBlockSize = 0x8000;
+
+    //  Set in a block pointer when the block is stored without compression
+    const uint64_t RawBlock = 1ull << 63;
+
+    bool is_gcz(std::span<const uint8_t> data);
+  }
+
+  /*
+    Summary:
+      Block table of a GCZ image held in memory. Any block can be decompressed on its own,
+      from any thread.
+  */
+  struct GczImage
+  {
+    GczImage(std::span<const uint8_t> file, std::string path);
+
+    inline uint64_t size() const
+    {
+      return m_data_size;
+    }
+
+    inline uint32_t block_size() const
+    {
+      return m_block_size;
+    }
+
+    inline uint64_t block_count() const
+    {
+      return m_pointers.size();
+    }
+
+    void decode(uint64_t block, uint8_t *out) const;
+  private:
+    std::span<const uint8_t> m_file;
+    std::string m_path;
+    uint64_t m_data_size;
+    uint32_t m_block_size;
+    uint64_t m_data_start;
+    uint64_t m_compressed_size;
+
+    std::vector<uint64_t> m_pointers;   //  Offset of each block after the tables, with RawBlock flag
+    std::vector<uint32_t> m_hashes;     //  Adler-32 of each block as stored
+  };
+
+  /*
+    Summary:
+      Writes a GCZ image from pieces placed at their offsets in the uncompressed image. Pieces
+      are only read when the blocks they fall in are compressed, which happens on a pool of
+      worker threads. Blocks are written in order as each batch finishes, so nothing the size
+      of the uncompressed image is ever held or written.
+  */
+  struct GczWriter
+  {
+    GczWriter(std::string file, uint64_t size, uint32_t block_size = gcz::DefaultBlockSize);
+
+    void add(uint64_t offset, std::vector<uint8_t> data);
+    void add_file(uint64_t offset, std::string path, uint64_t count);
+    void add_range(uint64_t offset, const DiscReader& disc, uint64_t source, uint64_t count);
+    void write(uint32_t jobs, util::ThreadPool *shared = nullptr);
+  private:
+    //  A piece of the image. fill copies the piece's data starting at a position inside it.
+    struct Segment
+    {
+      uint64_t offset;
+      uint64_t size;
+      std::function<void(uint64_t, std::span<uint8_t>)> fill;
+    };
+
+    std::string m_path;
+    uint64_t m_size;
+    uint32_t m_block_size;
+    std::vector<Segment> m_segments;
+
+    void fill_block(uint64_t block, std::vector<uint8_t>& out) const;
+  };
+}
+
+#endif
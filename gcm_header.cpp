@@ -2,34 +2,48 @@
 
 namespace gcm
 {
-  Header::Header(std::string file)
+  Header::Header(std::string file) : Header(DiscReader(file))
   {
-    //  Read in each section of data from the file
+  }
+
+  Header::Header(const DiscReader& disc) : Header(disc.view(0, Size))
+  {
+  }
+
+  //  Reads a header from its raw data, as extract writes it to sys/header.bin
+  Header::Header(std::span<const uint8_t> data)
+  {
+    if (data.size() < Size)
+    {
+      throw std::runtime_error("A disc header must be " + std::to_string(Size) + " bytes");
+    }
+
+    //  Read in each section of data from the disc
 
-    m_identifier = util::read(file, Header::Offset::ConsoleID, 6);
+    m_identifier = std::string(data.begin() + Header::Offset::ConsoleID, data.begin() + Header::Offset::ConsoleID + 6);
 
-    m_disk_id = util::read_big<uint8_t>(file, Header::Offset::DiskID);
-    m_version = util::read_big<uint8_t>(file, Header::Offset::Version);
-    m_audio_streaming = util::read_big<uint8_t>(file, Header::Offset::AudoStreaming);
-    m_stream_buffer_size = util::read_big<uint8_t>(file, Header::Offset::StreamBufferSize);
+    m_disk_id = util::read_big<uint8_t>(data, Header::Offset::DiskID);
+    m_version = util::read_big<uint8_t>(data, Header::Offset::Version);
+    m_audio_streaming = util::read_big<uint8_t>(data, Header::Offset::AudoStreaming);
+    m_stream_buffer_size = util::read_big<uint8_t>(data, Header::Offset::StreamBufferSize);
 
-    m_magic = util::read_big<uint32_t>(file, Header::Offset::MagicWord);
+    m_magic = util::read_big<uint32_t>(data, Header::Offset::MagicWord);
 
-    m_name = util::read(file, Header::Offset::Name, 0x3E0);
+    m_name = std::string(data.begin() + Header::Offset::Name, data.begin() + Header::Offset::Name + 0x3E0);
 
-    m_debug_offset = util::read_big<uint32_t>(file, Header::Offset::DebugOffset);
-    m_debug_load_addr = util::read_big<uint32_t>(file, Header::Offset::DebugAddress);
+    m_debug_offset = util::read_big<uint32_t>(data, Header::Offset::DebugOffset);
+    m_debug_load_addr = util::read_big<uint32_t>(data, Header::Offset::DebugAddress);
 
-    m_dol_offset = util::read_big<uint32_t>(file, Header::Offset::DOLOffset);
-    m_fst_offset = util::read_big<uint32_t>(file, Header::Offset::FSTOffset);
-    m_fst_size = util::read_big<uint32_t>(file, Header::Offset::FSTSize);
-    m_fst_max_size = util::read_big<uint32_t>(file, Header::Offset::FSTMaxSize);
+    m_dol_offset = util::read_big<uint32_t>(data, Header::Offset::DOLOffset);
+    m_fst_offset = util::read_big<uint32_t>(data, Header::Offset::FSTOffset);
+    m_fst_size = util::read_big<uint32_t>(data, Header::Offset::FSTSize);
+    m_fst_max_size = util::read_big<uint32_t>(data, Header::Offset::FSTMaxSize);
 
-    m_user_position = util::read_big<uint32_t>(file, Header::Offset::UserPosition);
-    m_user_length = util::read_big<uint32_t>(file, Header::Offset::UserLength);
+    m_user_position = util::read_big<uint32_t>(data, Header::Offset::UserPosition);
+    m_user_length = util::read_big<uint32_t>(data, Header::Offset::UserLength);
 
-    m_unknown = util::read_big<uint32_t>(file, Header::Offset::Unknown);
-    m_zero3 = util::read_big<uint32_t>(file, Header::Offset::Zero3);
+    m_unknown = util::read_big<uint32_t>(data, Header::Offset::Unknown);
+    m_zero3 = util::read_big<uint32_t>(data, Header::Offset::Zero3);
   }
 
   /*
@@ -39,7 +53,7 @@ namespace gcm
     Returns:
       The raw header data that was built from the current data in the class
   */
-  std::vector<uint8_t> Header::raw()
+  std::vector<uint8_t> Header::raw() const
   {
     std::vector<uint8_t> data;
 
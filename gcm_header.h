@@ -1,7 +1,12 @@
 #ifndef _GCM_HEADER_H
 #define _GCM_HEADER_H
 
-#include "gcm.h"
+#include <cstdint>
+#include <span>
+#include <string>
+#include <vector>
+
+#include "gcm_reader.h"
 
 namespace gcm
 {
@@ -9,8 +14,28 @@ namespace gcm
   {
     Header() {};
     Header(std::string file);
+    Header(const DiscReader& disc);
+    Header(std::span<const uint8_t> data);
+
+    //  Size of the header, which bi2.bin follows
+    static const uint32_t Size = 0x440;
+
+    std::vector<uint8_t> raw() const;
+
+    inline uint32_t dol_offset() const
+    {
+      return m_dol_offset;
+    }
 
-    std::vector<uint8_t> raw();
+    inline uint32_t fst_offset() const
+    {
+      return m_fst_offset;
+    }
+
+    inline uint32_t fst_size() const
+    {
+      return m_fst_size;
+    }
 
     inline void set_fst_offset(uint32_t value)
     {
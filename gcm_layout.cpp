@@ -0,0 +1,194 @@
+#include "gcm_layout.h"
+#include "fileio.h"
+#include "logging.h"
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <unordered_map>
+
+namespace gcm
+{
+  namespace
+  {
+    //  Lets a map keyed by path be searched with a string_view without building a string
+    struct PathHash
+    {
+      using is_transparent = void;
+
+      inline size_t operator()(std::string_view path) const
+      {
+        return std::hash<std::string_view>()(path);
+      }
+    };
+
+    inline std::string trim(std::string value)
+    {
+      size_t start = value.find_first_not_of(" \t\r\n");
+      size_t end = value.find_last_not_of(" \t\r\n");
+      return (start == std::string::npos) ? std::string() : value.substr(start, end - start + 1);
+    }
+
+    //  Finds the file a trace line names. Lines may start with a log prefix such as a time or
+    //  "FileMonitor:", and paths may be given with or without a leading "./" or "/".
+    std::optional<uint32_t> find_traced(const fst::FST& fst, std::string line)
+    {
+      line = trim(line);
+      size_t start = 0;
+
+      //  Try the whole line, then drop one leading word at a time
+      while (start < line.size())
+      {
+        auto found = fst.find(std::string_view(line).substr(start));
+
+        if (found && fst.is_file(*found))
+        {
+          return found;
+        }
+
+        size_t space = line.find(' ', start);
+
+        if (space == std::string::npos)
+        {
+          break;
+        }
+
+        start = line.find_first_not_of(' ', space);
+      }
+
+      return std::nullopt;
+    }
+  }
+
+  /*
+    Summary:
+      Orders files the way their data was ordered in another FST, usually the one from the
+      original disc. Files are matched by path. Files the other FST does not have follow in
+      table order.
+
+    Parameters:
+      fst: Table being laid out
+      original: Table whose data offsets give the order
+
+    Returns:
+      Entry indexes of the files in fst in the order their data should be placed
+  */
+  std::vector<uint32_t> order_by_offset(const fst::FST& fst, const fst::FST& original)
+  {
+    std::unordered_map<std::string, uint32_t, PathHash, std::equal_to<>> offsets;
+
+    original.visit(0, [&](uint32_t i, std::string_view path)
+    {
+      if (original.is_file(i))
+      {
+        offsets.emplace(path, original.data_offset(i));
+      }
+
+      return true;
+    });
+
+    std::vector<std::pair<uint64_t, uint32_t>> keyed;
+
+    fst.visit(0, [&](uint32_t i, std::string_view path)
+    {
+      if (fst.is_file(i))
+      {
+        auto found = offsets.find(path);
+        uint64_t key = (found != offsets.end()) ? found->second : (1ull << 32) + i;
+        keyed.push_back(std::make_pair(key, i));
+      }
+
+      return true;
+    });
+
+    //  Ties keep table order, which matters for empty files that share an offset
+    std::stable_sort(keyed.begin(), keyed.end(), [](const auto& a, const auto& b)
+    {
+      return a.first < b.first;
+    });
+
+    std::vector<uint32_t> ret;
+    ret.reserve(keyed.size());
+
+    for (auto& entry : keyed)
+    {
+      ret.push_back(entry.second);
+    }
+
+    return ret;
+  }
+
+  /*
+    Summary:
+      Orders files by the first time a trace reads them. A trace is a text file with one path
+      per line, such as a file access log from an emulator. Files the trace never reads follow
+      in table order.
+
+    Parameters:
+      fst: Table being laid out
+      trace: Path of the trace
+
+    Returns:
+      Entry indexes of the traced files in first read order
+  */
+  std::vector<uint32_t> order_by_trace(const fst::FST& fst, std::string trace)
+  {
+    std::ifstream in(trace);
+
+    if (!in)
+    {
+      throw std::runtime_error("Could not open trace " + trace);
+    }
+
+    std::vector<uint32_t> ret;
+    std::vector<bool> seen(fst.count(), false);
+    std::string line;
+    uint32_t unmatched = 0;
+
+    while (std::getline(in, line))
+    {
+      if (trim(line).empty())
+      {
+        continue;
+      }
+
+      auto found = find_traced(fst, line);
+
+      if (!found)
+      {
+        unmatched++;
+      }
+      else if (!seen[*found])
+      {
+        seen[*found] = true;
+        ret.push_back(*found);
+      }
+    }
+
+    if (unmatched > 0)
+    {
+      logging::warn(unmatched, " lines in ", trace, " did not name a file on the disc");
+    }
+
+    return ret;
+  }
+
+  /*
+    Summary:
+      Describes a layout for the build manifest so a change of layout forces a full rebuild.
+      A trace layout includes a hash of the trace so editing it counts as a change.
+  */
+  std::string layout_key(std::string layout, std::string trace)
+  {
+    if (layout != layout::Trace)
+    {
+      return layout;
+    }
+
+    std::ostringstream out;
+    out << layout << " " << std::hex << util::hash_file(trace);
+    return out.str();
+  }
+}
@@ -0,0 +1,30 @@
+#ifndef _GCM_LAYOUT_H
+#define _GCM_LAYOUT_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "gcm_fst.h"
+
+namespace gcm
+{
+  //  Ways build and repack can order file data on the disc
+  namespace layout
+  {
+    const std::string Original = "original";  //  Order of the data on the original disc
+    const std::string Sorted = "sorted";      //  Order of the FST, which is sorted by name
+    const std::string Trace = "trace";        //  Files in the order a trace first read them
+
+    inline bool valid(std::string name)
+    {
+      return name == Original || name == Sorted || name == Trace;
+    }
+  }
+
+  std::vector<uint32_t> order_by_offset(const fst::FST& fst, const fst::FST& original);
+  std::vector<uint32_t> order_by_trace(const fst::FST& fst, std::string trace);
+  std::string layout_key(std::string layout, std::string trace);
+}
+
+#endif
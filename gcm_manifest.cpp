@@ -0,0 +1,115 @@
+#include "gcm_manifest.h"
+
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+namespace gcm
+{
+  namespace
+  {
+    const char *ManifestMagic = "mdgcm-manifest 1";
+  }
+
+  /*
+    Summary:
+      Reads a manifest written by save
+
+    Parameters:
+      file: Path to the manifest
+
+    Returns:
+      False if the manifest does not exist or cannot be understood
+  */
+  bool Manifest::load(std::string file)
+  {
+    std::ifstream in(file);
+    std::string line;
+
+    if (!in || !std::getline(in, line) || line != ManifestMagic)
+    {
+      return false;
+    }
+
+    sys.clear();
+    files.clear();
+    order.clear();
+
+    while (std::getline(in, line))
+    {
+      std::istringstream fields(line);
+      std::string kind;
+      fields >> kind;
+
+      if (kind == "layout")
+      {
+        fields >> dol_offset >> fst_offset >> image_size;
+      }
+      else if (kind == "order")
+      {
+        fields.get();
+        std::getline(fields, order);
+      }
+      else if (kind == "sys" || kind == "file")
+      {
+        ManifestEntry entry;
+        fields >> entry.offset >> entry.size >> entry.mtime >> std::hex >> entry.hash >> std::dec;
+
+        //  The path is the rest of the line so it may contain spaces
+        fields.get();
+        std::getline(fields, entry.path);
+
+        (kind == "sys" ? sys : files).push_back(entry);
+      }
+
+      if (fields.fail())
+      {
+        return false;
+      }
+    }
+
+    return true;
+  }
+
+  /*
+    Summary:
+      Writes the manifest as plain text, one entry per line
+
+    Parameters:
+      file: Path to write to
+  */
+  void Manifest::save(std::string file) const
+  {
+    std::ofstream out(file, std::ios::trunc);
+
+    if (!out)
+    {
+      throw std::runtime_error("Could not create " + file);
+    }
+
+    out << ManifestMagic << "\n";
+    out << "layout " << dol_offset << " " << fst_offset << " " << image_size << "\n";
+    out << "order " << order << "\n";
+
+    auto write = [&out](const char *kind, const ManifestEntry& entry)
+    {
+      out << kind << " " << entry.offset << " " << entry.size << " " << entry.mtime << " "
+          << std::hex << entry.hash << std::dec << " " << entry.path << "\n";
+    };
+
+    for (auto& entry : sys)
+    {
+      write("sys", entry);
+    }
+
+    for (auto& entry : files)
+    {
+      write("file", entry);
+    }
+
+    if (!out.flush())
+    {
+      throw std::runtime_error("Could not write " + file);
+    }
+  }
+}
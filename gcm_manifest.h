@@ -0,0 +1,46 @@
+#ifndef _GCM_MANIFEST_H
+#define _GCM_MANIFEST_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace gcm
+{
+  //  A source file that was written into a built disc
+  struct ManifestEntry
+  {
+    std::string path;   //  Path relative to the build root, e.g. "files/audio/a.adp"
+    uint64_t offset;    //  Offset of the data in the disc
+    uint64_t size;      //  Size of the data in bytes
+    int64_t mtime;      //  Modification time of the source when it was written
+    uint64_t hash;      //  util::hash_bytes hash of the source contents
+  };
+
+  /*
+    Summary:
+      Record of how a disc was laid out by the last build. It is saved next to the disc so
+      the next build can rewrite only what changed.
+  */
+  struct Manifest
+  {
+    uint32_t dol_offset = 0;
+    uint32_t fst_offset = 0;
+    uint64_t image_size = 0;
+    std::string order;                  //  layout_key of the layout the files were placed with
+
+    std::vector<ManifestEntry> sys;     //  bi2.bin, apploader.bin and main.dol
+    std::vector<ManifestEntry> files;   //  Every file in FST order
+
+    bool load(std::string file);
+    void save(std::string file) const;
+
+    //  Path of the manifest kept next to a disc image
+    static inline std::string path_for(std::string disc)
+    {
+      return disc + ".manifest";
+    }
+  };
+}
+
+#endif
@@ -0,0 +1,1161 @@
+#include "gcm.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+namespace gcm
+{
+  namespace
+  {
+    //  Smallest block old data is indexed in. Shorter runs of shared data are not found.
+    const uint32_t MinBlock = 32;
+
+    //  The block size grows with the old file so its index holds at most about this many blocks
+    const uint64_t MaxBlocks = 0x100000;
+
+    //  Block size of the old data that no file of the new disc was matched with by path. It is
+    //  searched by the sys area, the gaps between files and new files without an old one.
+    const uint32_t LooseBlock = 0x400;
+
+    //  New data is diffed in pieces of at most this size, so a large file is spread over the workers
+    const uint64_t PieceSize = 0x1000000;
+
+    //  New data diffed at once. Compressed operations are kept in memory until they are written in order.
+    const uint64_t WindowSize = 0x8000000;
+
+    //  Runs of zeros at least this long are written as a zero operation instead of as data
+    const uint64_t ZeroRun = 0x40;
+
+    //  Size of the buffers the operation stream is compressed and decompressed through
+    const uint32_t StreamBuffer = 0x10000;
+
+    //  Multiplier of the rolling hash
+    const uint64_t HashBase = 0x100000001B3;
+
+    const uint8_t Zeros[0x1000] = {};
+
+    //  Polynomial hash of a block, which roll() can move along one byte at a time
+    uint64_t hash(const uint8_t *data, uint32_t size)
+    {
+      uint64_t value = 0;
+
+      for (uint32_t i = 0; i < size; i++)
+      {
+        value = value * HashBase + data[i];
+      }
+
+      return value;
+    }
+
+    bool all_zero(std::span<const uint8_t> data)
+    {
+      while (!data.empty())
+      {
+        size_t chunk = std::min(data.size(), sizeof(Zeros));
+
+        if (memcmp(data.data(), Zeros, chunk) != 0)
+        {
+          return false;
+        }
+
+        data = data.subspan(chunk);
+      }
+
+      return true;
+    }
+
+    //  Number of bytes at the start of a and b that are the same, looking at no more than count
+    size_t common(const uint8_t *a, const uint8_t *b, size_t count)
+    {
+      size_t same = 0;
+
+      //  Compare a chunk at a time and only look at single bytes in the chunk that differs
+      while (count - same >= 64 && memcmp(a + same, b + same, 64) == 0)
+      {
+        same += 64;
+      }
+
+      while (same < count && a[same] == b[same])
+      {
+        same++;
+      }
+
+      return same;
+    }
+
+    void put_varint(std::vector<uint8_t>& out, uint64_t value)
+    {
+      while (value >= 0x80)
+      {
+        out.push_back(static_cast<uint8_t>(value | 0x80));
+        value >>= 7;
+      }
+
+      out.push_back(static_cast<uint8_t>(value));
+    }
+
+    void write_all(int fd, uint64_t offset, const uint8_t *data, uint64_t count, const std::string& path)
+    {
+      while (count > 0)
+      {
+        ssize_t written = pwrite(fd, data, count, offset);
+        stats::add_syscalls(1);
+
+        if (written < 0 && errno == EINTR)
+        {
+          continue;
+        }
+
+        if (written <= 0)
+        {
+          throw std::runtime_error("Could not write to " + path + ": " + strerror(errno));
+        }
+
+        stats::add_write(written);
+        data += written;
+        offset += written;
+        count -= written;
+      }
+    }
+
+    /*
+      Summary:
+        Ranges of the old disc with the hash of every whole block in them, used to find new
+        data that can be copied from the old disc. Blocks of zeros are left out, as zeros are
+        written as zero operations anyway. Read only once built, so any thread can search it.
+    */
+    struct BlockIndex
+    {
+      //  A range of the old disc and its data
+      struct Range
+      {
+        uint64_t offset;
+        std::span<const uint8_t> data;
+      };
+
+      BlockIndex(uint32_t block) : m_block(block), m_power(1)
+      {
+        for (uint32_t i = 1; i < block; i++)
+        {
+          m_power *= HashBase;
+        }
+      }
+
+      inline uint32_t block() const
+      {
+        return m_block;
+      }
+
+      inline bool empty() const
+      {
+        return m_blocks.empty();
+      }
+
+      //  Moves a block hash one byte along, dropping out and taking in
+      inline uint64_t roll(uint64_t value, uint8_t out, uint8_t in) const
+      {
+        return (value - out * m_power) * HashBase + in;
+      }
+
+      void add(uint64_t offset, std::span<const uint8_t> data)
+      {
+        uint32_t range = static_cast<uint32_t>(m_ranges.size());
+        m_ranges.push_back(Range{ offset, data });
+
+        for (size_t i = 0; i + m_block <= data.size(); i += m_block)
+        {
+          std::span<const uint8_t> block = data.subspan(i, m_block);
+
+          if (!all_zero(block))
+          {
+            //  The first of several equal blocks is kept
+            m_blocks.emplace(hash(block.data(), m_block), Location{ range, i });
+          }
+        }
+      }
+
+      //  Sizes the filter once every range has been added, at about 16 bits a block
+      void finish()
+      {
+        uint32_t bits = 16;
+
+        while ((uint64_t(1) << bits) < m_blocks.size() * 16 && bits < 32)
+        {
+          bits++;
+        }
+
+        m_shift = 64 - bits;
+        m_filter.assign((uint64_t(1) << bits) / 64, 0);
+
+        for (auto& [value, location] : m_blocks)
+        {
+          uint64_t bit = value >> m_shift;
+          m_filter[bit / 64] |= uint64_t(1) << (bit % 64);
+        }
+      }
+
+      /*
+        Summary:
+          Looks for a block of old data equal to the block of new data at the start of target
+
+        Parameters:
+          value: Hash of the block
+          target: New data starting with the block
+          range: Receives the old range the block was found in
+          from: Receives the offset of the block in that range
+
+        Returns:
+          True if the block was found
+      */
+      inline bool find(uint64_t value, const uint8_t *target, const Range *& range, uint64_t& from) const
+      {
+        //  Most blocks of new data are nowhere in the old data, and the filter turns them away
+        //  without a lookup. Its high bits are used, as those of the hash depend on every byte.
+        uint64_t bit = value >> m_shift;
+
+        if ((m_filter[bit / 64] & (uint64_t(1) << (bit % 64))) == 0)
+        {
+          return false;
+        }
+
+        auto found = m_blocks.find(value);
+
+        if (found == m_blocks.end())
+        {
+          return false;
+        }
+
+        range = &m_ranges[found->second.range];
+        from = found->second.offset;
+
+        return memcmp(range->data.data() + from, target, m_block) == 0;
+      }
+    private:
+      struct Location
+      {
+        uint32_t range;
+        uint64_t offset;
+      };
+
+      uint32_t m_block;
+      uint64_t m_power;   //  HashBase to the power of m_block - 1
+      std::vector<Range> m_ranges;
+      std::unordered_map<uint64_t, Location> m_blocks;
+      std::vector<uint64_t> m_filter;
+      uint32_t m_shift = 63;
+    };
+
+    //  Operations for one piece of the new disc. Copies and zeros that follow on from the last are joined to it.
+    struct OpWriter
+    {
+      std::vector<uint8_t> out;
+      uint64_t copied = 0;
+      uint64_t literal = 0;
+      uint64_t zeros = 0;
+
+      void copy(uint64_t from, uint64_t count)
+      {
+        if (m_pending == patch::Copy && m_from + m_count == from)
+        {
+          m_count += count;
+        }
+        else
+        {
+          flush();
+          m_pending = patch::Copy;
+          m_from = from;
+          m_count = count;
+        }
+
+        copied += count;
+      }
+
+      //  Adds new data, with its long runs of zeros taken out as zero operations
+      void data(std::span<const uint8_t> bytes)
+      {
+        size_t start = 0;
+        size_t i = 0;
+
+        while (i < bytes.size())
+        {
+          if (bytes[i] != 0)
+          {
+            i++;
+            continue;
+          }
+
+          size_t run = i;
+
+          while (run < bytes.size() && bytes[run] == 0)
+          {
+            run++;
+          }
+
+          if (run - i >= ZeroRun)
+          {
+            put_data(bytes.subspan(start, i - start));
+            zero(run - i);
+            start = run;
+          }
+
+          i = run;
+        }
+
+        put_data(bytes.subspan(start));
+      }
+
+      void zero(uint64_t count)
+      {
+        if (m_pending != patch::Zero)
+        {
+          flush();
+          m_pending = patch::Zero;
+          m_count = 0;
+        }
+
+        m_count += count;
+        zeros += count;
+      }
+
+      //  Writes out the copy or zeros still being joined
+      void flush()
+      {
+        if (m_pending == patch::Copy)
+        {
+          out.push_back(patch::Copy);
+          put_varint(out, m_from);
+          put_varint(out, m_count);
+        }
+        else if (m_pending == patch::Zero)
+        {
+          out.push_back(patch::Zero);
+          put_varint(out, m_count);
+        }
+
+        m_pending = patch::End;
+      }
+    private:
+      patch::Op m_pending = patch::End;   //  End for nothing pending
+      uint64_t m_from = 0;
+      uint64_t m_count = 0;
+
+      void put_data(std::span<const uint8_t> bytes)
+      {
+        if (bytes.empty())
+        {
+          return;
+        }
+
+        flush();
+        out.push_back(patch::Data);
+        put_varint(out, bytes.size());
+        out.insert(out.end(), bytes.begin(), bytes.end());
+        literal += bytes.size();
+      }
+    };
+
+    /*
+      Summary:
+        Writes the operations that make target, copying what can be found in the index from
+        the old disc. The hash of a block is rolled along target a byte at a time and every
+        block found is grown as far as the data matches in both directions.
+
+      Parameters:
+        target: New data
+        index: Old data to search, or null to write target as it is
+        ops: Receives the operations
+    */
+    void encode(std::span<const uint8_t> target, const BlockIndex *index, OpWriter& ops)
+    {
+      size_t size = target.size();
+
+      if (!index || index->empty() || size < index->block())
+      {
+        ops.data(target);
+        return;
+      }
+
+      uint32_t block = index->block();
+      size_t literal = 0;   //  Start of the data not yet written
+      size_t at = 0;
+      uint64_t value = hash(&target[0], block);
+
+      while (at + block <= size)
+      {
+        const BlockIndex::Range *range;
+        uint64_t from;
+
+        if (!index->find(value, &target[at], range, from))
+        {
+          if (at + block < size)
+          {
+            value = index->roll(value, target[at], target[at + block]);
+          }
+
+          at++;
+          continue;
+        }
+
+        const uint8_t *old = range->data.data();
+        size_t start = at;
+        size_t count = block;
+
+        while (start > literal && from > 0 && old[from - 1] == target[start - 1])
+        {
+          start--;
+          from--;
+          count++;
+        }
+
+        count += common(old + from + count, &target[start + count], std::min<uint64_t>(range->data.size() - from, size - start) - count);
+
+        ops.data(target.subspan(literal, start - literal));
+        ops.copy(range->offset + from, count);
+
+        at = literal = start + count;
+
+        if (at + block <= size)
+        {
+          value = hash(&target[at], block);
+        }
+      }
+
+      ops.data(target.subspan(literal));
+    }
+
+    //  An old file with the same path as a new one. Its index is built by the first piece that needs it.
+    struct Match
+    {
+      uint64_t offset;
+      uint64_t size;
+      std::once_flag indexed;
+      std::unique_ptr<BlockIndex> index;
+    };
+
+    //  Marks a piece that does not carry on from any old data
+    const uint64_t NoOffset = ~uint64_t(0);
+
+    //  A part of the new disc to diff
+    struct Piece
+    {
+      uint64_t offset;
+      uint64_t size;
+      uint64_t follows;   //  Where the piece would be in the old disc if the data before it is unchanged, or NoOffset
+      Match *match;       //  Old file with the same path, or null to search the loose index
+      uint32_t files;     //  Files of the new disc this piece finishes, for the progress line
+    };
+
+    //  The operations of a piece, compressed
+    struct Segment
+    {
+      std::vector<uint8_t> data;
+      uLong adler;        //  Adler-32 of the operations before they were compressed
+      uint64_t size;      //  Size of the operations before they were compressed
+    };
+
+    /*
+      Summary:
+        Compresses data into raw deflate blocks. Unless last is set the blocks end on a byte
+        boundary without ending the stream, so segments compressed apart, each on its own
+        worker, can be joined into one stream, as pigz does.
+    */
+    Segment deflate_segment(std::span<const uint8_t> data, bool last)
+    {
+      z_stream stream{};
+
+      if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+      {
+        throw std::runtime_error("Could not start compressing a patch");
+      }
+
+      Segment segment{ {}, adler32(adler32(0, nullptr, 0), data.data(), static_cast<uInt>(data.size())), data.size() };
+      segment.data.resize(deflateBound(&stream, data.size()) + 16);
+
+      stream.next_in = const_cast<uint8_t *>(data.data());
+      stream.avail_in = static_cast<uInt>(data.size());
+      stream.next_out = &segment.data[0];
+      stream.avail_out = static_cast<uInt>(segment.data.size());
+
+      int result = deflate(&stream, last ? Z_FINISH : Z_SYNC_FLUSH);
+      segment.data.resize(stream.total_out);
+      deflateEnd(&stream);
+
+      if (result != (last ? Z_STREAM_END : Z_OK) || stream.avail_in != 0 || stream.avail_out == 0)
+      {
+        throw std::runtime_error("Could not compress a patch");
+      }
+
+      return segment;
+    }
+
+    //  Reads the operations back out of a patch file
+    struct Inflater
+    {
+      Inflater(int fd, uint64_t offset, std::string path)
+        : m_fd(fd), m_offset(offset), m_path(path), m_input(StreamBuffer), m_output(StreamBuffer), m_position(0), m_end(0), m_finished(false)
+      {
+        m_stream = z_stream{};
+
+        if (inflateInit(&m_stream) != Z_OK)
+        {
+          throw std::runtime_error("Could not start decompressing " + path);
+        }
+      }
+
+      ~Inflater()
+      {
+        inflateEnd(&m_stream);
+      }
+
+      Inflater(const Inflater&) = delete;
+      Inflater& operator=(const Inflater&) = delete;
+
+      //  Reads the next count bytes, which may be used until the next read
+      std::span<const uint8_t> read(size_t count)
+      {
+        if (m_position == m_end)
+        {
+          fill();
+        }
+
+        count = std::min(count, m_end - m_position);
+        std::span<const uint8_t> data(&m_output[m_position], count);
+        m_position += count;
+
+        return data;
+      }
+
+      uint8_t byte()
+      {
+        return read(1)[0];
+      }
+
+      uint64_t varint()
+      {
+        uint64_t value = 0;
+
+        for (uint32_t shift = 0; shift < 64; shift += 7)
+        {
+          uint8_t next = byte();
+          value |= static_cast<uint64_t>(next & 0x7F) << shift;
+
+          if ((next & 0x80) == 0)
+          {
+            return value;
+          }
+        }
+
+        throw std::runtime_error(m_path + " is damaged: a number is too long");
+      }
+    private:
+      int m_fd;
+      uint64_t m_offset;
+      std::string m_path;
+      z_stream m_stream;
+      std::vector<uint8_t> m_input;
+      std::vector<uint8_t> m_output;
+      size_t m_position;
+      size_t m_end;
+      bool m_finished;
+
+      //  Decompresses more of the stream, throwing if there is none
+      void fill()
+      {
+        m_stream.next_out = &m_output[0];
+        m_stream.avail_out = StreamBuffer;
+
+        while (m_stream.avail_out == StreamBuffer)
+        {
+          if (m_finished)
+          {
+            throw std::runtime_error(m_path + " ends before the disc does");
+          }
+
+          if (m_stream.avail_in == 0)
+          {
+            ssize_t count = pread(m_fd, &m_input[0], StreamBuffer, m_offset);
+            stats::add_syscalls(1);
+
+            if (count < 0)
+            {
+              throw std::runtime_error("Could not read " + m_path + ": " + strerror(errno));
+            }
+
+            if (count == 0)
+            {
+              throw std::runtime_error(m_path + " is cut short");
+            }
+
+            stats::add_read(count);
+            m_offset += count;
+            m_stream.next_in = &m_input[0];
+            m_stream.avail_in = static_cast<uInt>(count);
+          }
+
+          int result = inflate(&m_stream, Z_NO_FLUSH);
+
+          if (result == Z_STREAM_END)
+          {
+            m_finished = true;
+          }
+          else if (result != Z_OK)
+          {
+            throw std::runtime_error(m_path + " is damaged: " + (m_stream.msg ? m_stream.msg : "bad data"));
+          }
+        }
+
+        m_position = 0;
+        m_end = StreamBuffer - m_stream.avail_out;
+      }
+    };
+  }
+
+  /*
+    Summary:
+      Writes a patch that turns one disc into another. Both FSTs are read and each file of
+      the new disc is matched by path with the file of the old disc it came from. A file whose
+      data is unchanged becomes a single copy, and a changed one is delta encoded against its
+      old version with a rolling hash, so files that moved cost nothing and only the parts of
+      a file that changed are stored. The sys area, the gaps between files and new files are
+      matched against the old data that no new file took. The work is spread over
+      options.jobs worker threads and the operations are compressed in disc order.
+
+    Parameters:
+      old_image: Disc the patch applies to
+      new_image: Disc the patch makes
+      patchpath: Path of the patch to write
+      options: Settings such as the number of worker threads
+  */
+  void diff(const Disc& old_image, const Disc& new_image, std::string patchpath, const Options& options)
+  {
+    for (auto disc : { &old_image, &new_image })
+    {
+      if (boost::filesystem::exists(patchpath) && boost::filesystem::equivalent(disc->path(), patchpath))
+      {
+        throw std::runtime_error("Cannot write the patch over " + disc->path());
+      }
+    }
+
+    const DiscReader& old_disc = old_image.reader();
+    const DiscReader& new_disc = new_image.reader();
+
+    const fst::FST& old_fst = old_image.fst();
+    const fst::FST& new_fst = new_image.fst();
+
+    int fd = open(patchpath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    stats::add_syscalls(2);
+
+    if (fd < 0)
+    {
+      throw std::runtime_error("Could not create " + patchpath + ": " + strerror(errno));
+    }
+
+    try
+    {
+      //  Start hashing the new disc first so it overlaps with diffing it. Phases are only
+      //  opened on this thread, so the hash is timed by the wait for it at the end.
+      util::Sha1 sha1;
+      util::TaskGroup image_pool(options.pool, 1);
+
+      image_pool.submit([&new_disc, &sha1]()
+      {
+        new_disc.stream(0, new_disc.size(), [&sha1](std::span<const uint8_t> piece)
+        {
+          sha1.update(piece);
+        });
+      });
+
+      stats::Phase plan_phase("plan");
+
+      //  Files of the new disc by offset, each with the old file of the same path if there is one
+      struct NewFile
+      {
+        uint64_t offset;
+        uint64_t size;
+        Match *match;
+      };
+
+      std::vector<NewFile> files;
+      std::vector<std::unique_ptr<Match>> matches;
+      std::vector<std::pair<uint64_t, uint64_t>> taken;   //  Old file data that new files were matched with
+
+      new_fst.visit(0, [&](uint32_t i, std::string_view path)
+      {
+        if (new_fst.is_dir(i) || new_fst.data_size(i) == 0)
+        {
+          return true;
+        }
+
+        NewFile file{ new_fst.data_offset(i), new_fst.data_size(i), nullptr };
+        std::optional<uint32_t> old = old_fst.find(path);
+
+        if (old && old_fst.is_file(*old) && old_fst.data_size(*old) > 0)
+        {
+          matches.push_back(std::make_unique<Match>());
+          Match& match = *matches.back();
+          match.offset = old_fst.data_offset(*old);
+          match.size = old_fst.data_size(*old);
+          file.match = &match;
+          taken.emplace_back(match.offset, match.offset + match.size);
+        }
+
+        files.push_back(file);
+        return true;
+      });
+
+      std::stable_sort(files.begin(), files.end(), [](const NewFile& a, const NewFile& b)
+      {
+        return a.offset < b.offset;
+      });
+
+      //  Cut the new disc into pieces front to back. Files that share data are only diffed once.
+      //  Each piece notes where its data would be in the old disc if nothing before it changed
+      //  since the last matched file, which finds unchanged gaps and sys data without a search.
+      std::vector<Piece> pieces;
+      uint64_t cursor = 0;
+      uint64_t follows = 0;
+
+      auto add_pieces = [&pieces](uint64_t start, uint64_t end, uint64_t follows, Match *match, uint32_t files)
+      {
+        for (uint64_t offset = start; offset < end; offset += PieceSize)
+        {
+          uint64_t size = std::min(PieceSize, end - offset);
+          uint64_t from = (follows == NoOffset) ? NoOffset : follows + (offset - start);
+          pieces.push_back(Piece{ offset, size, from, match, (offset + size == end) ? files : 0 });
+        }
+      };
+
+      for (auto& file : files)
+      {
+        uint64_t end = std::min(file.offset + file.size, new_disc.size());
+
+        //  Its data was diffed with the file it shares it with
+        if (end <= cursor)
+        {
+          pieces.back().files++;
+          continue;
+        }
+
+        if (file.offset > cursor)
+        {
+          add_pieces(cursor, file.offset, follows, nullptr, 0);
+          follows = (follows == NoOffset) ? NoOffset : follows + (file.offset - cursor);
+        }
+
+        uint64_t start = std::max(cursor, file.offset);
+
+        if (file.match)
+        {
+          follows = file.match->offset + (start - file.offset);
+        }
+
+        add_pieces(start, end, file.match ? follows : NoOffset, file.match, 1);
+        follows = file.match ? follows + (end - start) : NoOffset;
+        cursor = end;
+      }
+
+      add_pieces(cursor, new_disc.size(), follows, nullptr, 0);
+
+      //  The old data no new file was matched with, which holds the old sys area, gaps and
+      //  files that were renamed or removed
+      std::sort(taken.begin(), taken.end());
+
+      std::unique_ptr<BlockIndex> loose;
+      std::once_flag loose_indexed;
+
+      //  Built by whichever worker needs it first, so its time is charged to the diff phase
+      auto build_loose = [&]()
+      {
+        loose = std::make_unique<BlockIndex>(LooseBlock);
+        uint64_t start = 0;
+
+        auto add = [&](uint64_t end)
+        {
+          end = std::min(end, old_disc.size());
+
+          if (end >= start + LooseBlock)
+          {
+            loose->add(start, old_disc.view(start, end - start));
+          }
+        };
+
+        for (auto& [first, last] : taken)
+        {
+          add(first);
+          start = std::max(start, last);
+        }
+
+        add(old_disc.size());
+        loose->finish();
+      };
+
+      plan_phase.end();
+      stats::Phase diff_phase("diff");
+
+      //  The operations are one zlib stream made of the segments of every piece joined
+      //  together. The header is written last, once the new disc has been hashed.
+      const uint8_t zlib_header[2] = { 0x78, 0x9C };
+      uint64_t offset = patch::HeaderSize;
+      write_all(fd, offset, zlib_header, sizeof(zlib_header), patchpath);
+      offset += sizeof(zlib_header);
+
+      uLong adler = adler32(0, nullptr, 0);
+      logging::Progress progress("Diffing", files.size(), new_disc.size());
+      util::TaskGroup group(options.pool, options.jobs);
+      std::atomic<uint64_t> copied(0), literal(0), zeros(0);
+
+      //  Pieces are diffed and compressed in runs of about PieceSize, so small files share a
+      //  segment and copies of files that did not move join up across them
+      std::vector<size_t> runs;
+
+      for (size_t i = 0, bytes = PieceSize; i < pieces.size(); i++)
+      {
+        if (bytes + pieces[i].size > PieceSize)
+        {
+          runs.push_back(i);
+          bytes = 0;
+        }
+
+        bytes += pieces[i].size;
+      }
+
+      runs.push_back(pieces.size());
+
+      for (size_t next = 0; next + 1 < runs.size();)
+      {
+        //  A window of runs is diffed and compressed at once and then written in order
+        size_t last = next + 1;
+
+        while (last + 1 < runs.size() && pieces[runs[last]].offset - pieces[runs[next]].offset < WindowSize)
+        {
+          last++;
+        }
+
+        std::vector<Segment> segments(last - next);
+
+        for (size_t run = next; run < last; run++)
+        {
+          group.submit([&, run, &segment = segments[run - next]]()
+          {
+            OpWriter out;
+
+            for (size_t i = runs[run]; i < runs[run + 1]; i++)
+            {
+              const Piece& piece = pieces[i];
+              std::span<const uint8_t> target = new_disc.view(piece.offset, piece.size);
+
+              //  Data that carries on unchanged from the piece before is copied whole without a search
+              if (piece.follows != NoOffset && piece.follows <= old_disc.size() && piece.size <= old_disc.size() - piece.follows &&
+                  memcmp(old_disc.view(piece.follows, piece.size).data(), target.data(), piece.size) == 0)
+              {
+                out.copy(piece.follows, piece.size);
+              }
+              else if (!piece.match)
+              {
+                std::call_once(loose_indexed, build_loose);
+                encode(target, loose.get(), out);
+              }
+              else
+              {
+                Match& match = *piece.match;
+
+                std::call_once(match.indexed, [&old_disc, &match]()
+                {
+                  uint32_t block = MinBlock;
+
+                  while (match.size / block > MaxBlocks)
+                  {
+                    block *= 2;
+                  }
+
+                  match.index = std::make_unique<BlockIndex>(block);
+                  match.index->add(match.offset, old_disc.view(match.offset, match.size));
+                  match.index->finish();
+                });
+
+                encode(target, match.index.get(), out);
+              }
+            }
+
+            out.flush();
+            segment = deflate_segment(out.out, false);
+
+            copied += out.copied;
+            literal += out.literal;
+            zeros += out.zeros;
+          });
+        }
+
+        group.wait();
+
+        for (size_t run = next; run < last; run++)
+        {
+          Segment& segment = segments[run - next];
+          write_all(fd, offset, segment.data.data(), segment.data.size(), patchpath);
+          offset += segment.data.size();
+          adler = adler32_combine(adler, segment.adler, static_cast<z_off_t>(segment.size));
+
+          for (size_t i = runs[run]; i < runs[run + 1]; i++)
+          {
+            progress.add(pieces[i].size, pieces[i].files);
+          }
+        }
+
+        next = last;
+      }
+
+      //  The end operation goes in the final block, followed by the checksum of the whole stream
+      const uint8_t end = patch::End;
+      Segment segment = deflate_segment(std::span<const uint8_t>(&end, 1), true);
+      adler = adler32_combine(adler, segment.adler, 1);
+
+      util::push_int_big<uint32_t>(segment.data, static_cast<uint32_t>(adler));
+      write_all(fd, offset, segment.data.data(), segment.data.size(), patchpath);
+      offset += segment.data.size();
+
+      progress.end();
+      diff_phase.end();
+
+      stats::Phase hash_phase("hash");
+      image_pool.wait();
+      hash_phase.end();
+
+      std::vector<uint8_t> header(patch::Magic, patch::Magic + sizeof(patch::Magic));
+      util::push_int_big<uint32_t>(header, patch::Version);
+      util::push_int_big<uint64_t>(header, old_disc.size());
+      util::push_int_big<uint64_t>(header, new_disc.size());
+
+      auto digest = sha1.digest();
+      header.insert(header.end(), digest.begin(), digest.end());
+      write_all(fd, 0, header.data(), header.size(), patchpath);
+
+      logging::info("Patch: ", offset, " bytes, ", copied.load(), " bytes copied, ", literal.load(), " bytes new, ", zeros.load(), " bytes of zeros");
+    }
+    catch (...)
+    {
+      close(fd);
+      throw;
+    }
+
+    close(fd);
+    stats::add_syscalls(1);
+  }
+
+  void diff(std::string old_path, std::string new_path, std::string patchpath, const Options& options)
+  {
+    diff(Disc(old_path), Disc(new_path), patchpath, options);
+  }
+
+  /*
+    Summary:
+      Makes a new disc from an old one and a patch written by diff. The disc is written front
+      to back, so the output can be a pipe, and its SHA-1 is checked against the one in the
+      patch once it is done. A disc that does not match is removed.
+
+    Parameters:
+      discpath: Path to the old disc, which may be a GCZ image
+      patchpath: Path to the patch
+      outpath: Path of the disc to write, or "-" for stdout
+      options: Settings such as the size of the copy buffer
+  */
+  void apply(std::string discpath, std::string patchpath, std::string outpath, const Options& options)
+  {
+    if (options.gcz)
+    {
+      throw std::runtime_error("apply writes an uncompressed disc, repack it with --gcz afterwards");
+    }
+
+    bool stream = (outpath == "-");
+
+    if (!stream && boost::filesystem::exists(outpath) &&
+        (boost::filesystem::equivalent(discpath, outpath) || boost::filesystem::equivalent(patchpath, outpath)))
+    {
+      throw std::runtime_error("Cannot write the patched disc over its inputs");
+    }
+
+    DiscReader disc(discpath);
+
+    int patch_fd = open(patchpath.c_str(), O_RDONLY);
+    stats::add_syscalls(1);
+
+    if (patch_fd < 0)
+    {
+      throw std::runtime_error("Could not open " + patchpath + ": " + strerror(errno));
+    }
+
+    try
+    {
+      uint8_t raw[patch::HeaderSize];
+
+      if (pread(patch_fd, raw, sizeof(raw), 0) != sizeof(raw) || memcmp(raw, patch::Magic, sizeof(patch::Magic)) != 0)
+      {
+        throw std::runtime_error(patchpath + " is not a GCM patch");
+      }
+
+      std::span<const uint8_t> header(raw);
+
+      if (util::read_big<uint32_t>(header, 8) != patch::Version)
+      {
+        throw std::runtime_error(patchpath + " is a version of patch this program cannot read");
+      }
+
+      uint64_t old_size = util::read_big<uint64_t>(header, 12);
+      uint64_t new_size = util::read_big<uint64_t>(header, 20);
+      std::span<const uint8_t> expected = header.subspan(28, 20);
+
+      if (disc.size() != old_size)
+      {
+        throw std::runtime_error(patchpath + " is for a disc of " + std::to_string(old_size) + " bytes, but " + discpath +
+                                 " is " + std::to_string(disc.size()) + " bytes");
+      }
+
+      std::optional<logging::ToStderr> to_stderr;
+
+      if (stream)
+      {
+        //  stdout is shared by every job in a batch
+        if (options.pool)
+        {
+          throw std::runtime_error("A batch job cannot stream a disc to stdout");
+        }
+
+        if (isatty(STDOUT_FILENO))
+        {
+          throw std::runtime_error("Not writing a disc to a terminal, pipe or redirect stdout instead");
+        }
+
+        //  The disc is the only thing that may go to stdout, so messages go to stderr
+        to_stderr.emplace();
+      }
+
+      int fd = stream ? STDOUT_FILENO : open(outpath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+      stats::add_syscalls(stream ? 0 : 1);
+
+      if (fd < 0)
+      {
+        throw std::runtime_error("Could not create " + outpath + ": " + strerror(errno));
+      }
+
+      try
+      {
+        stats::Phase phase("apply");
+        Inflater in(patch_fd, patch::HeaderSize, patchpath);
+        StreamWriter out(fd, options.buffer_size);
+        util::Sha1 sha1;
+        uint64_t position = 0;
+        uint64_t copied = 0;
+
+        auto check = [&](uint64_t count)
+        {
+          if (count > new_size - position)
+          {
+            throw std::runtime_error(patchpath + " is damaged: it writes past the end of the disc");
+          }
+        };
+
+        auto put = [&](std::span<const uint8_t> data)
+        {
+          sha1.update(data);
+          out.write(position, data);
+          position += data.size();
+        };
+
+        for (uint8_t op = in.byte(); op != patch::End; op = in.byte())
+        {
+          if (op == patch::Copy)
+          {
+            uint64_t from = in.varint();
+            uint64_t count = in.varint();
+            check(count);
+
+            if (from > old_size || count > old_size - from)
+            {
+              throw std::runtime_error(patchpath + " is damaged: it copies from past the end of the old disc");
+            }
+
+            disc.stream(from, count, put);
+            copied += count;
+          }
+          else if (op == patch::Data)
+          {
+            uint64_t count = in.varint();
+            check(count);
+
+            while (count > 0)
+            {
+              std::span<const uint8_t> data = in.read(count);
+              put(data);
+              count -= data.size();
+            }
+          }
+          else if (op == patch::Zero)
+          {
+            uint64_t count = in.varint();
+            check(count);
+
+            //  The writer fills the gap before the next write or at the end
+            for (uint64_t left = count; left > 0;)
+            {
+              uint64_t chunk = std::min<uint64_t>(left, sizeof(Zeros));
+              sha1.update(std::span<const uint8_t>(Zeros, chunk));
+              left -= chunk;
+            }
+
+            position += count;
+          }
+          else
+          {
+            throw std::runtime_error(patchpath + " is damaged: unknown operation");
+          }
+        }
+
+        if (position != new_size)
+        {
+          throw std::runtime_error(patchpath + " ends before the disc does");
+        }
+
+        out.finish(new_size);
+
+        auto digest = sha1.digest();
+
+        if (!std::equal(digest.begin(), digest.end(), expected.begin()))
+        {
+          throw std::runtime_error("The patched disc does not match the one the patch was made from, " + discpath +
+                                   " is not the disc the patch was made against");
+        }
+
+        logging::info("Applied: ", new_size, " bytes, ", copied, " bytes copied from ", discpath);
+      }
+      catch (...)
+      {
+        if (!stream)
+        {
+          close(fd);
+          unlink(outpath.c_str());
+          stats::add_syscalls(2);
+        }
+
+        throw;
+      }
+
+      if (!stream)
+      {
+        close(fd);
+        stats::add_syscalls(1);
+      }
+    }
+    catch (...)
+    {
+      close(patch_fd);
+      throw;
+    }
+
+    close(patch_fd);
+    stats::add_syscalls(1);
+  }
+}
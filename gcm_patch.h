@@ -0,0 +1,37 @@
+#ifndef _GCM_PATCH_H
+#define _GCM_PATCH_H
+
+#include <cstdint>
+
+namespace gcm
+{
+  /*
+    Patch format. A fixed header is followed by one zlib stream of operations that write the
+    new disc front to back:
+
+      'C' <from> <count>   Copy count bytes of the old disc starting at from
+      'D' <count> <bytes>  Write the bytes that follow
+      'Z' <count>          Write count zeros
+      'E'                  End of the disc
+
+    Numbers are unsigned LEB128. The header fields are big endian.
+  */
+  namespace patch
+  {
+    const char Magic[8] = { 'G', 'C', 'M', 'P', 'A', 'T', 'C', 'H' };
+    const uint32_t Version = 1;
+
+    //  Magic, version, old disc size, new disc size and the SHA-1 of the new disc
+    const uint32_t HeaderSize = 8 + 4 + 8 + 8 + 20;
+
+    enum Op : uint8_t
+    {
+      Copy = 'C',
+      Data = 'D',
+      Zero = 'Z',
+      End = 'E'
+    };
+  }
+}
+
+#endif
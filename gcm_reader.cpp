@@ -0,0 +1,330 @@
+#include "gcm_reader.h"
+#include "fileio.h"
+
+#include <cerrno>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace gcm
+{
+  DiscReader::DiscReader(std::string file) : m_path(file), m_fd(-1), m_data(nullptr), m_size(0), m_file(nullptr), m_file_size(0)
+  {
+    m_fd = open(file.c_str(), O_RDONLY);
+
+    if (m_fd < 0)
+    {
+      throw std::runtime_error("Could not open " + file);
+    }
+
+    struct stat st;
+
+    if (fstat(m_fd, &st) != 0)
+    {
+      close(m_fd);
+      throw std::runtime_error("Could not stat " + file);
+    }
+
+    m_size = static_cast<uint64_t>(st.st_size);
+
+    //  Empty files cannot be mapped, but are still valid to open
+    if (m_size > 0)
+    {
+      void *map = mmap(nullptr, m_size, PROT_READ, MAP_SHARED, m_fd, 0);
+
+      if (map == MAP_FAILED)
+      {
+        close(m_fd);
+        throw std::runtime_error("Could not map " + file);
+      }
+
+      m_data = static_cast<const uint8_t *>(map);
+    }
+
+    m_file = m_data;
+    m_file_size = m_size;
+
+    stats::add_syscalls(3);  //  open, fstat and mmap
+
+    if (gcz::is_gcz(std::span<const uint8_t>(m_file, static_cast<size_t>(m_file_size))))
+    {
+      try
+      {
+        open_gcz();
+      }
+      catch (...)
+      {
+        munmap(const_cast<uint8_t *>(m_file), m_file_size);
+        close(m_fd);
+        throw;
+      }
+    }
+  }
+
+  DiscReader::~DiscReader()
+  {
+    if (m_gcz && m_data)
+    {
+      munmap(const_cast<uint8_t *>(m_data), m_size);
+    }
+
+    if (m_file)
+    {
+      munmap(const_cast<uint8_t *>(m_file), m_file_size);
+    }
+
+    if (m_fd >= 0)
+    {
+      close(m_fd);
+    }
+
+    stats::add_syscalls(2);
+  }
+
+  /*
+    Summary:
+      Copies a range of the image into a new buffer
+
+    Parameters:
+      offset: Offset into the image
+      count: Number of bytes to copy
+
+    Returns:
+      A vector holding the copied data
+  */
+  std::vector<uint8_t> DiscReader::read(uint64_t offset, uint64_t count) const
+  {
+    auto data = view(offset, count);
+    return std::vector<uint8_t>(data.begin(), data.end());
+  }
+
+  /*
+    Summary:
+      Reads a fixed size string from the image. Null bytes are kept so the string can be written back as is.
+
+    Parameters:
+      offset: Offset into the image
+      count: Number of bytes in the string
+
+    Returns:
+      The string that was read
+  */
+  std::string DiscReader::read_string(uint64_t offset, uint64_t count) const
+  {
+    auto data = view(offset, count);
+    return std::string(data.begin(), data.end());
+  }
+
+  /*
+    Summary:
+      Writes a range of the image to a new file. The data is moved between the file descriptors
+      by the kernel when possible so it is never copied into a buffer of its own.
+
+    Parameters:
+      offset: Offset into the image
+      count: Number of bytes to copy
+      filename: Path of the file to create
+  */
+  void DiscReader::copy_to_file(uint64_t offset, uint64_t count, std::string filename) const
+  {
+    check(offset, count);
+
+    if (m_gcz)
+    {
+      write_out(offset, count, filename, nullptr);
+    }
+    else
+    {
+      util::copy_to_file(m_fd, offset, count, filename);
+    }
+  }
+
+  /*
+    Summary:
+      Writes a range of the image to a new file and checksums it on the way. The data is written
+      straight from the mapped image, one piece at a time, and each piece is checksummed just
+      before it is written.
+
+    Parameters:
+      offset: Offset into the image
+      count: Number of bytes to copy
+      filename: Path of the file to create
+      checksum: Checksum to update with the copied data
+  */
+  void DiscReader::copy_to_file(uint64_t offset, uint64_t count, std::string filename, util::Checksum& checksum) const
+  {
+    if (m_gcz)
+    {
+      check(offset, count);
+      write_out(offset, count, filename, &checksum);
+    }
+    else
+    {
+      util::write_checksummed(filename, view(offset, count), checksum);
+    }
+  }
+
+  /*
+    Summary:
+      Hands a range of the image to a function one piece at a time, in order. An uncompressed
+      image is handed over as a single piece. For a compressed image each block that has not
+      already been decompressed by view is decompressed into a buffer owned by the calling
+      thread, so nothing is kept once the call returns.
+
+    Parameters:
+      offset: Offset into the image
+      count: Number of bytes to hand over
+      sink: Called with each piece. A piece is only valid during the call.
+  */
+  void DiscReader::stream(uint64_t offset, uint64_t count, const std::function<void(std::span<const uint8_t>)>& sink) const
+  {
+    check(offset, count);
+
+    if (!m_gcz)
+    {
+      stats::add_read(count);
+
+      if (count > 0)
+      {
+        sink(std::span<const uint8_t>(m_data + offset, static_cast<size_t>(count)));
+      }
+
+      return;
+    }
+
+    thread_local std::vector<uint8_t> buffer;
+    uint32_t block_size = m_gcz->block_size();
+    uint64_t end = offset + count;
+
+    while (offset < end)
+    {
+      uint64_t block = offset / block_size;
+      uint64_t start = offset - block * block_size;
+      uint64_t piece = std::min<uint64_t>(block_size - start, end - offset);
+
+      if (m_ready[block].load(std::memory_order_acquire))
+      {
+        sink(std::span<const uint8_t>(m_data + offset, static_cast<size_t>(piece)));
+      }
+      else
+      {
+        buffer.resize(block_size);
+        m_gcz->decode(block, &buffer[0]);
+        sink(std::span<const uint8_t>(&buffer[start], static_cast<size_t>(piece)));
+      }
+
+      offset += piece;
+    }
+  }
+
+  //  Sets up reading a GCZ image. The uncompressed image gets an anonymous mapping that only
+  //  takes up memory where blocks are decompressed into it.
+  void DiscReader::open_gcz()
+  {
+    m_gcz = std::make_unique<GczImage>(std::span<const uint8_t>(m_file, static_cast<size_t>(m_file_size)), m_path);
+    m_size = m_gcz->size();
+    m_data = nullptr;
+    m_ready = std::make_unique<std::atomic<bool>[]>(m_gcz->block_count());
+
+    if (m_size > 0)
+    {
+      void *map = mmap(nullptr, m_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+      stats::add_syscalls();
+
+      if (map == MAP_FAILED)
+      {
+        throw std::runtime_error("Could not map " + m_path);
+      }
+
+      m_data = static_cast<const uint8_t *>(map);
+    }
+  }
+
+  //  Makes sure every block in a range has been decompressed into m_data
+  void DiscReader::decode(uint64_t offset, uint64_t count) const
+  {
+    if (count == 0)
+    {
+      return;
+    }
+
+    uint32_t block_size = m_gcz->block_size();
+
+    for (uint64_t block = offset / block_size; block <= (offset + count - 1) / block_size; block++)
+    {
+      if (m_ready[block].load(std::memory_order_acquire))
+      {
+        continue;
+      }
+
+      std::lock_guard<std::mutex> lock(m_decode_lock);
+
+      if (!m_ready[block].load(std::memory_order_relaxed))
+      {
+        //  The last block is decompressed whole, so the mapping must have room for all of it
+        uint64_t start = block * block_size;
+
+        if (start + block_size <= m_size)
+        {
+          m_gcz->decode(block, const_cast<uint8_t *>(m_data) + start);
+        }
+        else
+        {
+          std::vector<uint8_t> last(block_size);
+          m_gcz->decode(block, &last[0]);
+          memcpy(const_cast<uint8_t *>(m_data) + start, &last[0], static_cast<size_t>(m_size - start));
+        }
+
+        m_ready[block].store(true, std::memory_order_release);
+      }
+    }
+  }
+
+  //  Writes a range of a compressed image to a new file, checksumming it on the way if asked to
+  void DiscReader::write_out(uint64_t offset, uint64_t count, std::string filename, util::Checksum *checksum) const
+  {
+    int out_fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    stats::add_syscalls(2);  //  open and close
+
+    if (out_fd < 0)
+    {
+      throw std::runtime_error("Could not create " + filename + ": " + strerror(errno));
+    }
+
+    try
+    {
+      stream(offset, count, [&](std::span<const uint8_t> piece)
+      {
+        if (checksum)
+        {
+          checksum->update(piece);
+        }
+
+        size_t put = 0;
+
+        while (put < piece.size())
+        {
+          ssize_t result = write(out_fd, piece.data() + put, piece.size() - put);
+          stats::add_write(result > 0 ? result : 0, 1);
+
+          if (result < 0 && errno != EINTR)
+          {
+            throw std::runtime_error("Could not write " + filename + ": " + strerror(errno));
+          }
+
+          put += (result > 0) ? result : 0;
+        }
+      });
+    }
+    catch (...)
+    {
+      close(out_fd);
+      throw;
+    }
+
+    close(out_fd);
+  }
+}
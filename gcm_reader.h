@@ -0,0 +1,118 @@
+#ifndef _GCM_READER_H
+#define _GCM_READER_H
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "util.h"
+#include "stats.h"
+#include "checksum.h"
+#include "gcm_gcz.h"
+
+namespace gcm
+{
+  /*
+    Summary:
+      Read-only view of a disc image. The image is opened and memory mapped once so that
+      header fields, the FST and file data can be read without reopening the file.
+
+      GCZ images are read directly. Offsets and sizes are always those of the uncompressed
+      image, and only the blocks a read touches are decompressed. Blocks returned by view stay
+      decompressed in memory for as long as the reader is open, while stream decompresses bulk
+      data through a small buffer instead.
+  */
+  struct DiscReader
+  {
+    DiscReader(std::string file);
+    ~DiscReader();
+
+    DiscReader(const DiscReader&) = delete;
+    DiscReader& operator=(const DiscReader&) = delete;
+
+    inline std::string path() const
+    {
+      return m_path;
+    }
+
+    inline uint64_t size() const
+    {
+      return m_size;
+    }
+
+    inline int fd() const
+    {
+      return m_fd;
+    }
+
+    inline bool compressed() const
+    {
+      return m_gcz != nullptr;
+    }
+
+    /*
+      Summary:
+        Returns a view of the image data. Throws std::out_of_range if the range is not inside the image.
+    */
+    inline std::span<const uint8_t> view(uint64_t offset, uint64_t count) const
+    {
+      check(offset, count);
+
+      if (m_gcz)
+      {
+        decode(offset, count);
+      }
+      else
+      {
+        stats::add_read(count);
+      }
+
+      return std::span<const uint8_t>(m_data + offset, static_cast<size_t>(count));
+    }
+
+    template <typename T> inline T read_big(uint64_t offset) const
+    {
+      return util::read_big<T>(view(offset, sizeof(T)));
+    }
+
+    std::vector<uint8_t> read(uint64_t offset, uint64_t count) const;
+    std::string read_string(uint64_t offset, uint64_t count) const;
+    void copy_to_file(uint64_t offset, uint64_t count, std::string filename) const;
+    void copy_to_file(uint64_t offset, uint64_t count, std::string filename, util::Checksum& checksum) const;
+    void stream(uint64_t offset, uint64_t count, const std::function<void(std::span<const uint8_t>)>& sink) const;
+  private:
+    std::string m_path;
+    int m_fd;
+    const uint8_t *m_data;
+    uint64_t m_size;
+
+    //  The mapped file itself. The same as m_data unless the image is compressed.
+    const uint8_t *m_file;
+    uint64_t m_file_size;
+
+    //  Compressed images only: the block table and which blocks of m_data have been filled in
+    std::unique_ptr<GczImage> m_gcz;
+    std::unique_ptr<std::atomic<bool>[]> m_ready;
+    mutable std::mutex m_decode_lock;
+
+    void open_gcz();
+    void decode(uint64_t offset, uint64_t count) const;
+    void write_out(uint64_t offset, uint64_t count, std::string filename, util::Checksum *checksum) const;
+
+    inline void check(uint64_t offset, uint64_t count) const
+    {
+      if (offset > m_size || count > m_size - offset)
+      {
+        throw std::out_of_range("Read past the end of " + m_path);
+      }
+    }
+  };
+}
+
+#endif
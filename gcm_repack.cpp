@@ -0,0 +1,212 @@
+#include "gcm.h"
+
+using namespace fst;
+
+namespace gcm
+{
+  /*
+    Summary:
+      Writes a disc again with the same layout rules build uses, without extracting it first.
+      The FST keeps its entries and names, file data is packed right after it and every range
+      is copied from the source disc straight to its new offset by a pool of options.jobs
+      worker threads. With options.gcz the new disc is written as a GCZ image instead. File
+      data is ordered by options.layout.
+
+    Parameters:
+      image: Disc to read from
+      outfile: Output path for the new GCM file
+      options: Settings such as the number of worker threads
+  */
+  void repack(const Disc& image, std::string outfile, const Options& options)
+  {
+    //  The output is truncated, so it must not be the disc being read
+    if (boost::filesystem::exists(outfile) && boost::filesystem::equivalent(image.path(), outfile))
+    {
+      throw std::runtime_error("Cannot repack " + image.path() + " onto itself");
+    }
+
+    const DiscReader& disc = image.reader();
+
+    //  The header gets the new offsets, so it is a copy as well
+    Header header = image.header();
+
+    //  Same layout as build: apploader, DOL and FST follow each other on 4 byte boundaries
+    uint32_t appsize = apploader_size(disc);
+    uint32_t old_dol_offset = header.dol_offset();
+    uint32_t dolsize = dol_size(disc, old_dol_offset);
+
+    uint32_t doloffset = 0x2440 + appsize;
+    doloffset += util::pad(doloffset, 4);
+
+    uint32_t fstoffset = doloffset + dolsize;
+    fstoffset += util::pad(fstoffset, 4);
+
+    //  Packing moves the data, so it works on a table of its own
+    FST fst(image.fst().raw());
+
+    //  Remember where the data is now before packing moves it
+    stats::Phase plan_phase("plan");
+    //  Data offset of each file before packing, by entry index
+    std::vector<uint32_t> sources(fst.count(), 0);
+
+    for (auto i : fst.files())
+    {
+      sources[i] = fst.data_offset(i);
+    }
+
+    //  The original layout keeps the order the data already has on this disc
+    std::vector<uint32_t> order;
+
+    if (options.layout == layout::Original)
+    {
+      order = order_by_offset(fst, fst);
+    }
+    else if (options.layout == layout::Trace)
+    {
+      order = order_by_trace(fst, options.trace);
+    }
+
+    fst.pack(fstoffset, order);
+
+    uint64_t image_end = fstoffset + fst.raw().size();
+
+    for (auto i : fst.files())
+    {
+      if (fst.data_size(i) > 0)
+      {
+        image_end = std::max<uint64_t>(image_end, static_cast<uint64_t>(fst.data_offset(i)) + fst.data_size(i));
+      }
+    }
+
+    header.set_fst_size(fst.rawsize());
+    header.set_fst_offset(fstoffset);
+    header.set_dol_offset(doloffset);
+
+    //  Check every range up front so a bad FST fails before anything is written
+    for (auto i : fst.files())
+    {
+      if (static_cast<uint64_t>(sources[i]) + fst.data_size(i) > disc.size())
+      {
+        throw std::out_of_range(fst.path(i) + " runs past the end of " + disc.path());
+      }
+    }
+
+    plan_phase.end();
+
+    auto fstraw = fst.raw().first(fst.rawsize());
+
+    if (options.gcz)
+    {
+      stats::Phase compress_phase("compress");
+      GczWriter writer(outfile, image_end);
+
+      //  bi2 and the apploader never move, the DOL moves to follow the apploader
+      writer.add(0, header.raw());
+      writer.add_range(0x440, disc, 0x440, 0x2000 + appsize);
+      writer.add_range(doloffset, disc, old_dol_offset, dolsize);
+      writer.add(fstoffset, std::vector<uint8_t>(fstraw.begin(), fstraw.end()));
+
+      for (auto i : fst.files())
+      {
+        if (fst.data_size(i) > 0)
+        {
+          writer.add_range(fst.data_offset(i), disc, sources[i], fst.data_size(i));
+        }
+      }
+
+      writer.write(options.jobs, options.pool);
+      return;
+    }
+
+    DiscWriter writer(outfile, options.buffer_size, false, options.sparse);
+    writer.resize(image_end);
+
+    //  The kernel can only copy straight from an uncompressed disc. Compressed ones are streamed.
+    auto copy = [&writer, &disc](uint64_t to, uint64_t from, uint64_t size)
+    {
+      if (disc.compressed())
+      {
+        disc.stream(from, size, [&writer, &to](std::span<const uint8_t> piece)
+        {
+          writer.write(to, piece);
+          to += piece.size();
+        });
+      }
+      else
+      {
+        writer.copy_range(to, disc.fd(), from, size);
+      }
+    };
+
+    stats::Phase write_phase("write");
+    util::TaskGroup pool(options.pool, options.jobs);
+
+    pool.submit([&writer, raw = header.raw()]()
+    {
+      writer.write(0, raw);
+    });
+
+    //  bi2 and the apploader never move, the DOL moves to follow the apploader
+    pool.submit([&]()
+    {
+      copy(0x440, 0x440, 0x2000 + appsize);
+      copy(doloffset, old_dol_offset, dolsize);
+    });
+
+    pool.submit([&writer, fstraw, fstoffset]()
+    {
+      writer.write(fstoffset, fstraw);
+    });
+
+    uint64_t count = 0;
+    uint64_t bytes = 0;
+
+    for (auto i : fst.files())
+    {
+      if (fst.data_size(i) > 0)
+      {
+        count++;
+        bytes += fst.data_size(i);
+      }
+    }
+
+    logging::Progress progress("Repacking", count, bytes);
+
+    //  Paths are built once while walking the table rather than from each entry's parents
+    fst.visit(0, [&](uint32_t i, std::string_view path)
+    {
+      if (fst.is_dir(i))
+      {
+        return true;
+      }
+
+      uint64_t from = sources[i];
+      uint64_t to = fst.data_offset(i);
+      uint64_t size = fst.data_size(i);
+
+      if (size == 0)
+      {
+        return true;
+      }
+
+      pool.submit([&copy, &progress, from, to, size, path = std::string(path)]()
+      {
+        logging::verbose("Writing ", path);
+        auto start = std::chrono::steady_clock::now();
+        copy(to, from, size);
+        stats::add_file(path, size, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+        progress.add(size);
+      });
+
+      return true;
+    });
+
+    pool.wait();
+    writer.close();
+    progress.end();
+  }
+  void repack(std::string discpath, std::string outfile, const Options& options)
+  {
+    repack(Disc(discpath), outfile, options);
+  }
+}
@@ -0,0 +1,215 @@
+#include "gcm_store.h"
+#include "gcm_reader.h"
+#include "fileio.h"
+#include "stats.h"
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+#include <boost/filesystem.hpp>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#endif
+
+namespace gcm
+{
+  namespace
+  {
+    inline std::runtime_error io_error(std::string what, std::string path)
+    {
+      return std::runtime_error(what + " " + path + ": " + strerror(errno));
+    }
+
+    //  Numbers temporary objects so no two writers in this process pick the same name
+    std::atomic<uint64_t> g_temp_count(0);
+  }
+
+  /*
+    Summary:
+      Opens a store, creating its directories if they are missing
+
+    Parameters:
+      root: Directory of the store
+  */
+  Store::Store(std::string root) : m_root(root), m_reflink(true), m_hardlink(true)
+  {
+    boost::filesystem::create_directories(m_root + "/objects");
+    boost::filesystem::create_directories(m_root + "/tmp");
+  }
+
+  //  Objects are spread over 256 directories by the first two hex digits of their SHA-1
+  std::string Store::object_path(const std::string& sha1) const
+  {
+    return m_root + "/objects/" + sha1.substr(0, 2) + "/" + sha1.substr(2);
+  }
+
+  /*
+    Summary:
+      Adds a range of a disc as an object unless the store already has it
+
+    Parameters:
+      sha1: SHA-1 of the range as 40 hex digits
+      disc: Disc to copy the range from
+      offset: Offset of the range in the disc
+      count: Size of the range
+
+    Returns:
+      True if the object was written, false if the store already had it
+  */
+  bool Store::add(const std::string& sha1, const DiscReader& disc, uint64_t offset, uint64_t count) const
+  {
+    std::string object = object_path(sha1);
+    struct stat st;
+
+    stats::add_syscalls();
+
+    if (stat(object.c_str(), &st) == 0)
+    {
+      return false;
+    }
+
+    std::string temp = m_root + "/tmp/" + std::to_string(getpid()) + "-" + std::to_string(g_temp_count++);
+
+    try
+    {
+      disc.copy_to_file(offset, count, temp);
+      boost::filesystem::create_directories(boost::filesystem::path(object).parent_path());
+
+      //  Another writer may have added the same object meanwhile. Its data is the same, so either one can win.
+      stats::add_syscalls(2);
+
+      if (chmod(temp.c_str(), 0444) != 0 || rename(temp.c_str(), object.c_str()) != 0)
+      {
+        throw io_error("Could not add to the store", object);
+      }
+    }
+    catch (...)
+    {
+      unlink(temp.c_str());
+      throw;
+    }
+
+    return true;
+  }
+
+  /*
+    Summary:
+      Puts an object at a path, replacing whatever is there
+
+    Parameters:
+      sha1: SHA-1 of the object as 40 hex digits
+      target: Path to place it at
+  */
+  void Store::place(const std::string& sha1, std::string target) const
+  {
+    std::string object = object_path(sha1);
+
+    //  Never write through an old file at the target, it may itself be linked to an object
+    stats::add_syscalls();
+
+    if (unlink(target.c_str()) != 0 && errno != ENOENT)
+    {
+      throw io_error("Could not replace", target);
+    }
+
+#ifdef FICLONE
+    if (m_reflink)
+    {
+      int in_fd = open(object.c_str(), O_RDONLY);
+      int out_fd = in_fd < 0 ? -1 : open(target.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+      stats::add_syscalls(5);  //  open, open, ioctl, close and close
+
+      if (out_fd < 0)
+      {
+        if (in_fd >= 0)
+        {
+          close(in_fd);
+        }
+
+        throw io_error("Could not open", in_fd < 0 ? object : target);
+      }
+
+      int result = ioctl(out_fd, FICLONE, in_fd);
+      int error = errno;
+
+      close(in_fd);
+
+      if (result == 0)
+      {
+        if (close(out_fd) != 0)
+        {
+          throw io_error("Could not close", target);
+        }
+
+        return;
+      }
+
+      close(out_fd);
+      unlink(target.c_str());
+
+      //  Any other error would stop a copy just the same
+      if (error != EOPNOTSUPP && error != EXDEV && error != EINVAL && error != ENOTTY)
+      {
+        errno = error;
+        throw io_error("Could not clone", target);
+      }
+
+      m_reflink = false;
+    }
+#endif
+
+    if (m_hardlink)
+    {
+      stats::add_syscalls();
+
+      if (link(object.c_str(), target.c_str()) == 0)
+      {
+        return;
+      }
+
+      //  Too many links only rules out this object, the others can still be linked
+      if (errno != EMLINK && errno != EXDEV && errno != EPERM && errno != EOPNOTSUPP)
+      {
+        throw io_error("Could not link", target);
+      }
+
+      if (errno != EMLINK)
+      {
+        m_hardlink = false;
+      }
+    }
+
+    int in_fd = open(object.c_str(), O_RDONLY);
+    struct stat st;
+    stats::add_syscalls(3);  //  open, fstat and close
+
+    if (in_fd < 0 || fstat(in_fd, &st) != 0)
+    {
+      if (in_fd >= 0)
+      {
+        close(in_fd);
+      }
+
+      throw io_error("Could not open", object);
+    }
+
+    try
+    {
+      util::copy_to_file(in_fd, 0, static_cast<uint64_t>(st.st_size), target);
+    }
+    catch (...)
+    {
+      close(in_fd);
+      throw;
+    }
+
+    close(in_fd);
+  }
+}
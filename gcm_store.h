@@ -0,0 +1,39 @@
+#ifndef _GCM_STORE_H
+#define _GCM_STORE_H
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+namespace gcm
+{
+  struct DiscReader;
+
+  /*
+    Summary:
+      Directory of file contents named by their SHA-1, so each is kept once however many
+      discs and paths have it. Objects are written under a temporary name and renamed into
+      place, so several extracts can share a store at once. They are made read-only because
+      the files linked to them may share their data.
+
+      Files are placed from the store by reflink where the filesystem supports it, which
+      shares the data but lets the copy change on its own. Otherwise they are hard linked,
+      and copied only if neither works, such as across filesystems.
+  */
+  struct Store
+  {
+    Store(std::string root);
+
+    std::string object_path(const std::string& sha1) const;
+    bool add(const std::string& sha1, const DiscReader& disc, uint64_t offset, uint64_t count) const;
+    void place(const std::string& sha1, std::string target) const;
+  private:
+    std::string m_root;
+
+    //  Cleared the first time the filesystem turns down a reflink or a hard link
+    mutable std::atomic<bool> m_reflink;
+    mutable std::atomic<bool> m_hardlink;
+  };
+}
+
+#endif
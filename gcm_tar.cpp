@@ -0,0 +1,182 @@
+#include "gcm_tar.h"
+#include "gcm_reader.h"
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+namespace gcm
+{
+  namespace
+  {
+    //  Writes a number as zero padded octal filling a field but its last byte, which stays null
+    void octal(uint8_t *field, size_t size, uint64_t value)
+    {
+      for (size_t i = size - 1; i-- > 0; value >>= 3)
+      {
+        field[i] = static_cast<uint8_t>('0' + (value & 7));
+      }
+
+      if (value != 0)
+      {
+        throw std::out_of_range("Value too large for a tar header field");
+      }
+    }
+
+    //  Splits a path into the prefix and name fields of a ustar header, if it fits them
+    bool split(const std::string& path, std::string& prefix, std::string& name)
+    {
+      if (path.size() <= 100)
+      {
+        prefix.clear();
+        name = path;
+        return true;
+      }
+
+      //  Split at the first slash that leaves both parts short enough
+      for (size_t slash = path.find('/'); slash != std::string::npos; slash = path.find('/', slash + 1))
+      {
+        if (slash <= 155 && path.size() - slash - 1 <= 100 && slash + 1 < path.size())
+        {
+          prefix = path.substr(0, slash);
+          name = path.substr(slash + 1);
+          return true;
+        }
+      }
+
+      return false;
+    }
+  }
+
+  /*
+    Summary:
+      Starts an archive on an open handle. The handle is not closed.
+
+    Parameters:
+      fd: Handle to write to, such as stdout
+      mtime: Modification time given to every entry, in seconds since the epoch
+      buffer_size: Size of the buffer used when data cannot be copied by the kernel
+  */
+  TarWriter::TarWriter(int fd, int64_t mtime, uint32_t buffer_size) : m_out(fd, buffer_size), m_mtime(std::max<int64_t>(mtime, 0))
+  {
+  }
+
+  //  Adds a directory. Its path should end with a slash.
+  void TarWriter::add_directory(std::string path)
+  {
+    header(path, 0, '5');
+  }
+
+  //  Adds a file holding a block of data
+  void TarWriter::add(std::string path, std::span<const uint8_t> data)
+  {
+    header(path, data.size(), '0');
+    m_out.write(m_out.size(), data);
+  }
+
+  /*
+    Summary:
+      Adds a file holding a range of a disc. The kernel copies the range straight from an
+      uncompressed disc unless it is being checksummed.
+
+    Parameters:
+      path: Path of the file in the archive
+      disc: Disc to copy from
+      offset: Offset of the range in the disc
+      count: Size of the range
+      checksum: Checksum to update with the data, or null
+  */
+  void TarWriter::add_range(std::string path, const DiscReader& disc, uint64_t offset, uint64_t count, util::Checksum *checksum)
+  {
+    header(path, count, '0');
+
+    if (!checksum && !disc.compressed())
+    {
+      m_out.copy_range(m_out.size(), disc.fd(), offset, count);
+      return;
+    }
+
+    disc.stream(offset, count, [this, checksum](std::span<const uint8_t> piece)
+    {
+      if (checksum)
+      {
+        checksum->update(piece);
+      }
+
+      m_out.write(m_out.size(), piece);
+    });
+  }
+
+  //  Ends the archive with two empty blocks and pads it to a whole record
+  void TarWriter::finish()
+  {
+    uint64_t end = m_out.size() + util::pad(m_out.size(), tar::BlockSize) + 2 * tar::BlockSize;
+    m_out.finish(end + util::pad(end, tar::RecordSize));
+  }
+
+  //  Writes the headers for an entry, with a pax header first if its path does not fit ustar
+  void TarWriter::header(std::string path, uint64_t size, char type)
+  {
+    std::string prefix, name;
+
+    if (!split(path, prefix, name))
+    {
+      //  A record is "<length> path=<path>\n", where the length counts its own digits
+      std::string record = " path=" + path + "\n";
+      size_t length = record.size() + 1;
+
+      while (std::to_string(length).size() + record.size() != length)
+      {
+        length++;
+      }
+
+      record = std::to_string(length) + record;
+
+      block("PaxHeader/" + path.substr(0, 80), record.size(), 'x', 0644);
+      m_out.write(m_out.size(), std::span<const uint8_t>(reinterpret_cast<const uint8_t *>(record.data()), record.size()));
+
+      //  Older readers that skip the pax header still get most of the path
+      path = path.substr(0, 100);
+    }
+
+    block(path, size, type, type == '5' ? 0755 : 0644);
+  }
+
+  //  Writes one ustar header block, starting on the next block boundary
+  void TarWriter::block(std::string path, uint64_t size, char type, uint32_t mode)
+  {
+    uint8_t raw[tar::BlockSize] = {};
+    std::string prefix, name;
+
+    if (!split(path, prefix, name))
+    {
+      name = path.substr(0, 100);
+    }
+
+    std::copy(name.begin(), name.end(), raw);
+    octal(raw + 100, 8, mode);
+    octal(raw + 108, 8, 0);                                 //  uid
+    octal(raw + 116, 8, 0);                                 //  gid
+    octal(raw + 124, 12, size);
+    octal(raw + 136, 12, static_cast<uint64_t>(m_mtime));
+    raw[156] = static_cast<uint8_t>(type);
+    memcpy(raw + 257, "ustar", 6);                          //  Magic, with its null
+    memcpy(raw + 263, "00", 2);                             //  Version
+    std::copy(prefix.begin(), prefix.end(), raw + 345);
+
+    //  The checksum is worked out with its own field full of spaces
+    memset(raw + 148, ' ', 8);
+    uint32_t sum = 0;
+
+    for (auto byte : raw)
+    {
+      sum += byte;
+    }
+
+    octal(raw + 148, 7, sum);
+    raw[154] = 0;
+    raw[155] = ' ';
+
+    m_out.write(m_out.size() + util::pad(m_out.size(), tar::BlockSize), raw);
+  }
+}
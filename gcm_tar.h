@@ -0,0 +1,47 @@
+#ifndef _GCM_TAR_H
+#define _GCM_TAR_H
+
+#include <cstdint>
+#include <span>
+#include <string>
+
+#include "checksum.h"
+#include "gcm_writer.h"
+
+namespace gcm
+{
+  struct DiscReader;
+
+  namespace tar
+  {
+    const uint32_t BlockSize = 0x200;
+
+    //  Archives are padded to a whole record of 20 blocks, as tar itself writes them
+    const uint32_t RecordSize = 20 * BlockSize;
+  }
+
+  /*
+    Summary:
+      Writes a POSIX tar archive front to back, so the output can be a pipe. Every entry gets
+      a ustar header. Paths too long for ustar get a pax extended header with the full path
+      first, which any current tar reads. Every entry is given the same modification time and
+      no owner, so the same disc always gives the same archive.
+  */
+  struct TarWriter
+  {
+    TarWriter(int fd, int64_t mtime, uint32_t buffer_size = util::CopyBufferSize);
+
+    void add_directory(std::string path);
+    void add(std::string path, std::span<const uint8_t> data);
+    void add_range(std::string path, const DiscReader& disc, uint64_t offset, uint64_t count, util::Checksum *checksum = nullptr);
+    void finish();
+  private:
+    StreamWriter m_out;
+    int64_t m_mtime;
+
+    void header(std::string path, uint64_t size, char type);
+    void block(std::string name, uint64_t size, char type, uint32_t mode);
+  };
+}
+
+#endif
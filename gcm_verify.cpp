@@ -0,0 +1,147 @@
+#include "gcm.h"
+
+namespace gcm
+{
+  namespace
+  {
+    //  Outcome of checking one entry of a checksum list
+    enum class Result
+    {
+      Match,
+      Mismatch,
+      Missing
+    };
+
+    Result compare(const ChecksumEntry& expected, const util::Checksum& actual)
+    {
+      return expected.matches(ChecksumEntry::from(expected.path, actual)) ? Result::Match : Result::Mismatch;
+    }
+
+    util::Checksum checksum_range(const DiscReader& disc, uint64_t offset, uint64_t count)
+    {
+      util::Checksum ret;
+
+      disc.stream(offset, count, [&ret](std::span<const uint8_t> piece)
+      {
+        ret.update(piece);
+      });
+
+      return ret;
+    }
+  }
+
+  /*
+    Summary:
+      Checks a disc image or an extracted directory against a checksum list written by
+      extract --hash. Every file is checked on a pool of options.jobs worker threads and, for a
+      disc, the whole image is checked alongside them.
+
+    Parameters:
+      target: Disc image, or directory a disc was extracted to
+      checksums_path: Checksum list to check against
+      options: Settings such as the number of worker threads
+
+    Returns:
+      True if every entry in the list matched
+  */
+  bool verify(std::string target, std::string checksums_path, const Options& options)
+  {
+    Checksums checksums;
+
+    if (!checksums.load(checksums_path))
+    {
+      throw std::runtime_error("Could not read checksums from " + checksums_path);
+    }
+
+    std::vector<Result> results(checksums.files.size(), Result::Missing);
+    Result image_result = Result::Match;
+
+    if (boost::filesystem::is_directory(target))
+    {
+      //  Only the files can be checked, the image they came from is not here
+      stats::Phase phase("verify");
+      util::TaskGroup pool(options.pool, options.jobs);
+
+      for (size_t i = 0; i < checksums.files.size(); i++)
+      {
+        std::string path = target + "/files/" + checksums.files[i].path.substr(2);
+
+        if (!boost::filesystem::is_regular_file(path))
+        {
+          continue;
+        }
+
+        pool.submit([&checksums, &results, &options, path, i]()
+        {
+          results[i] = compare(checksums.files[i], util::checksum_file(path, options.buffer_size));
+        });
+      }
+
+      pool.wait();
+    }
+    else
+    {
+      Disc image(target);
+      const DiscReader& disc = image.reader();
+      const fst::FST& fst = image.fst();
+
+      stats::Phase phase("verify");
+      util::TaskGroup pool(options.pool, options.jobs);
+
+      //  The image is the largest job so it is queued first
+      for (auto& expected : checksums.image)
+      {
+        pool.submit([&disc, &expected, &image_result]()
+        {
+          image_result = compare(expected, checksum_range(disc, 0, disc.size()));
+        });
+      }
+
+      for (size_t i = 0; i < checksums.files.size(); i++)
+      {
+        auto index = fst.find(checksums.files[i].path);
+
+        if (!index || !fst.is_file(*index))
+        {
+          continue;
+        }
+
+        uint32_t offset = fst.data_offset(*index);
+        uint32_t size = fst.data_size(*index);
+
+        pool.submit([&disc, &checksums, &results, offset, size, i]()
+        {
+          results[i] = compare(checksums.files[i], checksum_range(disc, offset, size));
+        });
+      }
+
+      pool.wait();
+    }
+
+    //  Report in list order once everything is done so the output is stable
+    uint32_t failed = 0;
+
+    if (image_result != Result::Match)
+    {
+      logging::warn("Mismatch: ", checksums.image.front().path);
+      failed++;
+    }
+
+    for (size_t i = 0; i < results.size(); i++)
+    {
+      if (results[i] == Result::Mismatch)
+      {
+        logging::warn("Mismatch: ", checksums.files[i].path);
+        failed++;
+      }
+      else if (results[i] == Result::Missing)
+      {
+        logging::warn("Missing: ", checksums.files[i].path);
+        failed++;
+      }
+    }
+
+    logging::info("Checked ", results.size() + checksums.image.size(), " entries, ", failed, " failed");
+    return failed == 0;
+  }
+}
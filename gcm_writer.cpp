@@ -0,0 +1,659 @@
+#include "gcm_writer.h"
+#include "stats.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#endif
+
+namespace gcm
+{
+  namespace
+  {
+    //  Source of zeros for padding so no padding buffer has to be allocated
+    const uint8_t ZeroPage[0x1000] = {};
+
+    inline std::runtime_error io_error(std::string what, std::string path)
+    {
+      return std::runtime_error(what + " " + path + ": " + strerror(errno));
+    }
+  }
+
+  DiscWriter::DiscWriter(std::string file, uint32_t buffer_size, bool update, bool sparse, bool clone)
+    : m_path(file), m_fd(-1), m_end(0), m_buffer_size(std::max<uint32_t>(buffer_size, sizeof(ZeroPage))), m_sparse(sparse), m_clone(clone)
+  {
+    m_fd = open(file.c_str(), O_WRONLY | O_CREAT | (update ? 0 : O_TRUNC), 0644);
+    stats::add_syscalls(update ? 2 : 1);
+
+    if (m_fd < 0)
+    {
+      throw io_error("Could not create", file);
+    }
+
+    //  Existing data counts as written so it is not zeroed as a gap
+    struct stat st;
+
+    if (update && fstat(m_fd, &st) == 0)
+    {
+      m_end = static_cast<uint64_t>(st.st_size);
+    }
+  }
+
+  DiscWriter::~DiscWriter()
+  {
+    if (m_fd >= 0)
+    {
+      ::close(m_fd);
+    }
+  }
+
+  /*
+    Summary:
+      Writes a block of data at an offset in the image
+
+    Parameters:
+      offset: Offset into the image
+      data: Data to write
+  */
+  void DiscWriter::write(uint64_t offset, std::span<const uint8_t> data)
+  {
+    fill_gap(offset);
+    write_raw(offset, data.data(), data.size());
+  }
+
+  /*
+    Summary:
+      Streams a file into the image one buffer at a time. If the file is shorter than count
+      the rest of the range is filled with zeros, and if it is longer it is cut off.
+
+    Parameters:
+      offset: Offset into the image
+      path: File to copy from
+      count: Number of bytes the file occupies in the image
+
+    Returns:
+      The util::hash_bytes hash of the file data that was copied
+  */
+  uint64_t DiscWriter::write_file(uint64_t offset, std::string path, uint64_t count)
+  {
+    int in_fd = open(path.c_str(), O_RDONLY);
+    stats::add_syscalls(2);  //  open and close
+
+    if (in_fd < 0)
+    {
+      throw io_error("Could not open", path);
+    }
+
+    fill_gap(offset);
+
+    //  Every thread keeps one buffer for as long as it lives rather than one per file
+    thread_local std::vector<uint8_t> buffer;
+
+    if (buffer.size() < m_buffer_size)
+    {
+      buffer.resize(m_buffer_size);
+    }
+
+    uint64_t done = 0;
+    uint64_t hash = util::HashSeed;
+
+    //  Cloned blocks are still read for the hash, they are only not written
+    uint64_t cloned = m_clone ? clone(offset, in_fd, count) : 0;
+
+    while (done < count)
+    {
+      size_t chunk = static_cast<size_t>(std::min<uint64_t>(count - done, m_buffer_size));
+      ssize_t got = pread(in_fd, &buffer[0], chunk, done);
+      stats::add_read(got > 0 ? got : 0, 1);
+
+      if (got < 0 && errno == EINTR)
+      {
+        continue;
+      }
+
+      if (got < 0)
+      {
+        ::close(in_fd);
+        throw io_error("Could not read", path);
+      }
+
+      if (got == 0)
+      {
+        break;
+      }
+
+      if (done + got > cloned)
+      {
+        uint64_t skip = cloned > done ? cloned - done : 0;
+        write_raw(offset + done + skip, &buffer[skip], got - skip);
+      }
+
+      hash = util::hash_bytes(hash, &buffer[0], got);
+      done += got;
+    }
+
+    ::close(in_fd);
+
+    zero(offset + done, count - done);
+    return hash;
+  }
+
+  /*
+    Summary:
+      Streams a whole file into the image
+
+    Parameters:
+      offset: Offset into the image
+      path: File to copy from
+
+    Returns:
+      The util::hash_bytes hash of the file data
+  */
+  uint64_t DiscWriter::write_file(uint64_t offset, std::string path)
+  {
+    struct stat st;
+
+    stats::add_syscalls();
+
+    if (stat(path.c_str(), &st) != 0)
+    {
+      throw io_error("Could not stat", path);
+    }
+
+    return write_file(offset, path, static_cast<uint64_t>(st.st_size));
+  }
+
+  /*
+    Summary:
+      Queues a file to be copied into the image through an io_uring. It behaves as write_file
+      does, but the data is moved by the ring from the thread that waits on it.
+
+    Parameters:
+      ring: Ring to queue the copy on. It must be waited on before the image is closed.
+      offset: Offset into the image
+      path: File to copy from
+      count: Number of bytes the file occupies in the image
+      done: Called with the util::hash_bytes hash of the file data once it has been written
+  */
+  void DiscWriter::queue_file(util::CopyRing& ring, uint64_t offset, std::string path, uint64_t count, std::function<void(uint64_t)> done)
+  {
+    int in_fd = open(path.c_str(), O_RDONLY);
+    stats::add_syscalls();
+
+    if (in_fd < 0)
+    {
+      throw io_error("Could not open", path);
+    }
+
+    fill_gap(offset);
+
+    auto hash = std::make_shared<uint64_t>(util::HashSeed);
+
+    util::CopyRing::Copy copy{ .path = path, .in_fd = in_fd, .in_offset = 0, .out_fd = m_fd, .out_offset = offset, .count = count };
+    copy.owns_in = true;
+
+    copy.data = [hash](std::span<const uint8_t> piece)
+    {
+      *hash = util::hash_bytes(*hash, piece.data(), piece.size());
+    };
+
+    copy.done = [this, hash, offset, count, done](uint64_t copied)
+    {
+      raise_end(offset + copied);
+      zero(offset + copied, count - copied);
+      done(*hash);
+    };
+
+    ring.add(std::move(copy));
+  }
+
+  /*
+    Summary:
+      Copies a byte range of another open file into the image. The kernel moves the data
+      between the two files when it can, so it is never copied into a buffer of ours. If the
+      source ends early the rest of the range is filled with zeros.
+
+    Parameters:
+      offset: Offset into the image
+      in_fd: File to copy from
+      in_offset: Offset to start reading at
+      count: Number of bytes to copy
+  */
+  void DiscWriter::copy_range(uint64_t offset, int in_fd, uint64_t in_offset, uint64_t count)
+  {
+    fill_gap(offset);
+
+    uint64_t done = util::copy_range(in_fd, in_offset, m_fd, offset, count, true);
+    raise_end(offset + done);
+
+    zero(offset + done, count - done);
+  }
+
+  /*
+    Summary:
+      Writes a run of zeros into the image, or leaves it as a hole in sparse mode
+
+    Parameters:
+      offset: Offset into the image
+      count: Number of zero bytes to write
+  */
+  void DiscWriter::zero(uint64_t offset, uint64_t count)
+  {
+    if (count == 0 || (m_sparse && punch(offset, count)))
+    {
+      return;
+    }
+
+    while (count > 0)
+    {
+      uint64_t chunk = std::min<uint64_t>(count, sizeof(ZeroPage));
+      write_raw(offset, ZeroPage, chunk);
+      offset += chunk;
+      count -= chunk;
+    }
+  }
+
+  /*
+    Summary:
+      Grows or cuts the image to an exact size. Growing fills the new space with zeros, and
+      outside of sparse mode the whole image is reserved on disk.
+
+    Parameters:
+      size: New size of the image in bytes
+  */
+  void DiscWriter::resize(uint64_t size)
+  {
+    stats::add_syscalls();
+
+    if (ftruncate(m_fd, static_cast<off_t>(size)) != 0)
+    {
+      throw io_error("Could not resize", m_path);
+    }
+
+    m_end = size;
+
+    if (!m_sparse)
+    {
+      reserve(size);
+    }
+  }
+
+  /*
+    Summary:
+      Closes the output, reporting any error the final close returns
+  */
+  void DiscWriter::close()
+  {
+    if (m_fd >= 0)
+    {
+      int result = ::close(m_fd);
+      m_fd = -1;
+      stats::add_syscalls();
+
+      if (result != 0)
+      {
+        throw io_error("Could not close", m_path);
+      }
+    }
+  }
+
+  void DiscWriter::write_raw(uint64_t offset, const uint8_t *data, uint64_t count)
+  {
+    uint64_t done = 0;
+
+    while (done < count)
+    {
+      ssize_t result = pwrite(m_fd, data + done, static_cast<size_t>(count - done), offset + done);
+      stats::add_write(result > 0 ? result : 0, 1);
+
+      if (result < 0)
+      {
+        if (errno == EINTR)
+        {
+          continue;
+        }
+
+        throw io_error("Could not write", m_path);
+      }
+
+      done += result;
+    }
+
+    raise_end(offset + count);
+  }
+
+  //  Raise the end without losing a larger value stored by another thread
+  void DiscWriter::raise_end(uint64_t end)
+  {
+    uint64_t current = m_end.load();
+
+    while (current < end && !m_end.compare_exchange_weak(current, end))
+    {
+    }
+  }
+
+  /*
+    Summary:
+      Shares the whole blocks at the start of a source file with the image instead of
+      copying them. Only works when offset is on a CloneBlockSize boundary.
+
+    Returns:
+      Number of bytes cloned, 0 if nothing was. If the filesystem cannot clone, clone mode
+      is turned off.
+  */
+  uint64_t DiscWriter::clone(uint64_t offset, int in_fd, uint64_t count)
+  {
+#if defined(__linux__) && defined(FICLONERANGE)
+    uint64_t length = count - count % CloneBlockSize;
+
+    if (offset % CloneBlockSize != 0 || length == 0)
+    {
+      return 0;
+    }
+
+    file_clone_range range;
+    range.src_fd = in_fd;
+    range.src_offset = 0;
+    range.src_length = length;
+    range.dest_offset = offset;
+
+    stats::add_syscalls();
+
+    if (ioctl(m_fd, FICLONERANGE, &range) != 0)
+    {
+      //  A source shorter than count is refused as well, and is then copied and zero filled as usual
+      if (errno != EOPNOTSUPP && errno != EXDEV && errno != ENOTTY && errno != EINVAL)
+      {
+        throw io_error("Could not clone into", m_path);
+      }
+
+      if (errno != EINVAL)
+      {
+        m_clone = false;
+      }
+
+      return 0;
+    }
+
+    raise_end(offset + length);
+    return length;
+#else
+    m_clone = false;
+    return 0;
+#endif
+  }
+
+  /*
+    Summary:
+      Turns a range into a hole. Past the end of the image the file is only grown.
+
+    Returns:
+      False if the filesystem cannot punch holes, in which case sparse mode is turned off
+  */
+  bool DiscWriter::punch(uint64_t offset, uint64_t count)
+  {
+#if defined(__linux__) && defined(FALLOC_FL_PUNCH_HOLE)
+    uint64_t end = m_end.load();
+
+    if (offset < end)
+    {
+      stats::add_syscalls();
+
+      if (fallocate(m_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, std::min(count, end - offset)) != 0)
+      {
+        if (errno != EOPNOTSUPP && errno != ENOSYS)
+        {
+          throw io_error("Could not punch a hole in", m_path);
+        }
+
+        m_sparse = false;
+        return false;
+      }
+    }
+
+    if (offset + count > end)
+    {
+      resize(offset + count);
+    }
+
+    return true;
+#else
+    m_sparse = false;
+    return false;
+#endif
+  }
+
+  //  Allocates blocks for the whole image. Filesystems that cannot do this are left as they are.
+  void DiscWriter::reserve(uint64_t size)
+  {
+#ifdef __linux__
+    stats::add_syscalls();
+
+    if (size > 0 && fallocate(m_fd, 0, 0, static_cast<off_t>(size)) != 0 && errno != EOPNOTSUPP && errno != ENOSYS)
+    {
+      throw io_error("Could not reserve space for", m_path);
+    }
+#endif
+  }
+
+  //  Zero out everything between the end of the last write and offset
+  void DiscWriter::fill_gap(uint64_t offset)
+  {
+    uint64_t end = m_end.load();
+
+    if (offset > end)
+    {
+      zero(end, offset - end);
+    }
+  }
+
+  StreamWriter::StreamWriter(int fd, uint32_t buffer_size)
+    : m_fd(fd), m_end(0), m_sendfile(true), m_buffer(std::max<uint32_t>(buffer_size, sizeof(ZeroPage)))
+  {
+  }
+
+  /*
+    Summary:
+      Writes a block of data at an offset in the image
+
+    Parameters:
+      offset: Offset into the image. Must not be before the end of the last write.
+      data: Data to write
+  */
+  void StreamWriter::write(uint64_t offset, std::span<const uint8_t> data)
+  {
+    pad(offset);
+    put(data.data(), data.size());
+  }
+
+  /*
+    Summary:
+      Copies a file into the image. If the file is shorter than count the rest of the range
+      is filled with zeros, and if it is longer it is cut off.
+
+    Parameters:
+      offset: Offset into the image. Must not be before the end of the last write.
+      path: File to copy from
+      count: Number of bytes the file occupies in the image
+  */
+  void StreamWriter::write_file(uint64_t offset, std::string path, uint64_t count)
+  {
+    int in_fd = open(path.c_str(), O_RDONLY);
+    stats::add_syscalls(2);  //  open and close
+
+    if (in_fd < 0)
+    {
+      throw io_error("Could not open", path);
+    }
+
+    pad(offset);
+
+    try
+    {
+      send(in_fd, 0, count, path);
+    }
+    catch (...)
+    {
+      ::close(in_fd);
+      throw;
+    }
+
+    ::close(in_fd);
+    pad(offset + count);
+  }
+
+  /*
+    Summary:
+      Copies a byte range of another file into the image, such as file data from a disc
+
+    Parameters:
+      offset: Offset into the image. Must not be before the end of the last write.
+      in_fd: File to read from
+      in_offset: Offset to start reading at
+      count: Number of bytes to copy
+  */
+  void StreamWriter::copy_range(uint64_t offset, int in_fd, uint64_t in_offset, uint64_t count)
+  {
+    pad(offset);
+
+    if (send(in_fd, in_offset, count, "the input") < count)
+    {
+      throw std::out_of_range("Input ended before the range being streamed");
+    }
+  }
+
+  /*
+    Summary:
+      Copies from a file to the output. The kernel moves the data with sendfile where it can,
+      which works for pipes as well as files, and a buffer is used otherwise.
+
+    Returns:
+      Number of bytes copied, less than count only if the input ends early
+  */
+  uint64_t StreamWriter::send(int in_fd, uint64_t in_offset, uint64_t count, std::string path)
+  {
+    uint64_t done = 0;
+
+#ifdef __linux__
+    while (m_sendfile && done < count)
+    {
+      off_t in_pos = static_cast<off_t>(in_offset + done);
+      ssize_t result = sendfile(m_fd, in_fd, &in_pos, static_cast<size_t>(std::min<uint64_t>(count - done, 0x40000000)));
+      stats::add_syscalls();
+
+      if (result < 0 && errno == EINTR)
+      {
+        continue;
+      }
+
+      //  Outputs opened for appending, and some special files, only take plain writes
+      if (result < 0 && (errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP))
+      {
+        m_sendfile = false;
+        break;
+      }
+
+      if (result < 0)
+      {
+        throw io_error("Could not stream", path);
+      }
+
+      if (result == 0)
+      {
+        return done;
+      }
+
+      stats::add_read(result);
+      stats::add_write(result);
+      done += result;
+      m_end += result;
+    }
+#endif
+
+    while (done < count)
+    {
+      size_t chunk = static_cast<size_t>(std::min<uint64_t>(count - done, m_buffer.size()));
+      ssize_t got = pread(in_fd, &m_buffer[0], chunk, in_offset + done);
+      stats::add_read(got > 0 ? got : 0, 1);
+
+      if (got < 0 && errno == EINTR)
+      {
+        continue;
+      }
+
+      if (got < 0)
+      {
+        throw io_error("Could not read", path);
+      }
+
+      if (got == 0)
+      {
+        break;
+      }
+
+      put(&m_buffer[0], got);
+      done += got;
+    }
+
+    return done;
+  }
+
+  //  Writes zeros up to the end of the image
+  void StreamWriter::finish(uint64_t end)
+  {
+    pad(end);
+  }
+
+  //  Writes all of a block, however many calls it takes
+  void StreamWriter::put(const uint8_t *data, uint64_t count)
+  {
+    uint64_t done = 0;
+
+    while (done < count)
+    {
+      ssize_t result = ::write(m_fd, data + done, static_cast<size_t>(std::min<uint64_t>(count - done, 0x40000000)));
+      stats::add_write(result > 0 ? result : 0, 1);
+
+      if (result < 0)
+      {
+        if (errno == EINTR)
+        {
+          continue;
+        }
+
+        throw io_error("Could not write", "the output stream");
+      }
+
+      done += result;
+    }
+
+    m_end += count;
+  }
+
+  //  Writes zeros from the end of the last write up to offset
+  void StreamWriter::pad(uint64_t offset)
+  {
+    if (offset < m_end)
+    {
+      throw std::logic_error("Stream writes must go front to back: " + std::to_string(offset) + " is before " + std::to_string(m_end));
+    }
+
+    //  Gaps in a built disc are only alignment padding, so the zero page is big enough
+    while (m_end < offset)
+    {
+      uint64_t chunk = std::min<uint64_t>(offset - m_end, sizeof(ZeroPage));
+      put(ZeroPage, chunk);
+    }
+  }
+}
@@ -0,0 +1,111 @@
+#ifndef _GCM_WRITER_H
+#define _GCM_WRITER_H
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <span>
+#include <string>
+#include <vector>
+
+#include "fileio.h"
+#include "uring.h"
+
+namespace gcm
+{
+  //  Filesystems clone whole blocks of this size, so data must start on it to be cloned
+  const uint32_t CloneBlockSize = 0x1000;
+
+  /*
+    Summary:
+      Writes a disc image through a single open handle. Source files are streamed in chunks of
+      a fixed buffer size and any gap between two writes is filled with zeros. In update mode
+      an existing image is opened without truncating it so parts of it can be patched.
+
+      Once the image has been sized with resize, write, write_file and zero only use positional
+      writes inside it and may be called from several threads at once. Each thread streams
+      through its own buffer.
+
+      resize reserves the whole image on disk up front so it is laid out in as few extents as
+      possible. In sparse mode nothing is reserved and zero leaves holes instead of writing.
+
+      queue_file hands a file to an io_uring instead of streaming it on the calling thread.
+
+      In clone mode write_file asks the filesystem to share the whole blocks of a file that
+      starts on a CloneBlockSize boundary instead of writing them. Filesystems without
+      reflinks turn this down and the file is written as usual.
+  */
+  struct DiscWriter
+  {
+    DiscWriter(std::string file, uint32_t buffer_size = util::CopyBufferSize, bool update = false, bool sparse = false, bool clone = false);
+    ~DiscWriter();
+
+    DiscWriter(const DiscWriter&) = delete;
+    DiscWriter& operator=(const DiscWriter&) = delete;
+
+    //  Offset just past the furthest byte written so far
+    inline uint64_t size() const
+    {
+      return m_end;
+    }
+
+    void write(uint64_t offset, std::span<const uint8_t> data);
+    uint64_t write_file(uint64_t offset, std::string path, uint64_t count);
+    uint64_t write_file(uint64_t offset, std::string path);
+    void queue_file(util::CopyRing& ring, uint64_t offset, std::string path, uint64_t count, std::function<void(uint64_t)> done);
+    void copy_range(uint64_t offset, int in_fd, uint64_t in_offset, uint64_t count);
+    void zero(uint64_t offset, uint64_t count);
+    void resize(uint64_t size);
+    void close();
+  private:
+    std::string m_path;
+    int m_fd;
+    std::atomic<uint64_t> m_end;
+    uint32_t m_buffer_size;
+    std::atomic<bool> m_sparse;
+    std::atomic<bool> m_clone;
+
+    void write_raw(uint64_t offset, const uint8_t *data, uint64_t count);
+    void fill_gap(uint64_t offset);
+    void raise_end(uint64_t end);
+    bool punch(uint64_t offset, uint64_t count);
+    uint64_t clone(uint64_t offset, int in_fd, uint64_t count);
+    void reserve(uint64_t size);
+  };
+
+  /*
+    Summary:
+      Writes a disc image strictly front to back to a handle that cannot seek, such as stdout
+      piped into a compressor. Every write must start at or after the end of the one before
+      it, and the gap between them is written out as zeros. The handle is not closed.
+  */
+  struct StreamWriter
+  {
+    StreamWriter(int fd, uint32_t buffer_size = util::CopyBufferSize);
+
+    StreamWriter(const StreamWriter&) = delete;
+    StreamWriter& operator=(const StreamWriter&) = delete;
+
+    //  Offset of the next byte to be written
+    inline uint64_t size() const
+    {
+      return m_end;
+    }
+
+    void write(uint64_t offset, std::span<const uint8_t> data);
+    void write_file(uint64_t offset, std::string path, uint64_t count);
+    void copy_range(uint64_t offset, int in_fd, uint64_t in_offset, uint64_t count);
+    void finish(uint64_t end);
+  private:
+    int m_fd;
+    uint64_t m_end;
+    bool m_sendfile;
+    std::vector<uint8_t> m_buffer;
+
+    void put(const uint8_t *data, uint64_t count);
+    void pad(uint64_t offset);
+    uint64_t send(int in_fd, uint64_t in_offset, uint64_t count, std::string path);
+  };
+}
+
+#endif
@@ -0,0 +1,245 @@
+#include "logging.h"
+
+#include <cstdio>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+
+#include <unistd.h>
+
+namespace logging
+{
+  namespace
+  {
+    //  Queued messages are written out once this much has built up, or sooner by a progress line or flush
+    const size_t FlushSize = 0x8000;
+
+    //  Time between redraws of the progress line
+    const int64_t DrawInterval = 250;
+
+    std::mutex g_lock;
+    std::string g_buffer;
+    bool g_stderr = false;
+    Sink g_sink;
+
+    //  Progress whose line is on the terminal, if any, and whether it is drawn right now
+    Progress *g_progress = nullptr;
+    bool g_drawn = false;
+
+    //  Removes the progress line so other output starts on a clean line. Must hold g_lock.
+    void clear_line()
+    {
+      if (g_drawn)
+      {
+        std::cerr << "\r\033[K" << std::flush;
+        g_drawn = false;
+      }
+    }
+
+    //  Writes out the queued messages. Must hold g_lock.
+    void write_out()
+    {
+      if (g_buffer.empty())
+      {
+        return;
+      }
+
+      clear_line();
+
+      std::ostream& out = g_stderr ? std::cerr : std::cout;
+      out << g_buffer << std::flush;
+      g_buffer.clear();
+    }
+
+    std::string megabytes(uint64_t bytes)
+    {
+      std::ostringstream text;
+      text << std::fixed << std::setprecision(1) << bytes / 1048576.0;
+      return text.str();
+    }
+  }
+
+  namespace detail
+  {
+    std::atomic<Level> g_level(Level::Normal);
+
+    void add(Level level, std::string line)
+    {
+      std::lock_guard<std::mutex> guard(g_lock);
+
+      if (g_sink)
+      {
+        g_sink(level, line);
+        return;
+      }
+
+      g_buffer += line;
+      g_buffer += '\n';
+
+      if (g_buffer.size() >= FlushSize)
+      {
+        write_out();
+      }
+    }
+  }
+
+  void set_level(Level level)
+  {
+    detail::g_level = level;
+  }
+
+  /*
+    Summary:
+      Hands every message to a function instead of printing it, for programs that use the
+      commands as a library. Messages queued before it are written out first. The sink is
+      called with a lock held, so calls never overlap but it must not log itself. An empty
+      sink goes back to printing.
+  */
+  void set_sink(Sink sink)
+  {
+    std::lock_guard<std::mutex> guard(g_lock);
+    write_out();
+    g_sink = std::move(sink);
+  }
+
+  //  Writes out every queued message
+  void flush()
+  {
+    std::lock_guard<std::mutex> guard(g_lock);
+    write_out();
+  }
+
+  ToStderr::ToStderr()
+  {
+    std::lock_guard<std::mutex> guard(g_lock);
+    write_out();
+    g_stderr = true;
+  }
+
+  ToStderr::~ToStderr()
+  {
+    std::lock_guard<std::mutex> guard(g_lock);
+    write_out();
+    g_stderr = false;
+  }
+
+  /*
+    Summary:
+      Starts counting
+
+    Parameters:
+      what: What is being done, such as "Extracting", shown at the start of the line
+      files: Number of files that will be written
+      bytes: Number of bytes that will be written
+  */
+  Progress::Progress(std::string what, uint64_t files, uint64_t bytes)
+    : m_what(what), m_files(files), m_bytes(bytes), m_files_done(0), m_bytes_done(0), m_start(std::chrono::steady_clock::now()),
+      m_next_draw(DrawInterval), m_ended(false)
+  {
+    std::lock_guard<std::mutex> guard(g_lock);
+
+    if (!g_progress && !g_sink && level() >= Level::Normal && isatty(STDERR_FILENO))
+    {
+      g_progress = this;
+    }
+  }
+
+  Progress::~Progress()
+  {
+    std::lock_guard<std::mutex> guard(g_lock);
+
+    //  A command that failed part way through leaves no summary
+    if (g_progress == this)
+    {
+      clear_line();
+      g_progress = nullptr;
+    }
+  }
+
+  //  Counts one file as written, or a part of one when files is 0
+  void Progress::add(uint64_t bytes, uint32_t files)
+  {
+    m_files_done.fetch_add(files, std::memory_order_relaxed);
+    m_bytes_done.fetch_add(bytes, std::memory_order_relaxed);
+
+    int64_t now = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - m_start).count();
+    int64_t next = m_next_draw.load(std::memory_order_relaxed);
+
+    //  Only the one thread that moves the next draw time on gets to draw
+    if (now < next || !m_next_draw.compare_exchange_strong(next, now + DrawInterval))
+    {
+      return;
+    }
+
+    std::lock_guard<std::mutex> guard(g_lock);
+    write_out();
+
+    if (g_progress == this)
+    {
+      std::cerr << "\r" << line(now / 1000.0) << "\033[K" << std::flush;
+      g_drawn = true;
+    }
+  }
+
+  //  Takes a file that turned out not to need writing, such as one an update left alone, out of the totals
+  void Progress::skip(uint64_t bytes)
+  {
+    m_files.fetch_sub(1, std::memory_order_relaxed);
+    m_bytes.fetch_sub(bytes, std::memory_order_relaxed);
+  }
+
+  //  Takes the line down and prints the summary
+  void Progress::end()
+  {
+    if (m_ended)
+    {
+      return;
+    }
+
+    m_ended = true;
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - m_start).count();
+    uint64_t bytes = m_bytes_done.load();
+
+    std::ostringstream summary;
+    summary << m_what << ": " << m_files_done.load() << " files, " << megabytes(bytes) << " MB in "
+            << std::fixed << std::setprecision(2) << seconds << " s";
+
+    if (seconds > 0)
+    {
+      summary << " (" << megabytes(static_cast<uint64_t>(bytes / seconds)) << " MB/s)";
+    }
+
+    {
+      std::lock_guard<std::mutex> guard(g_lock);
+
+      if (g_progress == this)
+      {
+        clear_line();
+        g_progress = nullptr;
+      }
+    }
+
+    info(summary.str());
+  }
+
+  //  Text of the progress line, e.g. "Extracting: 120/3000 files, 10.5/110.0 MB, 52.3 MB/s, 0:02 left"
+  std::string Progress::line(double seconds) const
+  {
+    uint64_t bytes = m_bytes_done.load(std::memory_order_relaxed);
+    double rate = (seconds > 0) ? bytes / seconds : 0;
+
+    std::ostringstream text;
+    uint64_t total = m_bytes.load(std::memory_order_relaxed);
+
+    text << m_what << ": " << m_files_done.load(std::memory_order_relaxed) << "/" << m_files.load(std::memory_order_relaxed) << " files, "
+         << megabytes(bytes) << "/" << megabytes(total) << " MB, " << megabytes(static_cast<uint64_t>(rate)) << " MB/s";
+
+    if (rate > 0 && bytes < total)
+    {
+      uint64_t left = static_cast<uint64_t>((total - bytes) / rate);
+      text << ", " << left / 60 << ":" << std::setw(2) << std::setfill('0') << left % 60 << " left";
+    }
+
+    return text.str();
+  }
+}
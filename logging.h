@@ -0,0 +1,116 @@
+#ifndef _LOGGING_H
+#define _LOGGING_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <sstream>
+#include <string>
+
+namespace logging
+{
+  //  How much the commands print. Errors are always printed.
+  enum class Level
+  {
+    Quiet,    //  Warnings only
+    Normal,   //  Results, notices and a progress line
+    Verbose   //  Also a line for every file and directory
+  };
+
+  namespace detail
+  {
+    extern std::atomic<Level> g_level;
+
+    void add(Level level, std::string line);
+  }
+
+  //  Receives each message with the lowest level it is shown at, instead of it being printed
+  using Sink = std::function<void(Level level, const std::string& line)>;
+
+  inline Level level()
+  {
+    return detail::g_level.load(std::memory_order_relaxed);
+  }
+
+  void set_level(Level level);
+  void set_sink(Sink sink);
+  void flush();
+
+  //  Queues a line made of every part. Parts are only formatted if the line will be shown.
+  template <typename... Parts> inline void log(Level shown_at, const Parts&... parts)
+  {
+    if (level() >= shown_at)
+    {
+      std::ostringstream line;
+      (line << ... << parts);
+      detail::add(shown_at, line.str());
+    }
+  }
+
+  template <typename... Parts> inline void warn(const Parts&... parts)
+  {
+    log(Level::Quiet, parts...);
+  }
+
+  template <typename... Parts> inline void info(const Parts&... parts)
+  {
+    log(Level::Normal, parts...);
+  }
+
+  template <typename... Parts> inline void verbose(const Parts&... parts)
+  {
+    log(Level::Verbose, parts...);
+  }
+
+  /*
+    Summary:
+      Sends every message to stderr while in scope, for commands that write their data to
+      stdout. Messages queued before it are written out first.
+  */
+  struct ToStderr
+  {
+    ToStderr();
+    ~ToStderr();
+
+    ToStderr(const ToStderr&) = delete;
+    ToStderr& operator=(const ToStderr&) = delete;
+  };
+
+  /*
+    Summary:
+      Counts the files and bytes a command has written and keeps one line on stderr showing
+      them, with the rate and the time left. The line is redrawn at most a few times a
+      second and only when stderr is a terminal and no sink is set. Queued messages are
+      written out at the same time, so a long copy never sits on its output. When it ends a
+      summary line is printed.
+
+      add may be called from any thread. Only one progress line is shown at a time, so others
+      started meanwhile, such as by other jobs of a batch, only print their summary.
+  */
+  struct Progress
+  {
+    Progress(std::string what, uint64_t files, uint64_t bytes);
+    ~Progress();
+
+    void add(uint64_t bytes, uint32_t files = 1);
+    void skip(uint64_t bytes);
+    void end();
+
+    Progress(const Progress&) = delete;
+    Progress& operator=(const Progress&) = delete;
+  private:
+    std::string m_what;
+    std::atomic<uint64_t> m_files;
+    std::atomic<uint64_t> m_bytes;
+    std::atomic<uint64_t> m_files_done;
+    std::atomic<uint64_t> m_bytes_done;
+    std::chrono::steady_clock::time_point m_start;
+    std::atomic<int64_t> m_next_draw;   //  Time since start at which the line is next redrawn, in milliseconds
+    bool m_ended;
+
+    std::string line(double seconds) const;
+  };
+}
+
+#endif
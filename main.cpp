@@ -12,62 +12,641 @@
 
 void usage()
 {
-  std::cout << "Usage: gcm.exe <Command> <Root> <Output>";
+  std::cout << "Usage: gcm.exe <Command> [Options] <Root> <Output> [Paths...]";
   std::cout << R"DOC(
-    <Command>: "build"|"b" or "extract"|"e" or "files"|"f"
+       gcm.exe diff [Options] <Old> <New> <Patch>
+       gcm.exe apply [Options] <Old> <Patch> <Output>
+    <Command>: "build"|"b" or "extract"|"e" or "files"|"f" or "verify"|"v" or "repack"|"r" or "batch"
+               or "diff" or "apply"
     <Root>   : Build: Directory where a disc was previously extracted
-               Extract: Path to the disc to extract from
+               Extract: Path to the disc to extract from (.gcm or .gcz)
+               Repack: Path to the disc to repack
                Files: Path to the disc
-    <Output> : Build: Output file path and name
-               Extract: Output directory where files will be extracted
+               Verify: Path to a disc, or a directory it was extracted to
+               Batch: Job list with one command per line, or - to read it from stdin
+    <Output> : Build, Repack: Output file path and name. Build also takes - to stream the disc to stdout
+               Extract: Output directory where files will be extracted, or with --tar the archive
+                        to write, - for stdout
+               Verify: Checksum list written by extract --hash
+    [Paths...]: Extract: Only extract files matching these paths or globs, e.g. "./audio/*.adp"
+    Diff     : Writes a patch that turns the disc <Old> into <New>
+    Apply    : Writes the disc the patch makes from <Old> to <Output>, - for stdout
+    [Options]:
+      --jobs N, -j N     : Number of worker threads used to copy files (default: core count)
+      --buffer-size SIZE : Size of the copy buffer used by build, e.g. 256K or 4M (default: 1M)
+      --full             : Rebuild the whole disc instead of patching the previous build in place
+      --sparse           : Leave padding in the built disc as holes instead of reserving space for it
+      --layout MODE      : Order of file data in built and repacked discs: "original" (default),
+                           "sorted" or "trace"
+      --trace FILE       : Place files first in the order FILE lists them, one path per line
+      --io MODE          : How extract and build copy files: "auto" (default) uses io_uring when the
+                           kernel has it, "uring" requires it and "threads" uses the worker threads
+      --queue-depth N    : Number of file copies io_uring keeps in flight (default: 64)
+      --batch-jobs N     : Number of batch jobs run at once (default: 4)
+      --device-jobs N    : Number of batch jobs run at once on any one device (default: 2)
+      --gcz              : Write the built or repacked disc as a compressed GCZ image
+      --hash             : Write CRC-32, MD5 and SHA-1 of the image and each file to <Output>/checksums.txt while extracting
+      --store DIR        : Keep extracted file contents once in DIR by SHA-1 and reflink or hard link
+                           the extracted files to them, so repeated extracts share their data
+      --tar              : Extract into a tar archive instead of a directory
+      --clone            : Align file data in the built disc to 4 KiB and clone it from the source
+                           files where the filesystem supports it, such as Btrfs or XFS
+      --quiet            : Only print warnings and errors
+      --verbose          : Print a line for every file and directory written
+      --stats[=json]     : Print time, bytes, syscalls and files per phase to stderr at exit
+      --slowest N        : Number of slowest files listed by --stats (default: 10)
     Examples:
       gcm.exe extract Example.gcm output_dir
+      gcm.exe extract --jobs 4 Example.gcm output_dir
+      gcm.exe extract Example.gcm output_dir "./audio/*.adp" ./main.rel
       gcm.exe build output_dir RebuiltExample.gcm
+      gcm.exe repack Example.gcm CompactExample.gcm
+      gcm.exe repack --gcz Example.gcm Example.gcz
+      gcm.exe build --trace boot_trace.txt output_dir RebuiltExample.gcm
+      gcm.exe extract --hash Example.gcm output_dir
+      gcm.exe extract --io uring --queue-depth 128 Example.gcm output_dir
+      gcm.exe extract --store store_dir Example.gcm output_dir
+      gcm.exe extract --tar Example.gcm - | ssh host tar -x -C output_dir
+      gcm.exe build --clone output_dir RebuiltExample.gcm
+      gcm.exe build output_dir - | zstd -o RebuiltExample.gcm.zst
+      gcm.exe verify Example.gcm output_dir/checksums.txt
+      gcm.exe batch --batch-jobs 8 --device-jobs 2 jobs.txt
+      gcm.exe diff Example.gcm Translated.gcm translation.patch
+      gcm.exe apply Example.gcm translation.patch Translated.gcm
   )DOC" << std::endl;
 }
 
-int main(int argc, char *argv[])
+//  Most worker threads or jobs an option may ask for
+const uint32_t MaxJobs = 1024;
+
+/*
+  Summary:
+    Reads the count given to an option such as --jobs
+
+  Parameters:
+    value: Text of the option's value
+    max: Largest count allowed
+    count: Receives the count
+
+  Returns:
+    False if the value is not all digits or not between 1 and max
+*/
+bool parse_count(const std::string& value, uint32_t max, uint32_t& count)
 {
-  if (argc < 2)
+  //  Anything longer would not fit in 32 bits before it is compared with max
+  if (value.empty() || value.find_first_not_of("0123456789") != std::string::npos || value.size() > 9)
   {
-    usage();
-    exit(EXIT_FAILURE);
+    return false;
   }
 
-  std::string cmd(argv[1]);   //  Command comes first
+  count = util::to_int32(value);
+  return count != 0 && count <= max;
+}
+
+/*
+  Summary:
+    Splits the command line into positional arguments and options
+
+  Parameters:
+    argc, argv: Arguments after the command
+    args: Receives the positional arguments
+    options: Receives the parsed options
 
-  if (argc == 4 && (cmd == "build" || cmd == "b"))
+  Returns:
+    False if an option was not recognized, was missing its value or needs another option
+*/
+bool parse_args(int argc, char *argv[], std::vector<std::string>& args, gcm::Options& options)
+{
+  for (int i = 0; i < argc; i++)
   {
-    std::string root(argv[2]);  //  Root directory or file path
-    std::string out(argv[3]);   //  Output directory or file path
-    if (gcm::valid_directory(root))
+    std::string arg(argv[i]);
+    std::string value;
+    bool has_value = false;
+
+    //  Allow both "--opt value" and "--opt=value"
+    size_t equals = arg.find('=');
+
+    if (arg.compare(0, 2, "--") == 0 && equals != std::string::npos)
+    {
+      value = arg.substr(equals + 1);
+      arg = arg.substr(0, equals);
+      has_value = true;
+    }
+
+    bool takes_value = (arg == "--jobs" || arg == "-j" || arg == "--buffer-size" || arg == "--slowest" ||
+                        arg == "--layout" || arg == "--trace" || arg == "--io" || arg == "--queue-depth" ||
+                        arg == "--batch-jobs" || arg == "--device-jobs" || arg == "--store");
+
+    if (takes_value && !has_value)
+    {
+      if (i + 1 >= argc)
+      {
+        return false;
+      }
+
+      value = argv[++i];
+    }
+
+    if (arg == "--jobs" || arg == "-j")
+    {
+      if (!parse_count(value, MaxJobs, options.jobs))
+      {
+        return false;
+      }
+    }
+    else if (arg == "--stats")
+    {
+      //  The format can only be given with "=" so a following path is never taken as the value
+      if (!has_value)
+      {
+        value = "text";
+      }
+
+      if (value != "text" && value != "json")
+      {
+        return false;
+      }
+
+      options.stats = value;
+    }
+    else if (arg == "--slowest")
+    {
+      if (value.empty() || value.find_first_not_of("0123456789") != std::string::npos)
+      {
+        return false;
+      }
+
+      options.slowest = util::to_int32(value);
+    }
+    else if (arg == "--full")
     {
-      gcm::build(root, out);
+      if (has_value)
+      {
+        return false;
+      }
+
+      options.full = true;
+    }
+    else if (arg == "--sparse")
+    {
+      if (has_value)
+      {
+        return false;
+      }
+
+      options.sparse = true;
+    }
+    else if (arg == "--layout")
+    {
+      if (!gcm::layout::valid(value))
+      {
+        return false;
+      }
+
+      options.layout = value;
+    }
+    else if (arg == "--trace")
+    {
+      options.trace = value;
+      options.layout = gcm::layout::Trace;
+    }
+    else if (arg == "--io")
+    {
+      if (value != "auto" && value != "uring" && value != "threads")
+      {
+        return false;
+      }
+
+      options.io = value;
+    }
+    else if (arg == "--queue-depth")
+    {
+      //  Each copy in flight holds one buffer, and the ring only indexes so many of them
+      if (value.empty() || value.find_first_not_of("0123456789") != std::string::npos || value.size() > 4)
+      {
+        return false;
+      }
+
+      options.queue_depth = util::to_int32(value);
+
+      if (options.queue_depth == 0 || options.queue_depth > 4096)
+      {
+        return false;
+      }
+    }
+    else if (arg == "--batch-jobs")
+    {
+      if (!parse_count(value, MaxJobs, options.batch_jobs))
+      {
+        return false;
+      }
+    }
+    else if (arg == "--device-jobs")
+    {
+      if (!parse_count(value, MaxJobs, options.device_jobs))
+      {
+        return false;
+      }
+    }
+    else if (arg == "--gcz")
+    {
+      if (has_value)
+      {
+        return false;
+      }
+
+      options.gcz = true;
+    }
+    else if (arg == "--store")
+    {
+      if (value.empty())
+      {
+        return false;
+      }
+
+      options.store = value;
+    }
+    else if (arg == "--tar")
+    {
+      if (has_value)
+      {
+        return false;
+      }
+
+      options.tar = true;
+    }
+    else if (arg == "--clone")
+    {
+      if (has_value)
+      {
+        return false;
+      }
+
+      options.clone = true;
+    }
+    else if (arg == "--quiet")
+    {
+      if (has_value)
+      {
+        return false;
+      }
+
+      options.log_level = logging::Level::Quiet;
+    }
+    else if (arg == "--verbose")
+    {
+      if (has_value)
+      {
+        return false;
+      }
+
+      options.log_level = logging::Level::Verbose;
+    }
+    else if (arg == "--hash")
+    {
+      if (has_value)
+      {
+        return false;
+      }
+
+      options.hash = true;
+    }
+    else if (arg == "--buffer-size")
+    {
+      uint64_t size = util::parse_size(value);
+
+      if (size == 0 || size > 0x40000000)
+      {
+        return false;
+      }
+
+      options.buffer_size = static_cast<uint32_t>(size);
+    }
+    else if (arg.size() > 1 && arg[0] == '-')
+    {
+      std::cout << "Unknown option: " << arg << std::endl;
+      return false;
     }
     else
     {
-      std::cout << "Invalid directory.";
-      exit(EXIT_FAILURE);
+      args.push_back(arg);
+    }
+  }
+
+  //  A trace layout has nothing to follow without a trace
+  return options.layout != gcm::layout::Trace || !options.trace.empty();
+}
+
+/*
+  Summary:
+    Prints the stats summary to stderr if it was asked for, keeping it apart from the progress output
+*/
+void print_stats(std::string cmd, const gcm::Options& options)
+{
+  if (options.stats == "json")
+  {
+    std::cerr << stats::json(cmd) << std::endl;
+  }
+  else if (options.stats == "text")
+  {
+    std::cerr << stats::text();
+  }
+}
+
+//  Thrown when the command line itself is wrong, so usage is shown along with the error
+struct UsageError : std::runtime_error
+{
+  UsageError(std::string what) : std::runtime_error(what) {}
+};
+
+/*
+  Summary:
+    Runs one command with its arguments once the options have been parsed
+
+  Parameters:
+    cmd: Command name or alias
+    args: Arguments left after the options
+    options: Parsed options
+
+  Returns:
+    False if the command ran but found a problem, such as a verify that failed
+*/
+bool run_command(std::string cmd, const std::vector<std::string>& args, const gcm::Options& options)
+{
+  if (args.size() == 2 && (cmd == "build" || cmd == "b"))
+  {
+    std::string root(args[0]);  //  Root directory or file path
+    std::string out(args[1]);   //  Output directory or file path
+
+    if (!gcm::valid_directory(root))
+    {
+      throw std::runtime_error("Invalid directory: " + root);
     }
+
+    gcm::build(root, out, options);
+  }
+  else if (args.size() == 2 && (cmd == "repack" || cmd == "r"))
+  {
+    std::string root(args[0]);  //  Disc to read from
+    std::string out(args[1]);   //  Output file path
+    gcm::repack(root, out, options);
   }
-  else if (argc == 4 && (cmd == "extract" || cmd == "e"))
+  else if (args.size() >= 2 && (cmd == "extract" || cmd == "e"))
   {
-    std::string root(argv[2]);  //  Root directory or file path
-    std::string out(argv[3]);   //  Output directory or file path
-    gcm::extract(root, out);
+    std::string root(args[0]);  //  Root directory or file path
+    std::string out(args[1]);   //  Output directory or file path
+
+    if (options.tar)
+    {
+      gcm::extract_tar(root, out, std::vector<std::string>(args.begin() + 2, args.end()), options);
+    }
+    else if (args.size() > 2)
+    {
+      //  Any remaining arguments are paths or globs to extract on their own
+      gcm::extract_paths(root, out, std::vector<std::string>(args.begin() + 2, args.end()), options);
+    }
+    else
+    {
+      gcm::extract(root, out, options);
+    }
   }
-  else if (argc == 3 && (cmd == "files" || cmd == "f"))
+  else if (args.size() == 1 && (cmd == "files" || cmd == "f"))
   {
-    std::string root(argv[2]);  //  Root directory or file path
+    std::string root(args[0]);  //  Root directory or file path
     gcm::files(root);
   }
+  else if (args.size() == 2 && (cmd == "verify" || cmd == "v"))
+  {
+    std::string root(args[0]);        //  Disc or extracted directory
+    std::string checksums(args[1]);   //  Checksum list to check against
+
+    return gcm::verify(root, checksums, options);
+  }
+  else if (args.size() == 3 && cmd == "diff")
+  {
+    std::string old_disc(args[0]);  //  Disc the patch applies to
+    std::string new_disc(args[1]);  //  Disc the patch makes
+    std::string patch(args[2]);     //  Patch file to write
+    gcm::diff(old_disc, new_disc, patch, options);
+  }
+  else if (args.size() == 3 && cmd == "apply")
+  {
+    std::string disc(args[0]);    //  Disc the patch applies to
+    std::string patch(args[1]);   //  Patch written by diff
+    std::string out(args[2]);     //  Output file path
+    gcm::apply(disc, patch, out, options);
+  }
   else
   {
-    std::cout << "Invalid command: " << cmd << std::endl;
+    throw UsageError("Invalid command: " + cmd);
+  }
+
+  return true;
+}
+
+/*
+  Summary:
+    Reads a batch job list. Each line holds a command with its options and arguments just as
+    they would be given on the command line, and its options apply on top of the ones given
+    to batch. Empty lines and lines starting with # are skipped. A line that cannot be parsed
+    still becomes a job, one that fails, so the rest of the batch runs. A line that gives an
+    option only batch itself can use, such as --quiet or --stats, is a usage error.
+
+  Parameters:
+    in: Stream to read the job list from
+    options: Options given to batch, including the shared pool
+
+  Returns:
+    One job for each command in the list
+*/
+std::vector<gcm::BatchJob> read_jobs(std::istream& in, const gcm::Options& options)
+{
+  std::vector<gcm::BatchJob> jobs;
+  std::string line;
+  uint32_t number = 0;
+
+  while (std::getline(in, line))
+  {
+    number++;
+    std::vector<std::string> words = util::split_args(line);
+
+    if (words.empty() || words[0][0] == '#')
+    {
+      continue;
+    }
+
+    gcm::BatchJob job;
+
+    for (auto& word : words)
+    {
+      job.name += (job.name.empty() ? "" : " ") + word;
+    }
+
+    //  parse_args works on an argv, so point one at the words
+    std::vector<char *> argv;
+
+    for (auto& word : words)
+    {
+      argv.push_back(&word[0]);
+    }
+
+    std::string cmd = words[0];
+    std::vector<std::string> args;
+    gcm::Options job_options = options;
+    bool valid = cmd != "batch" && parse_args(static_cast<int>(argv.size()) - 1, argv.data() + 1, args, job_options);
+
+    //  Logging, stats and scheduling are set up once for the whole batch, so a job cannot change them
+    if (valid && (job_options.log_level != options.log_level || job_options.stats != options.stats ||
+                  job_options.slowest != options.slowest || job_options.batch_jobs != options.batch_jobs ||
+                  job_options.device_jobs != options.device_jobs))
+    {
+      throw UsageError("Line " + std::to_string(number) + " of the job list: --quiet, --verbose, --stats, --slowest, "
+                       "--batch-jobs and --device-jobs apply to the whole batch and can only be given to batch");
+    }
+
+    if (!valid)
+    {
+      std::string error = "line " + std::to_string(number) + " of the job list is not a valid command";
+
+      job.run = [error]() -> bool
+      {
+        throw std::runtime_error(error);
+      };
+    }
+    else
+    {
+      //  Files and verify only read, and diff and apply read two arguments and write the third.
+      //  The rest read their first argument and write their second, and extract paths after
+      //  those are inside the disc.
+      if (cmd == "files" || cmd == "f" || cmd == "verify" || cmd == "v")
+      {
+        job.inputs = args;
+      }
+      else if ((cmd == "diff" || cmd == "apply") && args.size() == 3)
+      {
+        job.inputs.assign(args.begin(), args.begin() + 2);
+        job.outputs.push_back(args[2]);
+      }
+      else if (args.size() >= 2)
+      {
+        job.inputs.push_back(args[0]);
+        job.outputs.push_back(args[1]);
+      }
+
+      job.run = [cmd, args, job_options]()
+      {
+        return run_command(cmd, args, job_options);
+      };
+    }
+
+    jobs.push_back(job);
+  }
+
+  return jobs;
+}
+
+/*
+  Summary:
+    Runs every command in a job list on one shared pool of worker threads
+
+  Parameters:
+    list: Path to the job list, or "-" to read it from stdin
+    options: Options for every job, such as the size of the shared pool
+
+  Returns:
+    True if every job succeeded
+*/
+bool batch(std::string list, gcm::Options options)
+{
+  //  Every job runs its work on this pool instead of starting one of its own
+  util::ThreadPool shared(options.jobs);
+  options.pool = &shared;
+
+  std::vector<gcm::BatchJob> jobs;
+
+  if (list == "-")
+  {
+    jobs = read_jobs(std::cin, options);
+  }
+  else
+  {
+    std::ifstream in(list);
+
+    if (!in)
+    {
+      throw std::runtime_error("Could not open job list " + list);
+    }
+
+    jobs = read_jobs(in, options);
+  }
+
+  //  Jobs overlap, so their phases cannot nest. Everything is counted as one batch phase.
+  stats::Phase phase("batch");
+  stats::freeze_phases();
+
+  return gcm::run_batch(jobs, options);
+}
+
+int main(int argc, char *argv[])
+{
+  if (argc < 2)
+  {
     usage();
     exit(EXIT_FAILURE);
   }
 
+  std::string cmd(argv[1]);   //  Command comes first
+  gcm::Options options;
+  bool ok = true;
+
+  try
+  {
+    std::vector<std::string> args;
+
+    if (!parse_args(argc - 2, argv + 2, args, options))
+    {
+      usage();
+      exit(EXIT_FAILURE);
+    }
+
+    if (!options.stats.empty())
+    {
+      stats::enable(options.slowest);
+    }
+
+    logging::set_level(options.log_level);
+
+    if (cmd == "batch")
+    {
+      if (args.size() != 1)
+      {
+        throw UsageError("batch needs one job list");
+      }
+
+      ok = batch(args[0], options);
+    }
+    else
+    {
+      ok = run_command(cmd, args, options);
+    }
+  }
+  catch (const UsageError& e)
+  {
+    logging::flush();
+    std::cout << e.what() << std::endl;
+    usage();
+    exit(EXIT_FAILURE);
+  }
+  catch (const std::exception& e)
+  {
+    //  stderr, so a failed build to stdout never adds text to the disc it streams
+    logging::flush();
+    std::cerr << "Error: " << e.what() << std::endl;
+    print_stats(cmd, options);
+    exit(EXIT_FAILURE);
+  }
 
-  return EXIT_SUCCESS;
+  logging::flush();
+  print_stats(cmd, options);
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
 }
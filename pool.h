@@ -0,0 +1,314 @@
+#ifndef _POOL_H
+#define _POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace util
+{
+  /*
+    Summary:
+      Fixed size pool of worker threads fed from a bounded queue. submit() blocks while the
+      queue is full so the amount of pending work (and the memory it holds) stays capped.
+      The first exception thrown by a task is rethrown from wait().
+  */
+  struct ThreadPool
+  {
+    ThreadPool(uint32_t threads, uint32_t queue_limit = 0) : m_limit(queue_limit), m_active(0), m_stop(false)
+    {
+      if (threads == 0)
+      {
+        threads = 1;
+      }
+
+      if (m_limit == 0)
+      {
+        m_limit = threads * 2;
+      }
+
+      for (uint32_t i = 0; i < threads; i++)
+      {
+        m_workers.push_back(std::thread(&ThreadPool::run, this));
+      }
+    }
+
+    ~ThreadPool()
+    {
+      {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+      }
+
+      m_work_ready.notify_all();
+
+      for (auto& worker : m_workers)
+      {
+        worker.join();
+      }
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    inline void submit(std::function<void()> task)
+    {
+      std::unique_lock<std::mutex> lock(m_mutex);
+      m_space_ready.wait(lock, [this]{ return m_queue.size() < m_limit; });
+      m_queue.push_back(std::move(task));
+      lock.unlock();
+      m_work_ready.notify_one();
+      m_changed.notify_all();
+    }
+
+    //  Queues a task unless the queue is full. Returns whether it was queued.
+    inline bool try_submit(std::function<void()>& task)
+    {
+      std::unique_lock<std::mutex> lock(m_mutex);
+
+      if (m_queue.size() >= m_limit)
+      {
+        return false;
+      }
+
+      m_queue.push_back(std::move(task));
+      lock.unlock();
+      m_work_ready.notify_one();
+      m_changed.notify_all();
+      return true;
+    }
+
+    //  Runs the oldest queued task on the calling thread. Returns false if there was none.
+    inline bool run_one()
+    {
+      std::unique_lock<std::mutex> lock(m_mutex);
+
+      if (m_queue.empty())
+      {
+        return false;
+      }
+
+      execute(lock);
+      return true;
+    }
+
+    //  Runs queued tasks on the calling thread until done returns true. done is checked with
+    //  the pool locked, after every task that finishes and every task that is queued.
+    inline void help_until(const std::function<bool()>& done)
+    {
+      std::unique_lock<std::mutex> lock(m_mutex);
+
+      while (true)
+      {
+        m_changed.wait(lock, [this, &done]{ return done() || !m_queue.empty(); });
+
+        if (done())
+        {
+          return;
+        }
+
+        execute(lock);
+      }
+    }
+
+    inline void wait()
+    {
+      std::unique_lock<std::mutex> lock(m_mutex);
+      m_idle.wait(lock, [this]{ return m_queue.empty() && m_active == 0; });
+
+      if (m_error)
+      {
+        std::exception_ptr error = m_error;
+        m_error = nullptr;
+        std::rethrow_exception(error);
+      }
+    }
+
+    inline uint32_t size() const
+    {
+      return static_cast<uint32_t>(m_workers.size());
+    }
+
+    //  Number of hardware threads, or 1 if it cannot be determined
+    static inline uint32_t default_threads()
+    {
+      uint32_t count = std::thread::hardware_concurrency();
+      return count ? count : 1;
+    }
+  private:
+    std::vector<std::thread> m_workers;
+    std::deque<std::function<void()>> m_queue;
+    std::mutex m_mutex;
+    std::condition_variable m_work_ready;   //  Signalled when a task is queued or the pool stops
+    std::condition_variable m_space_ready;  //  Signalled when a task leaves the queue
+    std::condition_variable m_idle;         //  Signalled when a task finishes
+    std::condition_variable m_changed;      //  Signalled when a task is queued or finishes, for help_until
+    std::exception_ptr m_error;
+
+    size_t m_limit;
+    uint32_t m_active;
+    bool m_stop;
+
+    inline void run()
+    {
+      std::unique_lock<std::mutex> lock(m_mutex);
+
+      while (true)
+      {
+        m_work_ready.wait(lock, [this]{ return m_stop || !m_queue.empty(); });
+
+        if (m_queue.empty())
+        {
+          return;
+        }
+
+        execute(lock);
+      }
+    }
+
+    //  Takes the oldest task off the queue and runs it with the pool unlocked. lock must hold
+    //  the pool and still holds it afterwards.
+    inline void execute(std::unique_lock<std::mutex>& lock)
+    {
+      std::function<void()> task = std::move(m_queue.front());
+      m_queue.pop_front();
+      m_active++;
+
+      lock.unlock();
+      m_space_ready.notify_one();
+
+      try
+      {
+        task();
+      }
+      catch (...)
+      {
+        std::lock_guard<std::mutex> error_lock(m_mutex);
+
+        if (!m_error)
+        {
+          m_error = std::current_exception();
+        }
+      }
+
+      //  Anything the task held must be released before anyone waiting on it wakes up
+      task = nullptr;
+
+      lock.lock();
+      m_active--;
+
+      m_idle.notify_all();
+      m_changed.notify_all();
+    }
+  };
+
+  /*
+    Summary:
+      Tasks that are waited on together. On a shared pool a group only waits for its own
+      tasks, and the thread waiting runs queued tasks meanwhile instead of sleeping, as does
+      a thread that finds the queue full. Tasks can then start groups of their own on the
+      same pool without every worker ending up blocked. Without a shared pool the group
+      starts a pool of its own and behaves just like one. The first exception thrown by one
+      of its tasks is rethrown from wait().
+  */
+  struct TaskGroup
+  {
+    TaskGroup(ThreadPool *shared, uint32_t threads) : m_pool(shared), m_pending(0)
+    {
+      if (!m_pool)
+      {
+        m_owned = std::make_unique<ThreadPool>(threads);
+        m_pool = m_owned.get();
+      }
+    }
+
+    ~TaskGroup()
+    {
+      if (!m_owned)
+      {
+        m_pool->help_until([this]{ return m_pending == 0; });
+      }
+    }
+
+    TaskGroup(const TaskGroup&) = delete;
+    TaskGroup& operator=(const TaskGroup&) = delete;
+
+    inline void submit(std::function<void()> task)
+    {
+      m_pending++;
+
+      std::function<void()> wrapped = [this, task = std::move(task)]() mutable
+      {
+        try
+        {
+          task();
+        }
+        catch (...)
+        {
+          std::lock_guard<std::mutex> lock(m_error_lock);
+
+          if (!m_error)
+          {
+            m_error = std::current_exception();
+          }
+        }
+
+        //  The group may be gone as soon as the count drops, so nothing of it is touched after
+        task = nullptr;
+        m_pending--;
+      };
+
+      if (m_owned)
+      {
+        m_pool->submit(std::move(wrapped));
+        return;
+      }
+
+      while (!m_pool->try_submit(wrapped))
+      {
+        m_pool->run_one();
+      }
+    }
+
+    inline void wait()
+    {
+      if (m_owned)
+      {
+        m_pool->wait();
+      }
+      else
+      {
+        m_pool->help_until([this]{ return m_pending == 0; });
+      }
+
+      std::lock_guard<std::mutex> lock(m_error_lock);
+
+      if (m_error)
+      {
+        std::exception_ptr error = m_error;
+        m_error = nullptr;
+        std::rethrow_exception(error);
+      }
+    }
+
+    inline uint32_t size() const
+    {
+      return m_pool->size();
+    }
+  private:
+    std::unique_ptr<ThreadPool> m_owned;
+    ThreadPool *m_pool;
+    std::atomic<uint32_t> m_pending;
+    std::mutex m_error_lock;
+    std::exception_ptr m_error;
+  };
+}
+
+#endif
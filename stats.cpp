@@ -0,0 +1,272 @@
+#include "stats.h"
+
+#include <algorithm>
+#include <deque>
+#include <iomanip>
+#include <mutex>
+#include <sstream>
+#include <vector>
+
+namespace stats
+{
+  namespace
+  {
+    struct FileTime
+    {
+      std::string path;
+      uint64_t bytes;
+      double seconds;
+    };
+
+    //  Everything counted outside of a named phase lands in the first one
+    std::deque<PhaseData> make_phases()
+    {
+      std::deque<PhaseData> ret;
+      ret.emplace_back("other");
+      return ret;
+    }
+
+    //  Phases live in a deque so pointers to them stay valid as more are added
+    std::deque<PhaseData> g_phases = make_phases();
+
+    std::chrono::steady_clock::time_point g_start;
+    uint32_t g_slowest = 0;
+    bool g_frozen = false;
+    std::mutex g_files_lock;
+    std::vector<FileTime> g_files;
+
+    std::string escape(std::string value)
+    {
+      std::ostringstream out;
+
+      for (unsigned char c : value)
+      {
+        switch (c)
+        {
+          case '"': out << "\\\""; break;
+          case '\\': out << "\\\\"; break;
+          case '\n': out << "\\n"; break;
+          case '\t': out << "\\t"; break;
+          default:
+            if (c < 0x20)
+            {
+              out << "\\u" << std::hex << std::setw(4) << std::setfill('0') << static_cast<int>(c) << std::dec;
+            }
+            else
+            {
+              out << c;
+            }
+        }
+      }
+
+      return out.str();
+    }
+
+    double elapsed()
+    {
+      return std::chrono::duration<double>(std::chrono::steady_clock::now() - g_start).count();
+    }
+
+    //  Slowest files first
+    std::vector<FileTime> slowest_files()
+    {
+      std::lock_guard<std::mutex> lock(g_files_lock);
+      std::vector<FileTime> ret = g_files;
+
+      std::sort(ret.begin(), ret.end(), [](const FileTime& a, const FileTime& b)
+      {
+        return a.seconds > b.seconds;
+      });
+
+      return ret;
+    }
+  }
+
+  namespace detail
+  {
+    bool g_enabled = false;
+    std::atomic<PhaseData *> g_current(&g_phases.front());
+  }
+
+  Phase::Phase(std::string name) : m_data(nullptr), m_parent(nullptr)
+  {
+    if (detail::g_enabled && !g_frozen)
+    {
+      g_phases.emplace_back(name);
+      m_data = &g_phases.back();
+      m_parent = detail::g_current.exchange(m_data);
+      m_start = std::chrono::steady_clock::now();
+    }
+  }
+
+  Phase::~Phase()
+  {
+    end();
+  }
+
+  //  Stops the phase before it goes out of scope. Later calls do nothing.
+  void Phase::end()
+  {
+    if (m_data)
+    {
+      m_data->seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - m_start).count();
+      detail::g_current.store(m_parent);
+      m_data = nullptr;
+    }
+  }
+
+  /*
+    Summary:
+      Turns on collection. Must be called before any worker threads are started.
+
+    Parameters:
+      slowest: Number of slowest files to remember
+  */
+  void enable(uint32_t slowest)
+  {
+    detail::g_enabled = true;
+    g_slowest = slowest;
+    g_start = std::chrono::steady_clock::now();
+  }
+
+  /*
+    Summary:
+      Charges everything from now on to the current phase. Phases opened later do nothing, so
+      commands can run on several threads at once without nesting their phases in each other.
+      Must be called before those threads are started.
+  */
+  void freeze_phases()
+  {
+    g_frozen = true;
+  }
+
+  /*
+    Summary:
+      Counts a file against the current phase and remembers it if it is one of the slowest
+
+    Parameters:
+      path: File that was copied
+      bytes: Size of the file
+      seconds: Time taken to copy it
+  */
+  void add_file(std::string path, uint64_t bytes, double seconds)
+  {
+    if (!detail::g_enabled)
+    {
+      return;
+    }
+
+    detail::g_current.load(std::memory_order_acquire)->files.fetch_add(1, std::memory_order_relaxed);
+
+    if (g_slowest == 0)
+    {
+      return;
+    }
+
+    std::lock_guard<std::mutex> lock(g_files_lock);
+
+    if (g_files.size() < g_slowest)
+    {
+      g_files.push_back(FileTime{ path, bytes, seconds });
+      return;
+    }
+
+    //  Replace the fastest of the files kept so far if this one was slower
+    auto fastest = std::min_element(g_files.begin(), g_files.end(), [](const FileTime& a, const FileTime& b)
+    {
+      return a.seconds < b.seconds;
+    });
+
+    if (seconds > fastest->seconds)
+    {
+      *fastest = FileTime{ path, bytes, seconds };
+    }
+  }
+
+  /*
+    Summary:
+      Formats everything collected as a table for people to read
+  */
+  std::string text()
+  {
+    std::ostringstream out;
+
+    out << std::left << std::setw(16) << "phase" << std::right << std::setw(12) << "ms"
+        << std::setw(16) << "read" << std::setw(16) << "written" << std::setw(12) << "syscalls"
+        << std::setw(10) << "files" << "\n";
+
+    for (auto& phase : g_phases)
+    {
+      //  The catch-all phase is only worth showing if something landed in it
+      if (&phase == &g_phases.front() && phase.bytes_read == 0 && phase.bytes_written == 0 && phase.syscalls == 0 && phase.files == 0)
+      {
+        continue;
+      }
+
+      out << std::left << std::setw(16) << phase.name << std::right
+          << std::setw(12) << std::fixed << std::setprecision(3) << phase.seconds * 1000.0
+          << std::setw(16) << phase.bytes_read.load() << std::setw(16) << phase.bytes_written.load()
+          << std::setw(12) << phase.syscalls.load() << std::setw(10) << phase.files.load() << "\n";
+    }
+
+    out << "total " << std::fixed << std::setprecision(3) << elapsed() * 1000.0 << " ms\n";
+
+    auto files = slowest_files();
+
+    if (!files.empty())
+    {
+      out << "slowest files:\n";
+
+      for (auto& file : files)
+      {
+        out << "  " << std::setw(10) << file.seconds * 1000.0 << " ms  " << std::setw(12) << file.bytes << "  " << file.path << "\n";
+      }
+    }
+
+    return out.str();
+  }
+
+  /*
+    Summary:
+      Formats everything collected as a single JSON object
+
+    Parameters:
+      command: Name of the command that was run
+  */
+  std::string json(std::string command)
+  {
+    std::ostringstream out;
+    uint64_t read = 0, written = 0, syscalls = 0, files = 0;
+
+    out << std::setprecision(9);
+    out << "{\"command\":\"" << escape(command) << "\",\"seconds\":" << elapsed() << ",\"phases\":[";
+
+    for (size_t i = 0; i < g_phases.size(); i++)
+    {
+      auto& phase = g_phases[i];
+
+      read += phase.bytes_read;
+      written += phase.bytes_written;
+      syscalls += phase.syscalls;
+      files += phase.files;
+
+      out << (i ? "," : "") << "{\"name\":\"" << escape(phase.name) << "\",\"seconds\":" << phase.seconds
+          << ",\"bytes_read\":" << phase.bytes_read << ",\"bytes_written\":" << phase.bytes_written
+          << ",\"syscalls\":" << phase.syscalls << ",\"files\":" << phase.files << "}";
+    }
+
+    out << "],\"totals\":{\"bytes_read\":" << read << ",\"bytes_written\":" << written
+        << ",\"syscalls\":" << syscalls << ",\"files\":" << files << "},\"slowest_files\":[";
+
+    auto slowest = slowest_files();
+
+    for (size_t i = 0; i < slowest.size(); i++)
+    {
+      out << (i ? "," : "") << "{\"path\":\"" << escape(slowest[i].path) << "\",\"bytes\":" << slowest[i].bytes
+          << ",\"seconds\":" << slowest[i].seconds << "}";
+    }
+
+    out << "]}";
+    return out.str();
+  }
+}
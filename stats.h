@@ -0,0 +1,95 @@
+#ifndef _STATS_H
+#define _STATS_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+namespace stats
+{
+  //  Counters for one phase of a command. Updated from any thread.
+  struct PhaseData
+  {
+    PhaseData(std::string name) : name(name), seconds(0), bytes_read(0), bytes_written(0), syscalls(0), files(0) {}
+
+    std::string name;
+    double seconds;
+    std::atomic<uint64_t> bytes_read;
+    std::atomic<uint64_t> bytes_written;
+    std::atomic<uint64_t> syscalls;
+    std::atomic<uint64_t> files;
+  };
+
+  namespace detail
+  {
+    extern bool g_enabled;
+
+    //  Loaded with acquire so a phase opened on the main thread is fully built before
+    //  a worker adds to it
+    extern std::atomic<PhaseData *> g_current;
+  }
+
+  //  True once enable has been called. Every counter is a no-op until then.
+  inline bool enabled()
+  {
+    return detail::g_enabled;
+  }
+
+  inline void add_read(uint64_t bytes, uint64_t syscalls = 0)
+  {
+    if (detail::g_enabled)
+    {
+      PhaseData *phase = detail::g_current.load(std::memory_order_acquire);
+      phase->bytes_read.fetch_add(bytes, std::memory_order_relaxed);
+      phase->syscalls.fetch_add(syscalls, std::memory_order_relaxed);
+    }
+  }
+
+  inline void add_write(uint64_t bytes, uint64_t syscalls = 0)
+  {
+    if (detail::g_enabled)
+    {
+      PhaseData *phase = detail::g_current.load(std::memory_order_acquire);
+      phase->bytes_written.fetch_add(bytes, std::memory_order_relaxed);
+      phase->syscalls.fetch_add(syscalls, std::memory_order_relaxed);
+    }
+  }
+
+  inline void add_syscalls(uint64_t count = 1)
+  {
+    if (detail::g_enabled)
+    {
+      detail::g_current.load(std::memory_order_acquire)->syscalls.fetch_add(count, std::memory_order_relaxed);
+    }
+  }
+
+  /*
+    Summary:
+      Times a named phase for as long as it is in scope. Counters added while it is the
+      innermost phase are charged to it. Phases must be opened and closed on one thread,
+      but counters may be added from any thread.
+  */
+  struct Phase
+  {
+    Phase(std::string name);
+    ~Phase();
+
+    void end();
+
+    Phase(const Phase&) = delete;
+    Phase& operator=(const Phase&) = delete;
+  private:
+    PhaseData *m_data;
+    PhaseData *m_parent;
+    std::chrono::steady_clock::time_point m_start;
+  };
+
+  void enable(uint32_t slowest = 10);
+  void freeze_phases();
+  void add_file(std::string path, uint64_t bytes, double seconds);
+  std::string text();
+  std::string json(std::string command);
+}
+
+#endif
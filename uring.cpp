@@ -0,0 +1,537 @@
+#include "uring.h"
+#include "stats.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+#include <unistd.h>
+
+//  io_uring is driven through its system calls directly so there is nothing extra to link
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#define COPYRING_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#endif
+
+namespace util
+{
+#ifdef COPYRING_URING
+  namespace
+  {
+    //  Copies queue this many requests before they are handed to the kernel in one call
+    const uint32_t SubmitBatch = 8;
+
+    inline int ring_setup(uint32_t entries, io_uring_params *params)
+    {
+      return static_cast<int>(syscall(__NR_io_uring_setup, entries, params));
+    }
+
+    inline int ring_enter(int fd, uint32_t submit, uint32_t wait_for)
+    {
+      return static_cast<int>(syscall(__NR_io_uring_enter, fd, submit, wait_for, wait_for > 0 ? IORING_ENTER_GETEVENTS : 0, nullptr, 0));
+    }
+
+    inline int ring_register(int fd, uint32_t opcode, const void *arg, uint32_t count)
+    {
+      return static_cast<int>(syscall(__NR_io_uring_register, fd, opcode, arg, count));
+    }
+
+    /*
+      Summary:
+        Checks whether a ring can read and write files with IORING_OP_READ and IORING_OP_WRITE.
+        Kernels 5.1 to 5.5 set up a ring without them, and without the probe that tells.
+
+      Parameters:
+        fd: Ring to ask
+    */
+    bool supports_copies(int fd)
+    {
+      const uint32_t count = 256;
+      std::vector<uint8_t> memory(sizeof(io_uring_probe) + count * sizeof(io_uring_probe_op), 0);
+      auto probe = reinterpret_cast<io_uring_probe *>(memory.data());
+
+      if (ring_register(fd, IORING_REGISTER_PROBE, probe, count) < 0)
+      {
+        return false;
+      }
+
+      auto supported = [probe](uint32_t op)
+      {
+        return op <= probe->last_op && (probe->ops[op].flags & IO_URING_OP_SUPPORTED);
+      };
+
+      return supported(IORING_OP_READ) && supported(IORING_OP_WRITE);
+    }
+
+    inline void *ring_map(int fd, size_t size, uint64_t offset)
+    {
+      void *map = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, static_cast<off_t>(offset));
+      return map == MAP_FAILED ? nullptr : map;
+    }
+
+    inline uint32_t *field(void *map, uint32_t offset)
+    {
+      return reinterpret_cast<uint32_t *>(static_cast<uint8_t *>(map) + offset);
+    }
+  }
+
+  /*
+    Summary:
+      Sets up the ring and one buffer for each copy that can be in flight
+
+    Parameters:
+      depth: Number of copies kept in flight at once
+      chunk_size: Size of each copy's buffer
+  */
+  CopyRing::CopyRing(uint32_t depth, uint32_t chunk_size)
+    : m_fd(-1), m_chunk_size(std::max<uint32_t>(chunk_size, 0x1000)), m_fixed(false), m_sq_map(nullptr), m_sq_map_size(0),
+      m_cq_map(nullptr), m_cq_map_size(0), m_sqes(nullptr), m_sqes_size(0), m_buffers(nullptr), m_unsubmitted(0)
+  {
+    depth = std::max<uint32_t>(depth, 1);
+    m_slots.resize(depth);
+
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    m_fd = ring_setup(depth, &params);
+    stats::add_syscalls();
+
+    if (m_fd < 0)
+    {
+      throw std::runtime_error(std::string("io_uring is not available: ") + strerror(errno));
+    }
+
+    try
+    {
+      stats::add_syscalls();
+
+      if (!supports_copies(m_fd))
+      {
+        throw std::runtime_error("io_uring on this kernel cannot read or write files");
+      }
+
+      m_sq_map_size = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+      m_cq_map_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+
+      //  Newer kernels share one mapping between both rings
+      if (params.features & IORING_FEAT_SINGLE_MMAP)
+      {
+        m_sq_map_size = m_cq_map_size = std::max(m_sq_map_size, m_cq_map_size);
+      }
+
+      m_sq_map = ring_map(m_fd, m_sq_map_size, IORING_OFF_SQ_RING);
+      m_cq_map = (params.features & IORING_FEAT_SINGLE_MMAP) ? m_sq_map : ring_map(m_fd, m_cq_map_size, IORING_OFF_CQ_RING);
+      m_sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+      m_sqes = ring_map(m_fd, m_sqes_size, IORING_OFF_SQES);
+
+      if (!m_sq_map || !m_cq_map || !m_sqes)
+      {
+        throw std::runtime_error(std::string("Could not map the io_uring: ") + strerror(errno));
+      }
+
+      m_sq_tail = field(m_sq_map, params.sq_off.tail);
+      m_sq_mask = *field(m_sq_map, params.sq_off.ring_mask);
+      m_sq_array = field(m_sq_map, params.sq_off.array);
+      m_cq_head = field(m_cq_map, params.cq_off.head);
+      m_cq_tail = field(m_cq_map, params.cq_off.tail);
+      m_cq_mask = *field(m_cq_map, params.cq_off.ring_mask);
+      m_cqes = static_cast<uint8_t *>(m_cq_map) + params.cq_off.cqes;
+
+      void *buffers = mmap(nullptr, static_cast<size_t>(depth) * m_chunk_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+      if (buffers == MAP_FAILED)
+      {
+        throw std::runtime_error(std::string("Could not allocate io_uring buffers: ") + strerror(errno));
+      }
+
+      m_buffers = static_cast<uint8_t *>(buffers);
+
+      //  Registering pins the buffers, which the locked memory limit may not allow. They
+      //  still work unregistered, only with a little more work in the kernel per request.
+      std::vector<iovec> iovecs(depth);
+
+      for (uint32_t i = 0; i < depth; i++)
+      {
+        iovecs[i].iov_base = m_buffers + static_cast<size_t>(i) * m_chunk_size;
+        iovecs[i].iov_len = m_chunk_size;
+      }
+
+      m_fixed = ring_register(m_fd, IORING_REGISTER_BUFFERS, iovecs.data(), depth) == 0;
+      stats::add_syscalls();
+    }
+    catch (...)
+    {
+      release();
+      throw;
+    }
+
+    for (uint32_t i = depth; i > 0; i--)
+    {
+      m_free.push_back(i - 1);
+    }
+  }
+
+  CopyRing::~CopyRing()
+  {
+    //  Whoever owns the callbacks may already be gone, so only let the kernel finish with the buffers
+    for (auto& slot : m_slots)
+    {
+      slot.copy.data = nullptr;
+      slot.copy.done = nullptr;
+    }
+
+    try
+    {
+      while (m_free.size() < m_slots.size())
+      {
+        submit(1);
+        reap();
+      }
+    }
+    catch (...)
+    {
+    }
+
+    release();
+  }
+
+  /*
+    Summary:
+      Starts a copy as soon as a buffer is free. Copies of nothing finish straight away.
+
+    Parameters:
+      copy: Range to copy and what to do with it
+  */
+  void CopyRing::add(Copy copy)
+  {
+    while (m_free.empty())
+    {
+      submit(1);
+      reap();
+    }
+
+    uint32_t index = m_free.back();
+    m_free.pop_back();
+
+    Slot& slot = m_slots[index];
+    slot.copy = std::move(copy);
+    slot.copied = 0;
+    slot.step = Step::Reading;
+
+    if (slot.copy.count == 0)
+    {
+      finish(index, nullptr);
+      return;
+    }
+
+    queue(index);
+
+    if (m_unsubmitted >= SubmitBatch)
+    {
+      submit(0);
+    }
+  }
+
+  /*
+    Summary:
+      Waits for every copy to finish and rethrows the first error any of them had
+  */
+  void CopyRing::wait()
+  {
+    while (m_free.size() < m_slots.size())
+    {
+      submit(1);
+      reap();
+    }
+
+    if (m_error)
+    {
+      std::exception_ptr error = m_error;
+      m_error = nullptr;
+      std::rethrow_exception(error);
+    }
+  }
+
+  //  Queues the next read or write of a slot at the tail of the submission ring
+  void CopyRing::queue(uint32_t index)
+  {
+    Slot& slot = m_slots[index];
+    uint8_t *buffer = m_buffers + static_cast<size_t>(index) * m_chunk_size;
+
+    uint32_t tail = *m_sq_tail;
+    uint32_t position = tail & m_sq_mask;
+    io_uring_sqe *sqe = static_cast<io_uring_sqe *>(m_sqes) + position;
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->user_data = index;
+
+    if (slot.step == Step::Reading)
+    {
+      sqe->opcode = m_fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+      sqe->fd = slot.copy.in_fd;
+      sqe->off = slot.copy.in_offset + slot.copied;
+      sqe->addr = reinterpret_cast<uint64_t>(buffer);
+      sqe->len = static_cast<uint32_t>(std::min<uint64_t>(slot.copy.count - slot.copied, m_chunk_size));
+    }
+    else
+    {
+      sqe->opcode = m_fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+      sqe->fd = slot.copy.out_fd;
+      sqe->off = slot.copy.out_offset + slot.copied + slot.written;
+      sqe->addr = reinterpret_cast<uint64_t>(buffer + slot.written);
+      sqe->len = slot.length - slot.written;
+    }
+
+    if (m_fixed)
+    {
+      sqe->buf_index = static_cast<uint16_t>(index);
+    }
+
+    m_sq_array[position] = position;
+    __atomic_store_n(m_sq_tail, tail + 1, __ATOMIC_RELEASE);
+    m_unsubmitted++;
+  }
+
+  //  Moves a slot on once its read or write has completed
+  void CopyRing::complete(uint32_t index, int32_t result)
+  {
+    Slot& slot = m_slots[index];
+
+    try
+    {
+      //  Interrupted requests are simply asked for again
+      if (result == -EINTR || result == -EAGAIN)
+      {
+        queue(index);
+        return;
+      }
+
+      if (slot.step == Step::Reading)
+      {
+        if (result < 0)
+        {
+          throw std::runtime_error("Could not read " + slot.copy.path + ": " + strerror(-result));
+        }
+
+        stats::add_read(result);
+
+        //  The input ended before count
+        if (result == 0)
+        {
+          finish(index, nullptr);
+          return;
+        }
+
+        slot.length = static_cast<uint32_t>(result);
+        slot.written = 0;
+
+        if (slot.copy.data)
+        {
+          slot.copy.data(std::span<const uint8_t>(m_buffers + static_cast<size_t>(index) * m_chunk_size, slot.length));
+        }
+
+        slot.step = Step::Writing;
+        queue(index);
+        return;
+      }
+
+      if (result <= 0)
+      {
+        throw std::runtime_error("Could not write " + slot.copy.path + ": " + strerror(result < 0 ? -result : ENOSPC));
+      }
+
+      stats::add_write(result);
+      slot.written += static_cast<uint32_t>(result);
+
+      if (slot.written < slot.length)
+      {
+        queue(index);
+        return;
+      }
+
+      slot.copied += slot.length;
+
+      if (slot.copied == slot.copy.count)
+      {
+        finish(index, nullptr);
+        return;
+      }
+
+      slot.step = Step::Reading;
+      queue(index);
+    }
+    catch (...)
+    {
+      finish(index, std::current_exception());
+    }
+  }
+
+  //  Closes whatever the copy owns, reports it done and frees its buffer
+  void CopyRing::finish(uint32_t index, std::exception_ptr error)
+  {
+    Slot& slot = m_slots[index];
+
+    if (slot.copy.owns_in)
+    {
+      ::close(slot.copy.in_fd);
+      stats::add_syscalls();
+    }
+
+    if (slot.copy.owns_out)
+    {
+      stats::add_syscalls();
+
+      if (::close(slot.copy.out_fd) != 0 && !error)
+      {
+        error = std::make_exception_ptr(std::runtime_error("Could not close " + slot.copy.path + ": " + strerror(errno)));
+      }
+    }
+
+    if (!error && slot.copy.done)
+    {
+      try
+      {
+        slot.copy.done(slot.copied);
+      }
+      catch (...)
+      {
+        error = std::current_exception();
+      }
+    }
+
+    if (error && !m_error)
+    {
+      m_error = error;
+    }
+
+    slot.copy = Copy();
+    slot.step = Step::Idle;
+    m_free.push_back(index);
+  }
+
+  //  Hands queued requests to the kernel and waits for wait_for of them to complete
+  void CopyRing::submit(uint32_t wait_for)
+  {
+    while (true)
+    {
+      int result = ring_enter(m_fd, m_unsubmitted, wait_for);
+      stats::add_syscalls();
+
+      if (result >= 0)
+      {
+        m_unsubmitted -= std::min<uint32_t>(m_unsubmitted, static_cast<uint32_t>(result));
+        return;
+      }
+
+      if (errno != EINTR)
+      {
+        throw std::runtime_error(std::string("Could not submit to the io_uring: ") + strerror(errno));
+      }
+    }
+  }
+
+  //  Handles every completion waiting in the completion ring
+  void CopyRing::reap()
+  {
+    uint32_t head = *m_cq_head;
+    uint32_t tail = __atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE);
+
+    while (head != tail)
+    {
+      io_uring_cqe cqe = static_cast<io_uring_cqe *>(m_cqes)[head & m_cq_mask];
+      head++;
+      __atomic_store_n(m_cq_head, head, __ATOMIC_RELEASE);
+
+      complete(static_cast<uint32_t>(cqe.user_data), cqe.res);
+    }
+  }
+
+  void CopyRing::release()
+  {
+    if (m_buffers)
+    {
+      munmap(m_buffers, m_slots.size() * m_chunk_size);
+    }
+
+    if (m_sqes)
+    {
+      munmap(m_sqes, m_sqes_size);
+    }
+
+    if (m_cq_map && m_cq_map != m_sq_map)
+    {
+      munmap(m_cq_map, m_cq_map_size);
+    }
+
+    if (m_sq_map)
+    {
+      munmap(m_sq_map, m_sq_map_size);
+    }
+
+    if (m_fd >= 0)
+    {
+      ::close(m_fd);
+    }
+
+    m_buffers = nullptr;
+    m_sqes = nullptr;
+    m_cq_map = nullptr;
+    m_sq_map = nullptr;
+    m_fd = -1;
+  }
+
+  /*
+    Summary:
+      Checks whether the running kernel lets this process set up an io_uring that can read and
+      write files. It can be missing on older kernels or blocked by a container's seccomp
+      policy, and kernels before 5.6 have a ring without the reads and writes a copy needs.
+  */
+  bool CopyRing::available()
+  {
+    static const bool result = []()
+    {
+      io_uring_params params;
+      memset(&params, 0, sizeof(params));
+
+      int fd = ring_setup(1, &params);
+
+      if (fd < 0)
+      {
+        return false;
+      }
+
+      bool ret = supports_copies(fd);
+      ::close(fd);
+      return ret;
+    }();
+
+    return result;
+  }
+#else
+  CopyRing::CopyRing(uint32_t, uint32_t)
+  {
+    throw std::runtime_error("io_uring is not available on this system");
+  }
+
+  CopyRing::~CopyRing()
+  {
+  }
+
+  void CopyRing::add(Copy)
+  {
+  }
+
+  void CopyRing::wait()
+  {
+  }
+
+  bool CopyRing::available()
+  {
+    return false;
+  }
+#endif
+}
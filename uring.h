@@ -0,0 +1,109 @@
+#ifndef _URING_H
+#define _URING_H
+
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <span>
+#include <string>
+#include <vector>
+
+namespace util
+{
+  //  Number of copies a CopyRing keeps in flight unless told otherwise
+  const uint32_t DefaultQueueDepth = 64;
+
+  //  Size of each copy's buffer in a CopyRing
+  const uint32_t RingChunkSize = 0x20000;
+
+  /*
+    Summary:
+      Copies byte ranges between open files through a Linux io_uring from a single thread.
+      Every copy in flight owns one buffer and moves through it a chunk at a time, reading
+      and then writing, so up to depth reads and writes are queued at the device at once
+      without a thread for each. The buffers are registered with the kernel when it allows
+      it so they are not mapped again for every request.
+
+      add only blocks while every buffer is in use. The first error from a copy or one of
+      its callbacks is rethrown from wait, once every other copy has finished.
+  */
+  struct CopyRing
+  {
+    //  One range to copy. Callbacks run on the thread calling add or wait.
+    struct Copy
+    {
+      std::string path;                                               //  Named in error messages
+      int in_fd;
+      uint64_t in_offset;
+      int out_fd;
+      uint64_t out_offset;
+      uint64_t count;
+      bool owns_in = false;                                           //  Close in_fd once the copy ends
+      bool owns_out = false;                                          //  Close out_fd once the copy ends
+      std::function<void(std::span<const uint8_t>)> data = nullptr;   //  Sees each chunk in order as it is read
+      std::function<void(uint64_t)> done = nullptr;                   //  Gets the bytes copied, less than count if the input ended early
+    };
+
+    CopyRing(uint32_t depth = DefaultQueueDepth, uint32_t chunk_size = RingChunkSize);
+    ~CopyRing();
+
+    CopyRing(const CopyRing&) = delete;
+    CopyRing& operator=(const CopyRing&) = delete;
+
+    void add(Copy copy);
+    void wait();
+
+    static bool available();
+  private:
+    enum class Step
+    {
+      Idle,
+      Reading,
+      Writing
+    };
+
+    struct Slot
+    {
+      Copy copy;
+      Step step = Step::Idle;
+      uint64_t copied = 0;    //  Bytes of the copy written so far
+      uint32_t length = 0;    //  Bytes of the current chunk in the buffer
+      uint32_t written = 0;   //  Bytes of the current chunk written so far
+    };
+
+    int m_fd;
+    uint32_t m_chunk_size;
+    bool m_fixed;           //  Buffers are registered with the kernel
+
+    //  Shared ring memory
+    void *m_sq_map;
+    size_t m_sq_map_size;
+    void *m_cq_map;
+    size_t m_cq_map_size;
+    void *m_sqes;
+    size_t m_sqes_size;
+
+    uint32_t *m_sq_tail;
+    uint32_t m_sq_mask;
+    uint32_t *m_sq_array;
+    uint32_t *m_cq_head;
+    uint32_t *m_cq_tail;
+    uint32_t m_cq_mask;
+    void *m_cqes;
+
+    uint8_t *m_buffers;
+    std::vector<Slot> m_slots;
+    std::vector<uint32_t> m_free;
+    uint32_t m_unsubmitted;
+    std::exception_ptr m_error;
+
+    void queue(uint32_t slot);
+    void complete(uint32_t slot, int32_t result);
+    void finish(uint32_t slot, std::exception_ptr error);
+    void submit(uint32_t wait_for);
+    void reap();
+    void release();
+  };
+}
+
+#endif
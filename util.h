@@ -1,15 +1,46 @@
 #ifndef _UTIL_H
 #define _UTIL_H
 
+#include <cctype>
+#include <cerrno>
 #include <iostream>
 #include <algorithm>
 #include <sstream>
 #include <fstream>
 #include <cstdint>
+#include <limits>
+#include <span>
+#include <string>
+#include <string_view>
+#include <type_traits>
 #include <vector>
 
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "stats.h"
+
 namespace util
 {
+  //  swap_endian taken from StackOverflow
+  //  https://stackoverflow.com/questions/105252
+  template <typename T> T swap_endian(T u)
+  {
+    union
+    {
+      T u;
+      unsigned char u8[sizeof(T)];
+    } source, dest;
+
+    source.u = u;
+
+    for (size_t k = 0; k < sizeof(T); k++)
+      dest.u8[k] = source.u8[sizeof(T)-k - 1];
+
+    return dest.u;
+  }
+
   inline std::vector<uint8_t> read_file(std::string filename, size_t count = std::numeric_limits<size_t>::max(), size_t offset = 0)
   {
     if (count == 0)
@@ -17,48 +48,96 @@ namespace util
       return std::vector<uint8_t>();
     }
 
-    FILE *fp = fopen(filename.c_str(), "rb");
+    int fd = open(filename.c_str(), O_RDONLY);
+    stats::add_syscalls();
 
-    if (!fp)
+    if (fd < 0)
     {
       return std::vector<uint8_t>();
     }
 
-    fseek(fp, 0, SEEK_END);
-    size_t size = ftell(fp);
-    rewind(fp);
+    struct stat st;
+    size_t size = fstat(fd, &st) == 0 ? static_cast<size_t>(st.st_size) : 0;
+    stats::add_syscalls();
 
     if (count < size)
     {
       size = count;
     }
 
-    fseek(fp, offset, SEEK_SET);
-
+    //  Anything past the end of the file is left as zeros
     std::vector<uint8_t> ret(size);
-    fread(&ret[0], sizeof(uint8_t), size, fp);
-    fclose(fp);
+    size_t done = 0;
+
+    while (done < size)
+    {
+      ssize_t got = pread(fd, &ret[done], size - done, offset + done);
+      stats::add_read(got > 0 ? got : 0, 1);
+
+      if (got < 0 && errno == EINTR)
+      {
+        continue;
+      }
+
+      if (got <= 0)
+      {
+        break;
+      }
+
+      done += got;
+    }
+
+    close(fd);
+    stats::add_syscalls();
 
     return ret;
   }
 
-  inline void write_file(std::string filename, std::vector<uint8_t>& data, uint32_t count = 0)
+  inline void write_file(std::string filename, std::span<const uint8_t> data, uint32_t count = 0)
   {
-    FILE *fp = fopen(filename.c_str(), "wb");
+    int fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    stats::add_syscalls();
 
-    if (fp && (data.size() > 0))
+    if (fd < 0)
     {
-      fwrite(&data[0], sizeof(data[0]), count ? count : data.size(), fp);
+      return;
     }
 
-    fclose(fp);
+    size_t size = (count && count < data.size()) ? count : data.size();
+    size_t done = 0;
+
+    while (done < size)
+    {
+      ssize_t wrote = write(fd, &data[done], size - done);
+      stats::add_write(wrote > 0 ? wrote : 0, 1);
+
+      if (wrote < 0 && errno == EINTR)
+      {
+        continue;
+      }
+
+      if (wrote <= 0)
+      {
+        break;
+      }
+
+      done += wrote;
+    }
+
+    close(fd);
+    stats::add_syscalls();
   }
 
-  inline void append_file(std::string filename, std::vector<uint8_t>& data, uint32_t count = 0, uint32_t offset = 0)
+  inline void append_file(std::string filename, std::span<const uint8_t> data, uint32_t count = 0, uint32_t offset = 0)
   {
     FILE *fp = fopen(filename.c_str(), "rb+");
 
-    if (fp && (data.size() > 0))
+    if (!fp)
+    {
+      return;
+    }
+
+    if (data.size() > 0)
     {
       if (offset > 0)
       {
@@ -69,19 +148,20 @@ namespace util
         fseek(fp, 0, SEEK_END);
       }
 
-      fwrite(&data[0], sizeof(data[0]), count ? count : data.size(), fp);
+      fwrite(&data[0], sizeof(data[0]), (count && count < data.size()) ? count : data.size(), fp);
 
+      //  Pad the rest of count with zeros
       if (count > data.size())
       {
-        char temp = 0;
-        fwrite(&temp, 1, count - data.size(), fp);
+        std::vector<uint8_t> zeros(count - data.size());
+        fwrite(&zeros[0], 1, zeros.size(), fp);
       }
     }
 
     fclose(fp);
   }
 
-  template <typename T> inline T read(std::vector<uint8_t>& data, uint32_t offset = 0)
+  template <typename T> inline T read(std::span<const uint8_t> data, size_t offset = 0)
   {
     static_assert(std::is_integral<T>::value, "Value must be an integral type.");
     T ret = 0;
@@ -95,7 +175,7 @@ namespace util
     return ret;
   }
 
-  template <typename T> inline T read_big(std::vector<uint8_t>& data, uint32_t offset = 0)
+  template <typename T> inline T read_big(std::span<const uint8_t> data, size_t offset = 0)
   {
     static_assert(std::is_integral<T>::value, "Value must be an integral type.");
     T ret = 0;
@@ -109,33 +189,25 @@ namespace util
     return ret;
   }
 
-  template <typename T> inline T read_big(std::string file, uint32_t offset = 0)
+  template <typename T> inline void write_big(std::span<uint8_t> data, size_t offset, T val)
   {
     static_assert(std::is_integral<T>::value, "Value must be an integral type.");
-    T ret = 0;
 
-    FILE *fp = fopen(file.c_str(), "rb");
-
-    if (!fp)
+    for (int32_t i = sizeof(T)-1; i >= 0; i--)
     {
-      return -1;
+      data[i + offset] = static_cast<uint8_t>(val & 0xFF);
+      val >>= 8;
     }
-
-    fseek(fp, offset, SEEK_SET);
-    fread(&ret, sizeof(T), 1, fp);
-    fclose(fp);
-
-    return swap_endian<T>(ret);
   }
 
-  inline std::string read(std::vector<uint8_t>& data, uint32_t offset, size_t size = 0)
+  inline std::string read(std::span<const uint8_t> data, size_t offset, size_t size = 0)
   {
-    uint32_t length = size;
+    size_t length = size;
 
     //  If length is 0 then try to find the next null
     if (size == 0)
     {
-      while (data[offset + length] != '\0' && offset + length < data.size())
+      while (offset + length < data.size() && data[offset + length] != '\0')
       {
         length++;
       }
@@ -146,35 +218,6 @@ namespace util
     return ret;
   }
 
-  inline std::string read(std::string& file, uint32_t offset, size_t size = 0)
-  {
-    std::string ret;
-    uint32_t length = size;
-
-    FILE *fp = fopen(file.c_str(), "rb");
-
-    if (!fp)
-    {
-      return ret;
-    }
-
-    fseek(fp, offset, SEEK_SET);
-
-    if (size == 0)
-    {
-      fgets(&ret[0], ret.max_size(), fp);
-    }
-    else
-    {
-      ret.resize(size);
-      fread(&ret[0], 1, size, fp);
-    }
-
-    fclose(fp);
-
-    return ret;
-  }
-
   /*
   Implementation taken from the following link:
   http://programmingknowledgeblog.blogspot.com/2013/04/the-most-elegant-way-to-split-string-in.html
@@ -212,10 +255,53 @@ namespace util
     return result;
   }
 
+  /*
+    Summary:
+      Matches text against a glob pattern where * matches any run of characters and ? matches
+      any single character
+  */
+  inline bool glob_match(std::string_view pattern, std::string_view text)
+  {
+    size_t p = 0, t = 0;
+    size_t star = std::string_view::npos, retry = 0;
+
+    while (t < text.size())
+    {
+      if (p < pattern.size() && (pattern[p] == '?' || pattern[p] == text[t]))
+      {
+        p++;
+        t++;
+      }
+      else if (p < pattern.size() && pattern[p] == '*')
+      {
+        //  Remember the star and first try matching nothing with it
+        star = p++;
+        retry = t;
+      }
+      else if (star != std::string_view::npos)
+      {
+        //  Let the last star swallow one more character
+        p = star + 1;
+        t = ++retry;
+      }
+      else
+      {
+        return false;
+      }
+    }
+
+    while (p < pattern.size() && pattern[p] == '*')
+    {
+      p++;
+    }
+
+    return p == pattern.size();
+  }
+
   inline uint32_t to_int32(const std::string& str)
   {
     std::istringstream iss;
-    uint32_t value;
+    uint32_t value = 0;
 
     iss.str(str);
     iss >> value;
@@ -223,22 +309,98 @@ namespace util
     return value;
   }
 
-  //  swap_endian taken from StackOverflow
-  //  https://stackoverflow.com/questions/105252
-  template <typename T> T swap_endian(T u)
+  /*
+    Summary:
+      Parses a byte count with an optional K, M or G suffix
+
+    Returns:
+      The number of bytes, or 0 if the value is not valid
+  */
+  inline uint64_t parse_size(std::string value)
   {
-    union
+    uint64_t scale = 1;
+
+    if (!value.empty())
     {
-      T u;
-      unsigned char u8[sizeof(T)];
-    } source, dest;
+      switch (toupper(value.back()))
+      {
+        case 'K': scale = 1ull << 10; break;
+        case 'M': scale = 1ull << 20; break;
+        case 'G': scale = 1ull << 30; break;
+      }
 
-    source.u = u;
+      if (scale > 1)
+      {
+        value.pop_back();
+      }
+    }
 
-    for (size_t k = 0; k < sizeof(T); k++)
-      dest.u8[k] = source.u8[sizeof(T)-k - 1];
+    if (value.empty() || value.find_first_not_of("0123456789") != std::string::npos)
+    {
+      return 0;
+    }
 
-    return dest.u;
+    return std::stoull(value) * scale;
+  }
+
+  /*
+    Summary:
+      Splits a line into words the way a shell does for simple command lines. Words are
+      separated by spaces or tabs and double quotes keep spaces inside a word. A backslash
+      before a quote or another backslash takes that character as it is, and any other
+      backslash is kept so Windows paths need no escaping.
+
+    Returns:
+      The words of the line, or nothing if a quote is left open
+  */
+  inline std::vector<std::string> split_args(const std::string& line)
+  {
+    std::vector<std::string> words;
+    std::string word;
+    bool in_word = false;
+    bool quoted = false;
+
+    for (size_t i = 0; i < line.size(); i++)
+    {
+      char c = line[i];
+
+      if (c == '\\' && i + 1 < line.size() && (line[i + 1] == '"' || line[i + 1] == '\\'))
+      {
+        word += line[++i];
+        in_word = true;
+      }
+      else if (c == '"')
+      {
+        quoted = !quoted;
+        in_word = true;
+      }
+      else if (!quoted && (c == ' ' || c == '\t' || c == '\r' || c == '\n'))
+      {
+        if (in_word)
+        {
+          words.push_back(word);
+          word.clear();
+          in_word = false;
+        }
+      }
+      else
+      {
+        word += c;
+        in_word = true;
+      }
+    }
+
+    if (quoted)
+    {
+      return std::vector<std::string>();
+    }
+
+    if (in_word)
+    {
+      words.push_back(word);
+    }
+
+    return words;
   }
 
   template<typename T> inline T rol(T x, uint32_t n)